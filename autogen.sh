@@ -14,18 +14,18 @@ PACKAGE_VERSION_MICRO="0"
 PACKAGE_VERSION="$PACKAGE_VERSION_MAJOR.$PACKAGE_VERSION_MINOR.$PACKAGE_VERSION_MICRO"
 
 # binaries/libraries to install
-PACKAGE_BINS=""
-PACKAGE_LIBS="libddebug"
+PACKAGE_BINS="ddtop"
+PACKAGE_LIBS="libddebug libddebug_preload"
 
 # get build number
 PACKAGE_BUILD=`cat debian/build`
 
 # libraries to be checked using pkgconfig
 PKGLIBSADD=""
-LIBSADD="pthread:pthread_create"
+LIBSADD="pthread:pthread_create m:log"
 
 # include headers when making package
-PACKAGE_HEADERS="debuglib.h strlens.h debug.h dlog.h synchro.h system.h cpuinfo.h filechange.h array3.h linkedlist.h dio.h"
+PACKAGE_HEADERS="debuglib.h strlens.h debug.h dlog.h synchro.h system.h cpuinfo.h filechange.h array3.h linkedlist.h dio.h ptrtable.h sitestats.h stacktab.h heapprof.h ddmalloc.h arena.h pool.h guard.h memtag.h resgauge.h ddclock.h histogram.h profile.h cputime.h perfctr.h cpuprof.h metrics.h shmstats.h ddthread.h watchdog.h ddshard.h ddslots.h"
 
 
 #
@@ -68,6 +68,16 @@ if test x\$debug == xyes ; then
 	CFLAGS=\"-g -O0 \$CFLAGS\"
 fi
 AC_MSG_RESULT([\$debug])
+
+AC_ARG_ENABLE([ddmalloc],
+              AC_HELP_STRING([--enable-ddmalloc], [Use slab allocator behind rec_malloc() (default NO)]),
+              [ddmalloc=[yes]], [ddmalloc=[no]])
+
+AC_MSG_CHECKING([slab allocator for rec_malloc])
+if test x\$ddmalloc == xyes ; then
+	AC_DEFINE(_DD_MALLOC, 1, [Slab allocator behind rec_malloc])
+fi
+AC_MSG_RESULT([\$ddmalloc])
 " >> $CONFIG
 
 echo "
@@ -80,6 +90,7 @@ AC_OUTPUT
 echo \"
 Configuration for \$PACKAGE_NAME \$PACKAGE_VERSION:
   debug mode:			\$debug
+  slab allocator:		\$ddmalloc
 \"
 " >> $CONFIG
 
@@ -0,0 +1,303 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+/**
+ * Round chunk offset up so that next allocation in fast path is aligned.
+ * Chunk sizes are rounded the same way, so offset stays within chunk.
+ */
+static __inline__ size_t dd_arena_round(size_t used)
+{
+	return (used + DD_ARENA_ALIGN - 1) & ~(size_t)(DD_ARENA_ALIGN - 1);
+}
+
+
+/******************************************************************************/
+static struct dd_arena_chunk *dd_arena_chunk_new(size_t size)
+{
+	struct dd_arena_chunk *c;
+
+	if (size > (size_t)-1 - sizeof(*c) - DD_ARENA_ALIGN)
+	{
+		return NULL;
+	}
+	size = dd_arena_round(size);
+	c = malloc(sizeof(*c) + size);
+	if (!c)
+	{
+		return NULL;
+	}
+	c->prev = NULL;
+	c->size = size;
+	c->used = 0;
+	c->base = 0;
+
+	return c;
+}
+
+
+/******************************************************************************/
+/**
+ * Bytes used now. Usage only drops when arena is rewound or reset, so
+ * updating peak there and when a chunk fills up is enough.
+ */
+static __inline__ size_t dd_arena_update_peak(struct dd_arena *a)
+{
+	size_t used = a->chunk->base + a->chunk->used;
+
+	if (used > a->peak)
+	{
+		a->peak = used;
+	}
+
+	return used;
+}
+
+
+/******************************************************************************/
+/**
+ * Create new arena.
+ *
+ * @param chunk_size size of chunks, 0 for DD_ARENA_CHUNK
+ * @return arena or NULL on errors
+ */
+struct dd_arena *dd_arena_create(size_t chunk_size)
+{
+	struct dd_arena *a;
+
+	a = malloc(sizeof(*a));
+	if (!a)
+	{
+		return NULL;
+	}
+	memset(a, 0, sizeof(*a));
+	a->chunk_size = chunk_size ? chunk_size : DD_ARENA_CHUNK;
+	a->chunk = dd_arena_chunk_new(a->chunk_size);
+	if (!a->chunk)
+	{
+		free(a);
+		return NULL;
+	}
+	a->chunks = 1;
+	rec_alloc("arena", a);
+
+	return a;
+}
+
+
+/******************************************************************************/
+/**
+ * Free all memory of arena.
+ */
+void dd_arena_destroy(struct dd_arena *a)
+{
+	struct dd_arena_chunk *c, *prev;
+
+	if (!a)
+	{
+		return;
+	}
+
+#ifdef _DEBUG_REC
+	{
+		char str[REC_TEXT_SIZE];
+		dd_arena_update_peak(a);
+		snprintf(str, sizeof(str), "peak %lu bytes, %lu chunks",
+		         (unsigned long)a->peak, (unsigned long)a->chunks);
+		rec_add("arena", str, a, __FILE__, __LINE__);
+	}
+#endif
+	rec_free("arena", a);
+
+	for (c = a->chunk; c; c = prev)
+	{
+		prev = c->prev;
+		free(c);
+	}
+	free(a);
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of dd_arena_alloc(): allocation does not fit into current
+ * chunk or needs other alignment.
+ *
+ * @param size number of bytes
+ * @param align alignment, power of two
+ * @return pointer to memory or NULL on errors
+ */
+void *dd_arena_alloc_chunk(struct dd_arena *a, size_t size, size_t align)
+{
+	struct dd_arena_chunk *c = a->chunk;
+	uintptr_t p;
+	size_t need;
+
+	if (align < DD_ARENA_ALIGN)
+	{
+		align = DD_ARENA_ALIGN;
+	}
+	if (size > (size_t)-1 - align)
+	{
+		return NULL;
+	}
+
+	p = ((uintptr_t)(c->data + c->used) + align - 1) & ~(uintptr_t)(align - 1);
+	if (p + size <= (uintptr_t)(c->data + c->size))
+	{
+		c->used = dd_arena_round(p + size - (uintptr_t)c->data);
+		return (void *)p;
+	}
+
+	/* Start new chunk, rest of current one is left unused. */
+	need = size + align - DD_ARENA_ALIGN;
+	c = dd_arena_chunk_new(need > a->chunk_size ? need : a->chunk_size);
+	if (!c)
+	{
+		return NULL;
+	}
+	dd_arena_update_peak(a);
+	c->base = a->chunk->base + a->chunk->used;
+	c->prev = a->chunk;
+	a->chunk = c;
+	a->chunks++;
+
+	p = ((uintptr_t)c->data + align - 1) & ~(uintptr_t)(align - 1);
+	c->used = dd_arena_round(p + size - (uintptr_t)c->data);
+
+	return (void *)p;
+}
+
+
+/******************************************************************************/
+/**
+ * Allocate aligned memory from arena.
+ *
+ * @param size number of bytes
+ * @param align alignment, power of two
+ * @return pointer to memory or NULL on errors
+ */
+void *dd_arena_alloc_aligned(struct dd_arena *a, size_t size, size_t align)
+{
+	if ((align & (align - 1)) != 0)
+	{
+		return NULL;
+	}
+	return dd_arena_alloc_chunk(a, size, align);
+}
+
+
+/******************************************************************************/
+/**
+ * Copy string into arena.
+ *
+ * @return copy or NULL on errors
+ */
+char *dd_arena_strdup(struct dd_arena *a, const char *str)
+{
+	size_t n = strlen(str) + 1;
+	char *p;
+
+	p = dd_arena_alloc(a, n);
+	if (p)
+	{
+		memcpy(p, str, n);
+	}
+
+	return p;
+}
+
+
+/******************************************************************************/
+/**
+ * Save current position of arena.
+ */
+void dd_arena_mark(struct dd_arena *a, struct dd_arena_mark *mark)
+{
+	mark->chunk = a->chunk;
+	mark->used = a->chunk->used;
+}
+
+
+/******************************************************************************/
+/**
+ * Release everything allocated after mark was saved. Chunks started
+ * after the mark are freed.
+ */
+void dd_arena_rewind(struct dd_arena *a, const struct dd_arena_mark *mark)
+{
+	struct dd_arena_chunk *c;
+
+	dd_arena_update_peak(a);
+	while (a->chunk != mark->chunk && a->chunk->prev)
+	{
+		c = a->chunk;
+		a->chunk = c->prev;
+		a->chunks--;
+		free(c);
+	}
+	if (a->chunk == mark->chunk && mark->used < a->chunk->used)
+	{
+		a->chunk->used = mark->used;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Release everything allocated from arena. First chunk is kept for
+ * reuse, all others are freed.
+ */
+void dd_arena_reset(struct dd_arena *a)
+{
+	struct dd_arena_chunk *c;
+
+	dd_arena_update_peak(a);
+	while (a->chunk->prev)
+	{
+		c = a->chunk;
+		a->chunk = c->prev;
+		free(c);
+	}
+	a->chunk->used = 0;
+	a->chunks = 1;
+}
+
+
+/******************************************************************************/
+/**
+ * @return number of bytes allocated from arena now, including padding
+ */
+size_t dd_arena_used(struct dd_arena *a)
+{
+	return a->chunk->base + a->chunk->used;
+}
+
+
+/******************************************************************************/
+/**
+ * @return highest number of bytes allocated from arena at once
+ */
+size_t dd_arena_peak(struct dd_arena *a)
+{
+	dd_arena_update_peak(a);
+	return a->peak;
+}
+
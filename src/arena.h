@@ -0,0 +1,97 @@
+/*
+ * DDebuglib
+ *
+ * Arena allocator: memory is bump allocated from chained chunks and
+ * released all at once.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default size of one chunk. */
+#define DD_ARENA_CHUNK (64 * 1024)
+
+/** Default alignment of allocations. */
+#define DD_ARENA_ALIGN 16
+
+/** One chunk of arena. */
+struct dd_arena_chunk
+{
+	struct dd_arena_chunk *prev;
+	size_t size;
+	size_t used;
+	/** Bytes used in chunks before this one. */
+	size_t base;
+	char data[] __attribute__((aligned(DD_ARENA_ALIGN)));
+};
+
+/** Arena, always has at least one chunk. */
+struct dd_arena
+{
+	/** Chunk allocations are made from, older ones are linked behind it. */
+	struct dd_arena_chunk *chunk;
+	/** Size of new chunks. */
+	size_t chunk_size;
+	/** Highest number of bytes used at once. */
+	size_t peak;
+	/** Number of chunks. */
+	size_t chunks;
+};
+
+/** Position in arena saved by dd_arena_mark(). */
+struct dd_arena_mark
+{
+	struct dd_arena_chunk *chunk;
+	size_t used;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+struct dd_arena *dd_arena_create(size_t);
+void dd_arena_destroy(struct dd_arena *);
+void *dd_arena_alloc_chunk(struct dd_arena *, size_t, size_t);
+void *dd_arena_alloc_aligned(struct dd_arena *, size_t, size_t);
+char *dd_arena_strdup(struct dd_arena *, const char *);
+void dd_arena_mark(struct dd_arena *, struct dd_arena_mark *);
+void dd_arena_rewind(struct dd_arena *, const struct dd_arena_mark *);
+void dd_arena_reset(struct dd_arena *);
+size_t dd_arena_used(struct dd_arena *);
+size_t dd_arena_peak(struct dd_arena *);
+
+/**
+ * Allocate memory from arena, aligned to DD_ARENA_ALIGN bytes. Memory is
+ * not cleared and is valid until arena is reset, rewound or destroyed.
+ *
+ * @return pointer to memory or NULL on errors
+ */
+static __inline__ void *dd_arena_alloc(struct dd_arena *a, size_t size)
+{
+	struct dd_arena_chunk *c = a->chunk;
+	size_t n = (size + DD_ARENA_ALIGN - 1) & ~(size_t)(DD_ARENA_ALIGN - 1);
+
+	if (__builtin_expect(n >= size && c->size - c->used >= n, 1))
+	{
+		void *p = c->data + c->used;
+		c->used += n;
+		return p;
+	}
+	return dd_arena_alloc_chunk(a, size, DD_ARENA_ALIGN);
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -8,6 +8,9 @@
 /******************************************************************************/
 /* INCLUDES */
 #include "cpuinfo.h"
+#if defined(__GNUC__) && (defined(i386) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
 
 
 /******************************************************************************/
@@ -274,3 +277,35 @@ int cpuinfo_has_sse2(void)
     return 0;
 }
 
+int cpuinfo_has_rdtsc(void)
+{
+    return CPU_haveRDTSC() != 0;
+}
+
+int cpuinfo_has_rdtscp(void)
+{
+    if (CPU_haveCPUID())
+    {
+        return (CPU_getCPUIDFeaturesExt() & 0x08000000) != 0;
+    }
+    return 0;
+}
+
+/*
+ * Invariant TSC runs at constant rate in all power states, so it can be
+ * used as clock source. Reported in extended function 80000007h.
+ */
+int cpuinfo_has_invariant_tsc(void)
+{
+#if defined(__GNUC__) && (defined(i386) || defined(__x86_64__))
+    unsigned int eax, ebx, ecx, edx;
+
+    if (CPU_haveCPUID() && __get_cpuid_max(0x80000000, 0) >= 0x80000007 &&
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    {
+        return (edx & 0x00000100) != 0;
+    }
+#endif
+    return 0;
+}
+
@@ -17,6 +17,9 @@
 int cpuinfo_has_mmx(void);
 int cpuinfo_has_sse(void);
 int cpuinfo_has_sse2(void);
+int cpuinfo_has_rdtsc(void);
+int cpuinfo_has_rdtscp(void);
+int cpuinfo_has_invariant_tsc(void);
 
 
 #endif /* END OF HEADER FILE */
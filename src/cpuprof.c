@@ -0,0 +1,587 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "cpuprof.h"
+#include "stacktab.h"
+#include "ddthread.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/** CPU time clock of any thread of this process, as in glibc. */
+#define DD_PROF_THREAD_CLOCK(tid) ((~(clockid_t)(tid) << 3) | 6)
+
+/** Number of stack counters in one block. */
+#define DD_PROF_BLOCK 4096
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/*
+ * Threads are found from /proc/self/task by the collector thread, which
+ * creates the sample buffer and timer of each thread. Signal handler
+ * finds buffer of its thread by thread id from an open addressing table
+ * that only the collector writes to. Each buffer has one writer, the
+ * thread itself in signal handler, and one reader, the collector.
+ */
+
+static struct dd_prof_thread dd_prof_threads[DD_PROF_THREADS];
+
+/** Stacks and sample counts of each stack id. */
+static struct stacktab dd_prof_stacks;
+static uint64_t *dd_prof_counts[(STACKTAB_SLOTS / 4 * 3) / DD_PROF_BLOCK + 1];
+static uint64_t dd_prof_samples = 0;
+static uint64_t dd_prof_dropped = 0;
+
+/** Protects stacks, counts and thread table against collector. */
+static pthread_mutex_t dd_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int dd_prof_hz = 0;
+static int dd_prof_run = 0;
+static int dd_prof_handler_set = 0;
+static pid_t dd_prof_collector_tid = 0;
+static pthread_t dd_prof_collector;
+static pthread_mutex_t dd_prof_collector_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dd_prof_collector_cond;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+/**
+ * Find buffer of thread, safe to call from signal handler.
+ */
+static struct dd_prof_ring *dd_prof_ring_find(pid_t tid)
+{
+	unsigned int i, n;
+	pid_t t;
+
+	for (n = 0, i = (unsigned int)tid; n < DD_PROF_THREADS; n++, i++)
+	{
+		i &= DD_PROF_THREADS - 1;
+		t = __atomic_load_n(&dd_prof_threads[i].tid, __ATOMIC_ACQUIRE);
+		if (t == tid)
+		{
+			return dd_prof_threads[i].ring;
+		}
+		if (t == 0)
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/******************************************************************************/
+static void dd_prof_handler(int sig, siginfo_t *info, void *uc)
+{
+	struct dd_prof_ring *r;
+	uint64_t head;
+	int saved = errno;
+
+	(void)sig;
+	(void)info;
+	r = dd_prof_ring_find((pid_t)syscall(SYS_gettid));
+	if (r)
+	{
+		head = r->head;
+		if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= DD_PROF_RING)
+		{
+			r->dropped++;
+		}
+		else
+		{
+			struct dd_prof_sample *sample = &r->samples[head & (DD_PROF_RING - 1)];
+			sample->depth = stacktab_walk(uc, sample->frames, DD_PROF_DEPTH);
+			__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+	errno = saved;
+}
+
+
+/******************************************************************************/
+/**
+ * Count stack. Lock must be held.
+ */
+static void dd_prof_count(void *const *frames, int depth)
+{
+	uint32_t id = stacktab_intern(&dd_prof_stacks, frames, depth);
+	uint64_t **block = &dd_prof_counts[id / DD_PROF_BLOCK];
+
+	dd_prof_samples++;
+	if (!*block)
+	{
+		void *p = mmap(NULL, DD_PROF_BLOCK * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			return;
+		}
+		*block = p;
+	}
+	(*block)[id % DD_PROF_BLOCK]++;
+}
+
+
+/******************************************************************************/
+/**
+ * Move samples from buffer of thread into counts. Lock must be held.
+ *
+ * Id of registered thread is stored as the outermost frame, so that
+ * same stack is counted separately for each thread. Ids are far below
+ * any code address.
+ */
+static void dd_prof_drain(struct dd_prof_thread *t)
+{
+	struct dd_prof_ring *r = t->ring;
+	uint64_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	struct dd_prof_sample *s;
+	void *frames[STACKTAB_DEPTH];
+	int depth;
+
+	if (!t->thread && tail != head)
+	{
+		t->thread = dd_thread_find_tid(t->tid);
+	}
+	for (; tail != head; tail++)
+	{
+		s = &r->samples[tail & (DD_PROF_RING - 1)];
+		if (!t->thread || s->depth <= 0)
+		{
+			dd_prof_count(s->frames, s->depth);
+			continue;
+		}
+		/* Full stack is already truncated, outermost frame gives way. */
+		depth = s->depth < STACKTAB_DEPTH ? s->depth : STACKTAB_DEPTH - 1;
+		memcpy(frames, s->frames, depth * sizeof(frames[0]));
+		frames[depth++] = (void *)(uintptr_t)t->thread;
+		dd_prof_count(frames, depth);
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	dd_prof_dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Start sampling thread. Lock must be held.
+ */
+static void dd_prof_thread_add(pid_t tid)
+{
+	struct dd_prof_thread *t = NULL;
+	struct dd_prof_ring *r;
+	struct sigevent sev;
+	struct itimerspec its;
+	unsigned int i, n;
+
+	for (n = 0, i = (unsigned int)tid; n < DD_PROF_THREADS; n++, i++)
+	{
+		i &= DD_PROF_THREADS - 1;
+		if (dd_prof_threads[i].tid <= 0)
+		{
+			t = &dd_prof_threads[i];
+			break;
+		}
+	}
+	if (!t)
+	{
+		return;
+	}
+
+	/* Buffers are never released, signal may still be handled while removing thread. */
+	r = t->ring;
+	if (!r)
+	{
+		r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (r == MAP_FAILED)
+		{
+			return;
+		}
+		t->ring = r;
+	}
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = tid;
+	if (timer_create(DD_PROF_THREAD_CLOCK(tid), &sev, &t->timer))
+	{
+		return;
+	}
+	t->seen = 1;
+	t->thread = dd_thread_find_tid(tid);
+	__atomic_store_n(&t->tid, tid, __ATOMIC_RELEASE);
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000000l / dd_prof_hz;
+	its.it_value = its.it_interval;
+	timer_settime(t->timer, 0, &its, NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * Stop sampling thread and collect its last samples. Lock must be held.
+ */
+static void dd_prof_thread_remove(struct dd_prof_thread *t)
+{
+	timer_delete(t->timer);
+	dd_prof_drain(t);
+	/* Leave a tombstone so that lookups of other threads keep probing. */
+	__atomic_store_n(&t->tid, -1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Start sampling new threads, stop sampling exited threads and collect
+ * samples. Lock must be held.
+ */
+static void dd_prof_collect(int scan)
+{
+	struct dirent *de;
+	DIR *dir;
+	pid_t tid;
+	int i;
+
+	if (scan && (dir = opendir("/proc/self/task")) != NULL)
+	{
+		for (i = 0; i < DD_PROF_THREADS; i++)
+		{
+			dd_prof_threads[i].seen = 0;
+		}
+		while ((de = readdir(dir)) != NULL)
+		{
+			tid = (pid_t)atoi(de->d_name);
+			if (tid <= 0 || tid == dd_prof_collector_tid)
+			{
+				continue;
+			}
+			for (i = 0; i < DD_PROF_THREADS && dd_prof_threads[i].tid != tid; i++);
+			if (i < DD_PROF_THREADS)
+			{
+				dd_prof_threads[i].seen = 1;
+			}
+			else
+			{
+				dd_prof_thread_add(tid);
+			}
+		}
+		closedir(dir);
+		for (i = 0; i < DD_PROF_THREADS; i++)
+		{
+			if (dd_prof_threads[i].tid > 0 && !dd_prof_threads[i].seen)
+			{
+				dd_prof_thread_remove(&dd_prof_threads[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < DD_PROF_THREADS; i++)
+	{
+		if (dd_prof_threads[i].tid > 0)
+		{
+			dd_prof_drain(&dd_prof_threads[i]);
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void *dd_prof_collector_thread(void *arg)
+{
+	struct timespec ts;
+	(void)arg;
+
+	dd_prof_collector_tid = (pid_t)syscall(SYS_gettid);
+	pthread_mutex_lock(&dd_prof_collector_lock);
+	while (dd_prof_run)
+	{
+		pthread_mutex_unlock(&dd_prof_collector_lock);
+		pthread_mutex_lock(&dd_prof_lock);
+		dd_prof_collect(1);
+		pthread_mutex_unlock(&dd_prof_lock);
+		pthread_mutex_lock(&dd_prof_collector_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += DD_PROF_INTERVAL * 1000000l;
+		if (ts.tv_nsec >= 1000000000l)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000l;
+		}
+		if (dd_prof_run)
+		{
+			pthread_cond_timedwait(&dd_prof_collector_cond, &dd_prof_collector_lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&dd_prof_collector_lock);
+
+	return NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Start profiling all threads of process. Threads started later are
+ * included within DD_PROF_INTERVAL milliseconds.
+ *
+ * @param hz samples per CPU second of each thread, 0 for DD_PROF_HZ
+ * @return 0 on success, -1 on errors
+ */
+int dd_prof_start(int hz)
+{
+	pthread_condattr_t attr;
+	struct sigaction sa;
+
+	pthread_mutex_lock(&dd_prof_collector_lock);
+	if (dd_prof_run)
+	{
+		pthread_mutex_unlock(&dd_prof_collector_lock);
+		return 0;
+	}
+	dd_prof_hz = (hz > 0 && hz <= 10000) ? hz : DD_PROF_HZ;
+
+	/*
+	 * Handler stays installed after stop, a signal from a deleted timer
+	 * may still be pending and default action of SIGPROF is to terminate.
+	 */
+	if (!dd_prof_handler_set)
+	{
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = dd_prof_handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGPROF, &sa, NULL))
+		{
+			pthread_mutex_unlock(&dd_prof_collector_lock);
+			return -1;
+		}
+		dd_prof_handler_set = 1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dd_prof_collector_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	dd_prof_run = 1;
+	if (pthread_create(&dd_prof_collector, NULL, dd_prof_collector_thread, NULL))
+	{
+		dd_prof_run = 0;
+		pthread_cond_destroy(&dd_prof_collector_cond);
+		pthread_mutex_unlock(&dd_prof_collector_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&dd_prof_collector_lock);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop profiling. Samples are kept until dd_prof_reset().
+ */
+void dd_prof_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&dd_prof_collector_lock);
+	if (!dd_prof_run)
+	{
+		pthread_mutex_unlock(&dd_prof_collector_lock);
+		return;
+	}
+	dd_prof_run = 0;
+	pthread_cond_signal(&dd_prof_collector_cond);
+	pthread_mutex_unlock(&dd_prof_collector_lock);
+	pthread_join(dd_prof_collector, NULL);
+	pthread_cond_destroy(&dd_prof_collector_cond);
+
+	pthread_mutex_lock(&dd_prof_lock);
+	for (i = 0; i < DD_PROF_THREADS; i++)
+	{
+		if (dd_prof_threads[i].tid > 0)
+		{
+			dd_prof_thread_remove(&dd_prof_threads[i]);
+		}
+		dd_prof_threads[i].tid = 0;
+	}
+	pthread_mutex_unlock(&dd_prof_lock);
+}
+
+
+/******************************************************************************/
+/**
+ * @return 1 if profiler is running
+ */
+int dd_prof_running(void)
+{
+	return __atomic_load_n(&dd_prof_run, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Forget all samples.
+ */
+void dd_prof_reset(void)
+{
+	int i;
+
+	pthread_mutex_lock(&dd_prof_lock);
+	dd_prof_collect(0);
+	for (i = 0; i < (int)(sizeof(dd_prof_counts) / sizeof(dd_prof_counts[0])); i++)
+	{
+		if (dd_prof_counts[i])
+		{
+			memset(dd_prof_counts[i], 0, DD_PROF_BLOCK * sizeof(uint64_t));
+		}
+	}
+	dd_prof_samples = 0;
+	dd_prof_dropped = 0;
+	pthread_mutex_unlock(&dd_prof_lock);
+}
+
+
+/******************************************************************************/
+/**
+ * Append name of code address into line: function name, or library and
+ * offset when there is no symbol.
+ */
+static size_t dd_prof_name(char *line, size_t len, size_t size, void *addr)
+{
+	const char *lib;
+	Dl_info dli;
+	int n;
+
+	if (!dladdr(addr, &dli))
+	{
+		memset(&dli, 0, sizeof(dli));
+	}
+	if (dli.dli_sname)
+	{
+		n = snprintf(line + len, size - len, "%s", dli.dli_sname);
+	}
+	else if (dli.dli_fname)
+	{
+		lib = strrchr(dli.dli_fname, '/');
+		n = snprintf(line + len, size - len, "%s+0x%lx", lib ? lib + 1 : dli.dli_fname,
+		             (unsigned long)((char *)addr - (char *)dli.dli_fbase));
+	}
+	else
+	{
+		n = snprintf(line + len, size - len, "0x%lx", (unsigned long)addr);
+	}
+	len += (n > 0) ? (size_t)n : 0;
+
+	return len < size ? len : size - 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Write profile as folded stacks into file descriptor: one line per
+ * stack, frames from outermost to innermost separated by semicolons,
+ * followed by number of samples. Output can be given as is to
+ * flamegraph.pl.
+ *
+ * @return 0 on success, -1 on errors
+ */
+int dd_prof_dump(int fd)
+{
+	void *const *frames;
+	char line[8192];
+	size_t len;
+	uint32_t id;
+	uint64_t count;
+	int depth, i, err = 0;
+
+	pthread_mutex_lock(&dd_prof_lock);
+	dd_prof_collect(0);
+	for (id = 1; id <= dd_prof_stacks.count; id++)
+	{
+		count = dd_prof_counts[id / DD_PROF_BLOCK] ? dd_prof_counts[id / DD_PROF_BLOCK][id % DD_PROF_BLOCK] : 0;
+		depth = stacktab_get(&dd_prof_stacks, id, &frames);
+		if (count == 0 || depth <= 0)
+		{
+			continue;
+		}
+		len = 0;
+		for (i = depth - 1; i >= 0; i--)
+		{
+			if (i == depth - 1 && (uintptr_t)frames[i] <= DD_THREAD_MAX)
+			{
+				len += snprintf(line, sizeof(line) - 32, "%s;", dd_thread_name((int)(uintptr_t)frames[i]));
+				len = len < sizeof(line) - 32 ? len : sizeof(line) - 33;
+				continue;
+			}
+			/* Return addresses point after the call, look up the call itself. */
+			len = dd_prof_name(line, len, sizeof(line) - 32, i > 0 ? (char *)frames[i] - 1 : frames[i]);
+			if (i > 0)
+			{
+				line[len++] = ';';
+			}
+		}
+		len += snprintf(line + len, sizeof(line) - len, " %llu\n", (unsigned long long)count);
+		if (write(fd, line, len) != (ssize_t)len)
+		{
+			err = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dd_prof_lock);
+
+	return err;
+}
+
+
+/******************************************************************************/
+/**
+ * Write profile as folded stacks into file.
+ *
+ * @return 0 on success, -1 on errors
+ */
+int dd_prof_dump_file(const char *path)
+{
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	err = dd_prof_dump(fd);
+	close(fd);
+
+	return err;
+}
+
@@ -0,0 +1,87 @@
+/*
+ * DDebuglib
+ *
+ * Sampling CPU profiler. Each thread gets a CPU time timer that sends
+ * SIGPROF, the signal handler walks frame pointers and stores the stack
+ * into a buffer of the thread. A background thread collects stacks and
+ * profile is written as folded stacks for flame graphs.
+ *
+ * Stacks are complete only for code built with -fno-omit-frame-pointer.
+ * When an interrupted leaf function has no frame of its own, its caller
+ * is missing from the stack. Stacks of threads in the thread registry
+ * start with name of the thread.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef CPUPROF_H
+#define CPUPROF_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default sampling frequency per thread, in samples per CPU second. */
+#define DD_PROF_HZ 99
+
+/** Maximum depth of sampled stacks. */
+#define DD_PROF_DEPTH 64
+
+/** Samples in buffer of one thread, power of two. */
+#define DD_PROF_RING 256
+
+/** Maximum number of threads profiled at once, power of two. */
+#define DD_PROF_THREADS 1024
+
+/** Milliseconds between collecting samples and looking for new threads. */
+#define DD_PROF_INTERVAL 100
+
+/** Stack that the signal handler stored. */
+struct dd_prof_sample
+{
+	int depth;
+	void *frames[DD_PROF_DEPTH];
+};
+
+/** Samples of one thread, written by signal handler and read by collector. */
+struct dd_prof_ring
+{
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	struct dd_prof_sample samples[DD_PROF_RING];
+};
+
+/** Profiled thread. */
+struct dd_prof_thread
+{
+	pid_t tid;
+	int seen;
+	/** Id in thread registry, 0 until thread has registered. */
+	int thread;
+	timer_t timer;
+	struct dd_prof_ring *ring;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_prof_start(int);
+void dd_prof_stop(void);
+int dd_prof_running(void);
+void dd_prof_reset(void);
+int dd_prof_dump(int);
+int dd_prof_dump_file(const char *);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,520 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "cputime.h"
+#include "metrics.h"
+#include "ddthread.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+static struct dd_cputime_thread dd_cputime_threads[DD_CPUTIME_THREADS];
+static pthread_mutex_t dd_cputime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread int dd_cputime_registered = 0;
+
+/** Slot of calling thread. */
+static __thread int dd_cputime_slot = -1;
+
+/** Whether dd_cputime_sample() has been called, exited threads wait for it then. */
+static int dd_cputime_sampled = 0;
+
+static pthread_once_t dd_cputime_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_cputime_key;
+
+/** Periodic reporter. */
+static pthread_t dd_cputime_reporter;
+static pthread_mutex_t dd_cputime_reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dd_cputime_reporter_cond;
+static int dd_cputime_reporter_run = 0;
+static unsigned int dd_cputime_interval = 0;
+static int dd_cputime_fd = -1;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static uint64_t dd_cputime_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts))
+	{
+		return 0;
+	}
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/******************************************************************************/
+/**
+ * Read context switch counts of thread from /proc.
+ *
+ * @return 0 on success, -1 on errors
+ */
+static int dd_cputime_switches(pid_t tid, uint64_t *voluntary, uint64_t *involuntary)
+{
+	char path[64], buf[2048], *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)tid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+	{
+		return -1;
+	}
+	buf[n] = '\0';
+
+	p = strstr(buf, "\nvoluntary_ctxt_switches:");
+	if (p)
+	{
+		*voluntary = strtoull(p + 25, NULL, 10);
+	}
+	p = strstr(buf, "\nnonvoluntary_ctxt_switches:");
+	if (p)
+	{
+		*involuntary = strtoull(p + 28, NULL, 10);
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************/
+static void dd_cputime_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_cputime_unregister();
+}
+
+
+/******************************************************************************/
+/**
+ * Export CPU time and context switches of live registered threads into
+ * metrics. Unlike dd_cputime_sample(), this does not start new interval.
+ */
+static void dd_cputime_collect(int fd, void *arg)
+{
+	static const char *names[] = {
+		"dd_thread_cpu_seconds_total", "dd_thread_context_switches_total"
+	};
+	static const char *helps[] = {
+		"CPU time used by registered thread.",
+		"Context switches of registered thread."
+	};
+	struct dd_cputime_thread *t;
+	uint64_t voluntary, involuntary;
+	char labels[128], tid[16];
+	size_t len;
+	int i, j;
+
+	(void)arg;
+	pthread_mutex_lock(&dd_cputime_lock);
+	for (j = 0; j < 2; j++)
+	{
+		dd_metrics_family(fd, names[j], DD_METRIC_COUNTER, helps[j]);
+		for (i = 0; i < DD_CPUTIME_THREADS; i++)
+		{
+			t = &dd_cputime_threads[i];
+			if (t->state != DD_CPUTIME_LIVE)
+			{
+				continue;
+			}
+			snprintf(tid, sizeof(tid), "%d", (int)t->tid);
+			labels[0] = '\0';
+			dd_metrics_label(labels, sizeof(labels), "thread", t->name);
+			len = dd_metrics_label(labels, sizeof(labels), "tid", tid);
+			if (j == 0)
+			{
+				dd_metrics_sample(fd, names[j], labels, (double)dd_cputime_clock(t->clock) / 1e9);
+				continue;
+			}
+			voluntary = t->last_voluntary;
+			involuntary = t->last_involuntary;
+			dd_cputime_switches(t->tid, &voluntary, &involuntary);
+			dd_metrics_label(labels, sizeof(labels), "type", "voluntary");
+			dd_metrics_sample(fd, names[j], labels, (double)voluntary);
+			labels[len] = '\0';
+			dd_metrics_label(labels, sizeof(labels), "type", "involuntary");
+			dd_metrics_sample(fd, names[j], labels, (double)involuntary);
+		}
+	}
+	pthread_mutex_unlock(&dd_cputime_lock);
+}
+
+
+/******************************************************************************/
+static void dd_cputime_setup(void)
+{
+	pthread_key_create(&dd_cputime_key, dd_cputime_thread_exit);
+	dd_metrics_collector(dd_cputime_collect, NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * Register calling thread for CPU accounting, or rename it if already
+ * registered. Thread is unregistered automatically when it exits.
+ *
+ * @param name name of thread, threads with same name are also reported
+ *             together, NULL to use name given to dd_thread_register()
+ *             or to pthread_setname_np()
+ * @return 0 on success, -1 if there are too many threads
+ */
+int dd_cputime_register(const char *name)
+{
+	struct dd_cputime_thread *t;
+	char buf[DD_CPUTIME_NAME];
+	int i = dd_cputime_slot, j;
+
+	pthread_once(&dd_cputime_once, dd_cputime_setup);
+
+	if (!name && dd_thread_self_id > 0)
+	{
+		name = dd_thread_name(dd_thread_self_id);
+	}
+	if (!name)
+	{
+		if (pthread_getname_np(pthread_self(), buf, sizeof(buf)))
+		{
+			strcpy(buf, "thread");
+		}
+		name = buf;
+	}
+
+	pthread_mutex_lock(&dd_cputime_lock);
+	if (i < 0)
+	{
+		for (i = 0; i < DD_CPUTIME_THREADS; i++)
+		{
+			if (dd_cputime_threads[i].state == DD_CPUTIME_FREE)
+			{
+				break;
+			}
+		}
+		/* Without free slots, exited threads give way before their last sample. */
+		for (j = 0; i >= DD_CPUTIME_THREADS && j < DD_CPUTIME_THREADS; j++)
+		{
+			if (dd_cputime_threads[j].state == DD_CPUTIME_DEAD)
+			{
+				i = j;
+			}
+		}
+		if (i >= DD_CPUTIME_THREADS)
+		{
+			pthread_mutex_unlock(&dd_cputime_lock);
+			return -1;
+		}
+		t = &dd_cputime_threads[i];
+		memset(t, 0, sizeof(*t));
+		t->state = DD_CPUTIME_LIVE;
+		t->tid = dd_gettid();
+		if (pthread_getcpuclockid(pthread_self(), &t->clock))
+		{
+			t->clock = CLOCK_THREAD_CPUTIME_ID;
+		}
+		t->last_cpu_ns = dd_cputime_clock(CLOCK_THREAD_CPUTIME_ID);
+		t->last_wall = dd_cputime_clock(CLOCK_MONOTONIC);
+		dd_cputime_switches(t->tid, &t->last_voluntary, &t->last_involuntary);
+		dd_cputime_slot = i;
+		dd_cputime_registered = 1;
+		pthread_setspecific(dd_cputime_key, &dd_cputime_slot);
+	}
+	t = &dd_cputime_threads[i];
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	pthread_mutex_unlock(&dd_cputime_lock);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Unregister calling thread. Its final totals are included in the next
+ * sample, if threads are sampled at all.
+ */
+void dd_cputime_unregister(void)
+{
+	struct dd_cputime_thread *t;
+	struct rusage ru;
+
+	if (dd_cputime_slot < 0)
+	{
+		return;
+	}
+	t = &dd_cputime_threads[dd_cputime_slot];
+
+	pthread_mutex_lock(&dd_cputime_lock);
+	t->cpu_ns = dd_cputime_clock(CLOCK_THREAD_CPUTIME_ID);
+	if (getrusage(RUSAGE_THREAD, &ru) == 0)
+	{
+		t->voluntary = ru.ru_nvcsw;
+		t->involuntary = ru.ru_nivcsw;
+	}
+	/* Nobody reports final totals if threads have never been sampled. */
+	t->state = dd_cputime_sampled ? DD_CPUTIME_DEAD : DD_CPUTIME_FREE;
+	pthread_mutex_unlock(&dd_cputime_lock);
+
+	dd_cputime_slot = -1;
+	dd_cputime_registered = 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Sample all registered threads. Shares and context switches are counted
+ * since the previous sample, so each sample starts a new interval.
+ * Threads that have exited are included once more and then forgotten.
+ *
+ * @param list where to store samples, may be NULL
+ * @param max size of list
+ * @return number of samples stored
+ */
+size_t dd_cputime_sample(struct dd_cputime_info *list, size_t max)
+{
+	struct dd_cputime_thread *t;
+	uint64_t cpu, voluntary, involuntary, wall;
+	size_t n = 0;
+	int i;
+
+	pthread_mutex_lock(&dd_cputime_lock);
+	dd_cputime_sampled = 1;
+	wall = dd_cputime_clock(CLOCK_MONOTONIC);
+	for (i = 0; i < DD_CPUTIME_THREADS; i++)
+	{
+		t = &dd_cputime_threads[i];
+		if (t->state == DD_CPUTIME_FREE)
+		{
+			continue;
+		}
+		if (t->state == DD_CPUTIME_LIVE)
+		{
+			cpu = dd_cputime_clock(t->clock);
+			voluntary = t->last_voluntary;
+			involuntary = t->last_involuntary;
+			dd_cputime_switches(t->tid, &voluntary, &involuntary);
+		}
+		else
+		{
+			cpu = t->cpu_ns;
+			voluntary = t->voluntary;
+			involuntary = t->involuntary;
+		}
+		cpu = cpu < t->last_cpu_ns ? t->last_cpu_ns : cpu;
+		voluntary = voluntary < t->last_voluntary ? t->last_voluntary : voluntary;
+		involuntary = involuntary < t->last_involuntary ? t->last_involuntary : involuntary;
+
+		if (list && n < max)
+		{
+			struct dd_cputime_info *info = &list[n++];
+			memcpy(info->name, t->name, DD_CPUTIME_NAME);
+			info->tid = t->tid;
+			info->live = t->state == DD_CPUTIME_LIVE;
+			info->cpu_ns = cpu;
+			info->voluntary = voluntary;
+			info->involuntary = involuntary;
+			info->share = wall > t->last_wall ?
+			              (double)(cpu - t->last_cpu_ns) / (double)(wall - t->last_wall) : 0.0;
+			info->voluntary_delta = voluntary - t->last_voluntary;
+			info->involuntary_delta = involuntary - t->last_involuntary;
+		}
+
+		t->last_cpu_ns = cpu;
+		t->last_voluntary = voluntary;
+		t->last_involuntary = involuntary;
+		t->last_wall = wall;
+		if (t->state == DD_CPUTIME_DEAD)
+		{
+			t->state = DD_CPUTIME_FREE;
+		}
+	}
+	pthread_mutex_unlock(&dd_cputime_lock);
+
+	return n;
+}
+
+
+/******************************************************************************/
+static int dd_cputime_cmp(const void *a, const void *b)
+{
+	const struct dd_cputime_info *ia = a, *ib = b;
+	int r = strcmp(ia->name, ib->name);
+	if (r)
+	{
+		return r;
+	}
+	return (ib->share > ia->share) - (ib->share < ia->share);
+}
+
+
+/******************************************************************************/
+/**
+ * Sample all registered threads and print their CPU shares since the
+ * previous sample into file descriptor. Threads are grouped by name and
+ * groups of more than one thread get a total line.
+ */
+void dd_cputime_report(int fd)
+{
+	struct dd_cputime_info *list, sum;
+	size_t n, i, j, k;
+
+	list = malloc(DD_CPUTIME_THREADS * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	n = dd_cputime_sample(list, DD_CPUTIME_THREADS);
+	qsort(list, n, sizeof(*list), dd_cputime_cmp);
+
+	dprintf(fd, "%-32s %8s %8s %12s %10s %10s\n",
+	        "thread", "tid", "cpu %", "cpu s", "vol cs", "invol cs");
+	for (i = 0; i < n; i = j)
+	{
+		memset(&sum, 0, sizeof(sum));
+		for (j = i; j < n && strcmp(list[i].name, list[j].name) == 0; j++)
+		{
+			sum.share += list[j].share;
+			sum.cpu_ns += list[j].cpu_ns;
+			sum.voluntary_delta += list[j].voluntary_delta;
+			sum.involuntary_delta += list[j].involuntary_delta;
+		}
+		for (k = i; k < j; k++)
+		{
+			dprintf(fd, "%-32s %8d %8.1f %12.3f %10llu %10llu%s\n",
+			        list[k].name, (int)list[k].tid, list[k].share * 100.0,
+			        (double)list[k].cpu_ns / 1e9,
+			        (unsigned long long)list[k].voluntary_delta,
+			        (unsigned long long)list[k].involuntary_delta,
+			        list[k].live ? "" : " (exited)");
+		}
+		if (j - i > 1)
+		{
+			dprintf(fd, "%-32s %8s %8.1f %12.3f %10llu %10llu\n",
+			        list[i].name, "total", sum.share * 100.0, (double)sum.cpu_ns / 1e9,
+			        (unsigned long long)sum.voluntary_delta,
+			        (unsigned long long)sum.involuntary_delta);
+		}
+	}
+
+	free(list);
+}
+
+
+/******************************************************************************/
+static void *dd_cputime_reporter_thread(void *arg)
+{
+	struct timespec ts;
+	(void)arg;
+
+	pthread_mutex_lock(&dd_cputime_reporter_lock);
+	while (dd_cputime_reporter_run)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += dd_cputime_interval / 1000;
+		ts.tv_nsec += (long)(dd_cputime_interval % 1000) * 1000000l;
+		if (ts.tv_nsec >= 1000000000l)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000l;
+		}
+		if (pthread_cond_timedwait(&dd_cputime_reporter_cond, &dd_cputime_reporter_lock, &ts) == 0)
+		{
+			continue;
+		}
+		pthread_mutex_unlock(&dd_cputime_reporter_lock);
+		dd_cputime_report(dd_cputime_fd);
+		pthread_mutex_lock(&dd_cputime_reporter_lock);
+	}
+	pthread_mutex_unlock(&dd_cputime_reporter_lock);
+
+	return NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Start reporting CPU shares of all registered threads periodically.
+ *
+ * @param interval milliseconds between reports, 0 for 1000
+ * @param fd where to print reports
+ * @return 0 on success, -1 on errors
+ */
+int dd_cputime_start(unsigned int interval, int fd)
+{
+	pthread_condattr_t attr;
+	int err = 0;
+
+	pthread_mutex_lock(&dd_cputime_reporter_lock);
+	if (dd_cputime_reporter_run)
+	{
+		dd_cputime_interval = interval > 0 ? interval : 1000;
+		dd_cputime_fd = fd;
+		pthread_mutex_unlock(&dd_cputime_reporter_lock);
+		return 0;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dd_cputime_reporter_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	dd_cputime_interval = interval > 0 ? interval : 1000;
+	dd_cputime_fd = fd;
+	dd_cputime_reporter_run = 1;
+	if (pthread_create(&dd_cputime_reporter, NULL, dd_cputime_reporter_thread, NULL))
+	{
+		dd_cputime_reporter_run = 0;
+		pthread_cond_destroy(&dd_cputime_reporter_cond);
+		err = -1;
+	}
+	pthread_mutex_unlock(&dd_cputime_reporter_lock);
+
+	/* Start first interval now. */
+	dd_cputime_sample(NULL, 0);
+
+	return err;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop periodic reporting.
+ */
+void dd_cputime_stop(void)
+{
+	pthread_mutex_lock(&dd_cputime_reporter_lock);
+	if (!dd_cputime_reporter_run)
+	{
+		pthread_mutex_unlock(&dd_cputime_reporter_lock);
+		return;
+	}
+	dd_cputime_reporter_run = 0;
+	pthread_cond_signal(&dd_cputime_reporter_cond);
+	pthread_mutex_unlock(&dd_cputime_reporter_lock);
+
+	pthread_join(dd_cputime_reporter, NULL);
+	pthread_cond_destroy(&dd_cputime_reporter_cond);
+}
+
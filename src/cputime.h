@@ -0,0 +1,89 @@
+/*
+ * DDebuglib
+ *
+ * CPU time accounting of named threads. CPU time and context switches of
+ * registered threads are sampled periodically or on demand, and reported
+ * as share of one core per thread and per thread name.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef CPUTIME_H
+#define CPUTIME_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of registered threads. */
+#define DD_CPUTIME_THREADS 256
+
+/** Maximum length of thread name. */
+#define DD_CPUTIME_NAME 32
+
+/** Slot states. */
+enum {
+	DD_CPUTIME_FREE = 0,
+	DD_CPUTIME_LIVE,
+	DD_CPUTIME_DEAD,
+};
+
+/** Registered thread. */
+struct dd_cputime_thread
+{
+	int state;
+	pid_t tid;
+	clockid_t clock;
+	char name[DD_CPUTIME_NAME];
+	/** Totals when thread exited. */
+	uint64_t cpu_ns;
+	uint64_t voluntary;
+	uint64_t involuntary;
+	/** Totals at previous sample. */
+	uint64_t last_cpu_ns;
+	uint64_t last_voluntary;
+	uint64_t last_involuntary;
+	uint64_t last_wall;
+};
+
+/** Sample of one thread. */
+struct dd_cputime_info
+{
+	char name[DD_CPUTIME_NAME];
+	pid_t tid;
+	int live;
+	uint64_t cpu_ns;
+	uint64_t voluntary;
+	uint64_t involuntary;
+	/** CPU share since previous sample, 1.0 is one core fully used. */
+	double share;
+	/** Context switches since previous sample. */
+	uint64_t voluntary_delta;
+	uint64_t involuntary_delta;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_cputime_register(const char *);
+void dd_cputime_unregister(void);
+size_t dd_cputime_sample(struct dd_cputime_info *, size_t);
+void dd_cputime_report(int);
+int dd_cputime_start(unsigned int, int);
+void dd_cputime_stop(void);
+
+/** Whether calling thread has been registered. */
+extern __thread int dd_cputime_registered;
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
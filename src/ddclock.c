@@ -0,0 +1,92 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <pthread.h>
+
+#include "ddclock.h"
+#include "cpuinfo.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+struct dd_clock dd_clock = { DD_CLOCK_NONE, 0, 0, 0 };
+
+static pthread_once_t dd_clock_once = PTHREAD_ONCE_INIT;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static uint64_t dd_clock_monotonic(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/******************************************************************************/
+/**
+ * Select clock source and calibrate TSC against CLOCK_MONOTONIC by
+ * spinning for DD_CLOCK_CALIBRATE_NS.
+ */
+static void dd_clock_setup(void)
+{
+	int source = DD_CLOCK_MONOTONIC;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (cpuinfo_has_rdtsc() && cpuinfo_has_invariant_tsc())
+	{
+		uint64_t t0, t1, c0, c1;
+
+		t0 = dd_clock_monotonic();
+		c0 = __builtin_ia32_rdtsc();
+		do
+		{
+			t1 = dd_clock_monotonic();
+		} while (t1 - t0 < DD_CLOCK_CALIBRATE_NS);
+		c1 = __builtin_ia32_rdtsc();
+
+		if (c1 > c0)
+		{
+			dd_clock.mult = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / (c1 - c0));
+			dd_clock.hz = (uint64_t)((unsigned __int128)(c1 - c0) * 1000000000ull / (t1 - t0));
+			dd_clock.rdtscp = cpuinfo_has_rdtscp();
+			source = DD_CLOCK_TSC;
+		}
+	}
+#endif
+
+	__atomic_store_n(&dd_clock.source, source, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Initialize clock. Called automatically on first use, call explicitly to
+ * keep calibration delay out of measurements.
+ */
+void dd_clock_init(void)
+{
+	pthread_once(&dd_clock_once, dd_clock_setup);
+}
+
+
+/******************************************************************************/
+/**
+ * @return name of clock source in use
+ */
+const char *dd_clock_source(void)
+{
+	dd_clock_init();
+	return dd_clock.source == DD_CLOCK_TSC ? "tsc" : "monotonic";
+}
+
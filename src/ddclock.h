@@ -0,0 +1,102 @@
+/*
+ * DDebuglib
+ *
+ * Monotonic nanosecond clock. Uses calibrated TSC when the processor has
+ * an invariant TSC, clock_gettime(CLOCK_MONOTONIC) otherwise.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef DDCLOCK_H
+#define DDCLOCK_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdint.h>
+#include <time.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** How long TSC is calibrated against CLOCK_MONOTONIC, in nanoseconds. */
+#define DD_CLOCK_CALIBRATE_NS 20000000
+
+/** Clock sources. */
+enum {
+	DD_CLOCK_NONE = 0,
+	DD_CLOCK_MONOTONIC,
+	DD_CLOCK_TSC,
+};
+
+/**
+ * Clock state. When source is DD_CLOCK_TSC, ticks are TSC cycles and
+ * converted to nanoseconds as (ticks * mult) >> 32.
+ */
+struct dd_clock
+{
+	int source;
+	int rdtscp;
+	uint64_t mult;
+	uint64_t hz;
+};
+
+extern struct dd_clock dd_clock;
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+void dd_clock_init(void);
+const char *dd_clock_source(void);
+
+/**
+ * Read clock in ticks. Only differences of ticks are meaningful, convert
+ * them with dd_clock_ns().
+ */
+static __inline__ uint64_t dd_clock_ticks(void)
+{
+	struct timespec ts;
+
+	if (__builtin_expect(dd_clock.source == DD_CLOCK_NONE, 0))
+	{
+		dd_clock_init();
+	}
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (dd_clock.source == DD_CLOCK_TSC)
+	{
+		unsigned int aux;
+		/* rdtscp waits for earlier instructions, plain rdtsc may not. */
+		return dd_clock.rdtscp ? __builtin_ia32_rdtscp(&aux) : __builtin_ia32_rdtsc();
+	}
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Convert ticks from dd_clock_ticks() into nanoseconds.
+ */
+static __inline__ uint64_t dd_clock_ns(uint64_t ticks)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (dd_clock.source == DD_CLOCK_TSC)
+	{
+		return (uint64_t)(((unsigned __int128)ticks * dd_clock.mult) >> 32);
+	}
+#endif
+	return ticks;
+}
+
+/**
+ * Get current time in nanoseconds from arbitrary starting point.
+ */
+static __inline__ uint64_t dd_clock_now(void)
+{
+	return dd_clock_ns(dd_clock_ticks());
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
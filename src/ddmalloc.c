@@ -0,0 +1,572 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <mm_malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ddmalloc.h"
+#include "synchro.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/*
+ * Slabs are carved from regions that are marked in a bitmap covering the
+ * whole address space, so free can tell slab objects from large
+ * allocations made with system allocator. Only touched pages of the bitmap
+ * take memory. Header of slab is found by masking object address.
+ *
+ * Free objects are kept in singly linked lists threaded through the
+ * objects themselves. Each thread has its own list per class and moves
+ * objects to and from central list of the class in batches, so the central
+ * lock is taken once per batch instead of once per call.
+ */
+
+/** Header in front of every slab. */
+struct ddmalloc_slab
+{
+	uint32_t cls;
+	uint32_t size;
+};
+
+/** Free list. */
+struct ddmalloc_list
+{
+	void *head;
+	uint32_t count;
+};
+
+/** Central free list of one class. */
+struct ddmalloc_central
+{
+	int lock;
+	void *head;
+	size_t count;
+} __attribute__((aligned(64)));
+
+/** Cache of one thread. */
+struct ddmalloc_cache
+{
+	struct ddmalloc_list lists[DDMALLOC_CLASSES];
+	int registered;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t requested;
+	uint64_t rounded;
+	int64_t inuse;
+};
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+static struct ddmalloc_central ddmalloc_central[DDMALLOC_CLASSES];
+static __thread struct ddmalloc_cache ddmalloc_cache;
+
+/** Bit set for each region used for slabs. */
+static uint64_t ddmalloc_regions[DDMALLOC_SPACE / DDMALLOC_REGION / 64];
+
+/** Region slabs are carved from. */
+static int ddmalloc_region_lock = 0;
+static char *ddmalloc_region = NULL;
+static size_t ddmalloc_region_left = 0;
+
+/** Global statistics, thread caches add their counters here in batches. */
+static struct dd_malloc_stats ddmalloc_totals;
+
+static pthread_once_t ddmalloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ddmalloc_key;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static __inline__ unsigned int ddmalloc_class(size_t size)
+{
+	if (size <= 1024)
+	{
+		return size ? (unsigned int)((size + 15) >> 4) - 1 : 0;
+	}
+	return 64 + (unsigned int)((size - 1024 + 511) >> 9) - 1;
+}
+
+
+/******************************************************************************/
+static __inline__ size_t ddmalloc_class_size(unsigned int cls)
+{
+	return (cls < 64) ? (size_t)(cls + 1) << 4 : 1024 + ((size_t)(cls - 63) << 9);
+}
+
+
+/******************************************************************************/
+/**
+ * Number of objects moved at once between thread cache and central list.
+ */
+static __inline__ uint32_t ddmalloc_batch(unsigned int cls)
+{
+	size_t n = 8192 / ddmalloc_class_size(cls);
+	return (n < 4) ? 4 : (n > 64) ? 64 : (uint32_t)n;
+}
+
+
+/******************************************************************************/
+static __inline__ struct ddmalloc_slab *ddmalloc_slab_of(void *ptr)
+{
+	return (struct ddmalloc_slab *)((uintptr_t)ptr & ~(uintptr_t)(DDMALLOC_SLAB - 1));
+}
+
+
+/******************************************************************************/
+static __inline__ int ddmalloc_is_slab(void *ptr)
+{
+	uintptr_t r = (uintptr_t)ptr / DDMALLOC_REGION;
+
+	if ((uint64_t)(uintptr_t)ptr >= DDMALLOC_SPACE)
+	{
+		return 0;
+	}
+	return (__atomic_load_n(&ddmalloc_regions[r / 64], __ATOMIC_RELAXED) >> (r % 64)) & 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Map new region aligned to its size and mark it in region map.
+ */
+static char *ddmalloc_region_map(void)
+{
+	char *p, *a;
+	uintptr_t r;
+
+	p = mmap(NULL, 2 * DDMALLOC_REGION, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		return NULL;
+	}
+	a = (char *)(((uintptr_t)p + DDMALLOC_REGION - 1) & ~(uintptr_t)(DDMALLOC_REGION - 1));
+	if (a > p)
+	{
+		munmap(p, a - p);
+	}
+	munmap(a + DDMALLOC_REGION, (p + DDMALLOC_REGION) - a);
+	if ((uint64_t)(uintptr_t)a >= DDMALLOC_SPACE)
+	{
+		munmap(a, DDMALLOC_REGION);
+		return NULL;
+	}
+
+	r = (uintptr_t)a / DDMALLOC_REGION;
+	__atomic_or_fetch(&ddmalloc_regions[r / 64], 1ull << (r % 64), __ATOMIC_RELEASE);
+
+	return a;
+}
+
+
+/******************************************************************************/
+static void ddmalloc_atfork_prepare(void)
+{
+	int i;
+
+	dd_spin_lock(&ddmalloc_region_lock);
+	for (i = 0; i < DDMALLOC_CLASSES; i++)
+	{
+		dd_spin_lock(&ddmalloc_central[i].lock);
+	}
+}
+
+
+/******************************************************************************/
+static void ddmalloc_atfork_release(void)
+{
+	int i;
+
+	for (i = DDMALLOC_CLASSES - 1; i >= 0; i--)
+	{
+		dd_spin_unlock(&ddmalloc_central[i].lock);
+	}
+	dd_spin_unlock(&ddmalloc_region_lock);
+}
+
+
+/******************************************************************************/
+static void ddmalloc_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_malloc_flush();
+}
+
+
+/******************************************************************************/
+static void ddmalloc_setup(void)
+{
+	pthread_key_create(&ddmalloc_key, ddmalloc_thread_exit);
+	pthread_atfork(ddmalloc_atfork_prepare, ddmalloc_atfork_release, ddmalloc_atfork_release);
+}
+
+
+/******************************************************************************/
+/**
+ * Make cache of this thread to be flushed when thread exits.
+ */
+static __attribute__((noinline)) void ddmalloc_register(struct ddmalloc_cache *c)
+{
+	pthread_once(&ddmalloc_once, ddmalloc_setup);
+	pthread_setspecific(ddmalloc_key, c);
+	c->registered = 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Move statistics counters of this thread into global totals.
+ */
+static void ddmalloc_count(struct ddmalloc_cache *c)
+{
+	__atomic_add_fetch(&ddmalloc_totals.cache_hits, c->hits, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ddmalloc_totals.cache_misses, c->misses, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ddmalloc_totals.requested_bytes, c->requested, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ddmalloc_totals.rounded_bytes, c->rounded, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ddmalloc_totals.inuse_bytes, (uint64_t)c->inuse, __ATOMIC_RELAXED);
+	c->hits = c->misses = c->requested = c->rounded = 0;
+	c->inuse = 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Carve new slab of class and link its objects into list.
+ * Region lock is taken inside, central lock of class must be held.
+ */
+static int ddmalloc_slab_new(unsigned int cls, struct ddmalloc_central *central)
+{
+	struct ddmalloc_slab *slab;
+	size_t size = ddmalloc_class_size(cls);
+	size_t n, i;
+	char *obj;
+
+	dd_spin_lock(&ddmalloc_region_lock);
+	if (ddmalloc_region_left < DDMALLOC_SLAB)
+	{
+		ddmalloc_region = ddmalloc_region_map();
+		if (!ddmalloc_region)
+		{
+			ddmalloc_region_left = 0;
+			dd_spin_unlock(&ddmalloc_region_lock);
+			return -1;
+		}
+		ddmalloc_region_left = DDMALLOC_REGION;
+		__atomic_add_fetch(&ddmalloc_totals.slab_bytes, DDMALLOC_REGION, __ATOMIC_RELAXED);
+	}
+	slab = (struct ddmalloc_slab *)ddmalloc_region;
+	ddmalloc_region += DDMALLOC_SLAB;
+	ddmalloc_region_left -= DDMALLOC_SLAB;
+	dd_spin_unlock(&ddmalloc_region_lock);
+
+	slab->cls = cls;
+	slab->size = (uint32_t)size;
+
+	n = (DDMALLOC_SLAB - DDMALLOC_HDR) / size;
+	obj = (char *)slab + DDMALLOC_HDR;
+	for (i = 0; i < n - 1; i++)
+	{
+		*(void **)(obj + i * size) = obj + (i + 1) * size;
+	}
+	*(void **)(obj + i * size) = central->head;
+	central->head = obj;
+	central->count += n;
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Refill thread cache of class from central list.
+ */
+static __attribute__((noinline)) void *ddmalloc_refill(struct ddmalloc_cache *c, unsigned int cls)
+{
+	struct ddmalloc_central *central = &ddmalloc_central[cls];
+	struct ddmalloc_list *l = &c->lists[cls];
+	uint32_t batch = ddmalloc_batch(cls);
+	void *head, *tail;
+	uint32_t n;
+
+	if (!c->registered)
+	{
+		ddmalloc_register(c);
+	}
+
+	dd_spin_lock(&central->lock);
+	if (central->count < batch && ddmalloc_slab_new(cls, central))
+	{
+		if (!central->head)
+		{
+			dd_spin_unlock(&central->lock);
+			return NULL;
+		}
+	}
+	head = tail = central->head;
+	for (n = 1; n < batch && *(void **)tail; n++)
+	{
+		tail = *(void **)tail;
+	}
+	central->head = *(void **)tail;
+	central->count -= n;
+	dd_spin_unlock(&central->lock);
+
+	/* First object is returned, rest go to thread cache. */
+	*(void **)tail = l->head;
+	l->head = *(void **)head;
+	l->count += n - 1;
+
+	c->misses++;
+	__atomic_add_fetch(&ddmalloc_totals.transfers, 1, __ATOMIC_RELAXED);
+	ddmalloc_count(c);
+
+	return head;
+}
+
+
+/******************************************************************************/
+/**
+ * Move n objects from thread cache of class into central list.
+ */
+static void ddmalloc_release(struct ddmalloc_cache *c, unsigned int cls, uint32_t n)
+{
+	struct ddmalloc_central *central = &ddmalloc_central[cls];
+	struct ddmalloc_list *l = &c->lists[cls];
+	void *head, *tail;
+	uint32_t i;
+
+	if (n == 0)
+	{
+		return;
+	}
+	head = tail = l->head;
+	for (i = 1; i < n; i++)
+	{
+		tail = *(void **)tail;
+	}
+	l->head = *(void **)tail;
+	l->count -= n;
+
+	dd_spin_lock(&central->lock);
+	*(void **)tail = central->head;
+	central->head = head;
+	central->count += n;
+	dd_spin_unlock(&central->lock);
+
+	__atomic_add_fetch(&ddmalloc_totals.transfers, 1, __ATOMIC_RELAXED);
+	ddmalloc_count(c);
+}
+
+
+/******************************************************************************/
+static void *ddmalloc_large(size_t size)
+{
+	void *ptr = _mm_malloc(size, 16);
+
+	if (ptr)
+	{
+		size_t n = malloc_usable_size(ptr);
+		__atomic_add_fetch(&ddmalloc_totals.large_bytes, n, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ddmalloc_totals.large_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ddmalloc_totals.requested_bytes, size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ddmalloc_totals.rounded_bytes, n, __ATOMIC_RELAXED);
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+/**
+ * Allocate memory, aligned to 16 bytes.
+ *
+ * @param size number of bytes
+ * @return pointer to memory or NULL on errors
+ */
+void *dd_malloc(size_t size)
+{
+	struct ddmalloc_cache *c = &ddmalloc_cache;
+	struct ddmalloc_list *l;
+	unsigned int cls;
+	void *ptr;
+
+	if (size > DDMALLOC_MAX)
+	{
+		return ddmalloc_large(size);
+	}
+	cls = ddmalloc_class(size);
+	l = &c->lists[cls];
+	c->requested += size;
+	c->rounded += ddmalloc_class_size(cls);
+	c->inuse += ddmalloc_class_size(cls);
+
+	ptr = l->head;
+	if (__builtin_expect(ptr != NULL, 1))
+	{
+		l->head = *(void **)ptr;
+		l->count--;
+		c->hits++;
+		return ptr;
+	}
+
+	ptr = ddmalloc_refill(c, cls);
+	if (!ptr)
+	{
+		c->requested -= size;
+		c->rounded -= ddmalloc_class_size(cls);
+		c->inuse -= ddmalloc_class_size(cls);
+	}
+	return ptr;
+}
+
+
+/******************************************************************************/
+/**
+ * Free memory allocated with dd_malloc(). Objects go into cache of calling
+ * thread even when allocated by another thread.
+ */
+void dd_free(void *ptr)
+{
+	struct ddmalloc_cache *c = &ddmalloc_cache;
+	struct ddmalloc_slab *slab;
+	struct ddmalloc_list *l;
+	unsigned int cls;
+	uint32_t batch;
+
+	if (!ptr)
+	{
+		return;
+	}
+	if (!ddmalloc_is_slab(ptr))
+	{
+		__atomic_sub_fetch(&ddmalloc_totals.large_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&ddmalloc_totals.large_count, 1, __ATOMIC_RELAXED);
+		_mm_free(ptr);
+		return;
+	}
+	if (__builtin_expect(!c->registered, 0))
+	{
+		ddmalloc_register(c);
+	}
+	slab = ddmalloc_slab_of(ptr);
+	cls = slab->cls;
+
+	l = &c->lists[cls];
+	*(void **)ptr = l->head;
+	l->head = ptr;
+	l->count++;
+	c->inuse -= slab->size;
+
+	batch = ddmalloc_batch(cls);
+	if (__builtin_expect(l->count > 2 * batch, 0))
+	{
+		ddmalloc_release(c, cls, batch);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * @return number of bytes usable in allocation
+ */
+size_t dd_malloc_usable_size(void *ptr)
+{
+	struct ddmalloc_slab *slab;
+
+	if (!ptr)
+	{
+		return 0;
+	}
+	if (!ddmalloc_is_slab(ptr))
+	{
+		return malloc_usable_size(ptr);
+	}
+	slab = ddmalloc_slab_of(ptr);
+	return slab->size;
+}
+
+
+/******************************************************************************/
+/**
+ * Return all objects cached by calling thread into central lists. Done
+ * automatically when thread exits.
+ */
+void dd_malloc_flush(void)
+{
+	struct ddmalloc_cache *c = &ddmalloc_cache;
+	unsigned int i;
+
+	for (i = 0; i < DDMALLOC_CLASSES; i++)
+	{
+		ddmalloc_release(c, i, c->lists[i].count);
+	}
+	ddmalloc_count(c);
+}
+
+
+/******************************************************************************/
+/**
+ * Get allocator statistics. Other threads add their counters into totals
+ * when they exchange objects with central lists, so numbers lag behind by
+ * at most one batch per thread and class.
+ */
+void dd_malloc_stats(struct dd_malloc_stats *stats)
+{
+	ddmalloc_count(&ddmalloc_cache);
+	stats->slab_bytes = __atomic_load_n(&ddmalloc_totals.slab_bytes, __ATOMIC_RELAXED);
+	stats->large_bytes = __atomic_load_n(&ddmalloc_totals.large_bytes, __ATOMIC_RELAXED);
+	stats->inuse_bytes = __atomic_load_n(&ddmalloc_totals.inuse_bytes, __ATOMIC_RELAXED);
+	stats->requested_bytes = __atomic_load_n(&ddmalloc_totals.requested_bytes, __ATOMIC_RELAXED);
+	stats->rounded_bytes = __atomic_load_n(&ddmalloc_totals.rounded_bytes, __ATOMIC_RELAXED);
+	stats->cache_hits = __atomic_load_n(&ddmalloc_totals.cache_hits, __ATOMIC_RELAXED);
+	stats->cache_misses = __atomic_load_n(&ddmalloc_totals.cache_misses, __ATOMIC_RELAXED);
+	stats->transfers = __atomic_load_n(&ddmalloc_totals.transfers, __ATOMIC_RELAXED);
+	stats->large_count = __atomic_load_n(&ddmalloc_totals.large_count, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Print statistics and fragmentation into file descriptor.
+ */
+void dd_malloc_report(int fd)
+{
+	struct dd_malloc_stats s;
+	uint64_t calls;
+	double waste, unused, hit;
+
+	dd_malloc_stats(&s);
+	calls = s.cache_hits + s.cache_misses;
+	hit = calls ? 100.0 * (double)s.cache_hits / (double)calls : 0.0;
+	waste = s.rounded_bytes ?
+	        100.0 * (double)(s.rounded_bytes - s.requested_bytes) / (double)s.rounded_bytes : 0.0;
+	unused = s.slab_bytes ?
+	         100.0 * (double)(s.slab_bytes - s.inuse_bytes) / (double)s.slab_bytes : 0.0;
+
+	dprintf(fd, "slab bytes:     %llu (%llu in use, %.1f%% free or cached)\n",
+	        (unsigned long long)s.slab_bytes, (unsigned long long)s.inuse_bytes, unused);
+	dprintf(fd, "large bytes:    %llu in %llu allocations\n",
+	        (unsigned long long)s.large_bytes, (unsigned long long)s.large_count);
+	dprintf(fd, "rounding waste: %.1f%% (%llu requested, %llu handed out)\n",
+	        waste, (unsigned long long)s.requested_bytes, (unsigned long long)s.rounded_bytes);
+	dprintf(fd, "cache hits:     %.1f%% (%llu hits, %llu misses, %llu transfers)\n",
+	        hit, (unsigned long long)s.cache_hits, (unsigned long long)s.cache_misses,
+	        (unsigned long long)s.transfers);
+}
+
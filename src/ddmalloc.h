@@ -0,0 +1,76 @@
+/*
+ * DDebuglib
+ *
+ * Size class slab allocator with per-thread caches.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef DDMALLOC_H
+#define DDMALLOC_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Size of one slab, power of two. Slabs are aligned to their size. */
+#define DDMALLOC_SLAB (64 * 1024)
+
+/** Size of slab header, objects start after it. */
+#define DDMALLOC_HDR 64
+
+/** Slabs are carved from regions of this size, aligned to their size. */
+#define DDMALLOC_REGION (4 * 1024 * 1024)
+
+/** Size of address space covered by region map. */
+#define DDMALLOC_SPACE (1ull << 47)
+
+/** Largest size served from size classes, larger go to system allocator. */
+#define DDMALLOC_MAX 8192
+
+/** Classes of 16 byte steps up to 1024, then 512 byte steps up to max. */
+#define DDMALLOC_CLASSES (64 + (DDMALLOC_MAX - 1024) / 512)
+
+/** Statistics of allocator. */
+struct dd_malloc_stats
+{
+	/** Bytes mapped for slabs. */
+	uint64_t slab_bytes;
+	/** Bytes of large allocations from system allocator. */
+	uint64_t large_bytes;
+	/** Bytes of class sized objects in use. */
+	uint64_t inuse_bytes;
+	/** Total bytes requested by callers. */
+	uint64_t requested_bytes;
+	/** Total bytes handed out, requested rounded up to class size. */
+	uint64_t rounded_bytes;
+	/** Allocations served from thread cache. */
+	uint64_t cache_hits;
+	/** Allocations that had to refill thread cache from central list. */
+	uint64_t cache_misses;
+	/** Batches moved between thread caches and central lists. */
+	uint64_t transfers;
+	/** Number of live large allocations. */
+	uint64_t large_count;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+void *dd_malloc(size_t);
+void dd_free(void *);
+size_t dd_malloc_usable_size(void *);
+void dd_malloc_flush(void);
+void dd_malloc_stats(struct dd_malloc_stats *);
+void dd_malloc_report(int);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,105 @@
+/*
+ * DDebuglib
+ *
+ * Sharded counters. Each thread picks a shard when it first updates and
+ * gives it back when it exits, see dd_shard_release(). While a shard is
+ * in use by one thread it is updated without locked instructions. When
+ * more threads are alive than there are private shards, the rest share
+ * the last shard, which is never owned, and update it atomically.
+ *
+ * Counters are cumulative, so a shard given back keeps its values and the
+ * next thread keeps adding to them.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef DDSHARD_H
+#define DDSHARD_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of shards, one bit each in mask of shards in use. */
+#define DD_SHARD_MAX 64
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+
+/**
+ * Pick shard for calling thread.
+ *
+ * @param used mask of shards in use, shared by all threads
+ * @param shards number of shards, from two to DD_SHARD_MAX
+ * @param own set to 1 if the shard is private to calling thread
+ * @return shard index
+ */
+static __inline__ int dd_shard_pick(uint64_t *used, unsigned int shards, int *own)
+{
+	uint64_t u = __atomic_load_n(used, __ATOMIC_RELAXED);
+	unsigned int n;
+
+	/* Last shard is never marked used, so ~u is never zero. */
+	while ((n = (unsigned int)__builtin_ctzll(~u)) < shards - 1)
+	{
+		if (__atomic_compare_exchange_n(used, &u, u | (1ull << n), 1,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			*own = 1;
+			return (int)n;
+		}
+	}
+	*own = 0;
+	return (int)shards - 1;
+}
+
+/**
+ * Give shard back, call from thread exit. After this the thread must not
+ * update the shard, but it may still use the shared last shard.
+ *
+ * @param n shard index from dd_shard_pick()
+ * @param own whether the shard is private, as from dd_shard_pick()
+ */
+static __inline__ void dd_shard_release(uint64_t *used, int n, int own)
+{
+	if (own)
+	{
+		__atomic_and_fetch(used, ~(1ull << n), __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Keep only shard of calling thread in use, call in child after fork.
+ */
+static __inline__ void dd_shard_reset(uint64_t *used, int n, int own)
+{
+	__atomic_store_n(used, own ? (1ull << n) : 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add to counter in shard. Signed counters can be passed cast to unsigned.
+ *
+ * @param own whether the shard is private, as from dd_shard_pick()
+ * @return new value of counter
+ */
+static __inline__ uint64_t dd_shard_add(int own, uint64_t *counter, uint64_t v)
+{
+	if (own)
+	{
+		v += __atomic_load_n(counter, __ATOMIC_RELAXED);
+		__atomic_store_n(counter, v, __ATOMIC_RELAXED);
+		return v;
+	}
+	return __atomic_add_fetch(counter, v, __ATOMIC_RELAXED);
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
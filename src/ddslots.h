@@ -0,0 +1,135 @@
+/*
+ * DDebuglib
+ *
+ * Lock-free table of entries keyed by hash. Table is an array of entry
+ * pointers probed linearly. Entries are created outside the table and
+ * claimed into an empty slot with compare and swap, they are never
+ * removed. Callbacks are given as a constant struct, so compiler can
+ * inline them into the caller.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef DDSLOTS_H
+#define DDSLOTS_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Entry callbacks of table. */
+struct dd_slots_ops
+{
+	/** Return nonzero if entry has given key. */
+	int (*match)(const void *entry, const void *key);
+	/** Create new entry for key, NULL if out of memory. */
+	void *(*create)(const void *key);
+	/** Release entry that was created but not inserted. */
+	void (*destroy)(void *entry);
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+
+/**
+ * Find entry from table.
+ *
+ * @param slots table
+ * @param size number of slots, power of two
+ * @param probe maximum number of slots looked at
+ * @param full set to 1 if all looked at slots had other keys, 0 otherwise
+ * @return entry or NULL if not found
+ */
+static __inline__ void *dd_slots_find(void **slots, unsigned int size, unsigned int probe,
+                                      unsigned int hash, const void *key,
+                                      const struct dd_slots_ops *ops, int *full)
+{
+	void *e;
+	unsigned int i, n;
+
+	*full = 0;
+	for (n = 0, i = hash; n < probe; n++, i++)
+	{
+		i &= size - 1;
+		e = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+		if (!e)
+		{
+			return NULL;
+		}
+		if (ops->match(e, key))
+		{
+			return e;
+		}
+	}
+
+	*full = 1;
+	return NULL;
+}
+
+/**
+ * Find entry from table, insert new if not found.
+ *
+ * @param count incremented when new entry is inserted
+ * @param full set to 1 if all looked at slots had other keys, 0 otherwise
+ * @return entry or NULL if not found and not inserted
+ */
+static __inline__ void *dd_slots_get(void **slots, unsigned int size, unsigned int probe,
+                                     unsigned int hash, const void *key,
+                                     const struct dd_slots_ops *ops,
+                                     unsigned int *count, int *full)
+{
+	void *e, *fresh = NULL;
+	unsigned int i, n;
+
+	*full = 0;
+	for (n = 0, i = hash; n < probe; n++, i++)
+	{
+		i &= size - 1;
+		e = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+		if (!e)
+		{
+			if (!fresh)
+			{
+				fresh = ops->create(key);
+				if (!fresh)
+				{
+					return NULL;
+				}
+			}
+			if (__atomic_compare_exchange_n(&slots[i], &e, fresh, 0,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+				return fresh;
+			}
+			/* Someone else took the slot, e now holds its value. */
+		}
+		if (ops->match(e, key))
+		{
+			break;
+		}
+	}
+
+	if (fresh)
+	{
+		ops->destroy(fresh);
+	}
+	if (n < probe)
+	{
+		return e;
+	}
+
+	*full = 1;
+	return NULL;
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,336 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ddthread.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+struct dd_thread dd_threads[DD_THREAD_MAX];
+__thread int dd_thread_self_id = 0;
+__thread pid_t dd_thread_tid_cached = 0;
+void (*dd_thread_unregister_hook)(void) = NULL;
+
+/** Where next registration starts looking for a free slot. */
+static unsigned int dd_thread_hint = 0;
+
+static pthread_once_t dd_thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_thread_key;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_thread_unregister();
+}
+
+
+/******************************************************************************/
+/**
+ * Only the thread that called fork() exists in the child. Slots of other
+ * threads are released and kernel thread id of the caller is changed.
+ */
+static void dd_thread_atfork_child(void)
+{
+	int i;
+
+	dd_thread_tid_cached = 0;
+	for (i = 0; i < DD_THREAD_MAX; i++)
+	{
+		if (i + 1 == dd_thread_self_id)
+		{
+			dd_threads[i].tid = dd_gettid();
+			continue;
+		}
+		dd_threads[i].state = DD_THREAD_FREE;
+	}
+}
+
+
+/******************************************************************************/
+static void dd_thread_setup(void)
+{
+	pthread_key_create(&dd_thread_key, dd_thread_exit);
+	pthread_atfork(NULL, NULL, dd_thread_atfork_child);
+}
+
+
+/******************************************************************************/
+/**
+ * Set up at load time, not at first registration: dd_gettid() caches the
+ * thread id also in processes that never register a thread, and child
+ * after fork must not keep the id of the parent.
+ */
+static __attribute__((constructor)) void dd_thread_init(void)
+{
+	pthread_once(&dd_thread_once, dd_thread_setup);
+}
+
+
+/******************************************************************************/
+static void dd_thread_set_name(struct dd_thread *t, const char *name)
+{
+	char buf[DD_THREAD_NAME];
+
+	if (!name)
+	{
+		if (pthread_getname_np(pthread_self(), buf, sizeof(buf)))
+		{
+			snprintf(buf, sizeof(buf), "%d", (int)dd_gettid());
+		}
+		name = buf;
+	}
+	snprintf(t->name, sizeof(t->name), "%s", name);
+}
+
+
+/******************************************************************************/
+/**
+ * Register calling thread, or rename it if already registered. Free slot
+ * is claimed with compare and swap, so threads never wait for each other.
+ * Thread is unregistered automatically when it exits.
+ *
+ * @param name name of thread, NULL to use name from pthread_setname_np()
+ * @return id of thread, or -1 if there are too many threads
+ */
+int dd_thread_register(const char *name)
+{
+	struct dd_thread *t;
+	struct timespec ts;
+	unsigned int start, n;
+	int i, state, id = dd_thread_self_id;
+
+	pthread_once(&dd_thread_once, dd_thread_setup);
+
+	if (id > 0)
+	{
+		t = &dd_threads[id - 1];
+		__atomic_add_fetch(&t->gen, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		dd_thread_set_name(t, name);
+		__atomic_add_fetch(&t->gen, 1, __ATOMIC_RELEASE);
+		return id;
+	}
+
+	start = __atomic_fetch_add(&dd_thread_hint, 1, __ATOMIC_RELAXED);
+	for (n = 0; n < DD_THREAD_MAX; n++)
+	{
+		i = (start + n) % DD_THREAD_MAX;
+		state = DD_THREAD_FREE;
+		if (__atomic_load_n(&dd_threads[i].state, __ATOMIC_RELAXED) == DD_THREAD_FREE &&
+		    __atomic_compare_exchange_n(&dd_threads[i].state, &state, DD_THREAD_CLAIMED, 0,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if (n >= DD_THREAD_MAX)
+	{
+		dd_thread_self_id = -DD_THREAD_RETRY;
+		return -1;
+	}
+
+	/* Generation is odd while slot is filled, readers retry then. */
+	t = &dd_threads[i];
+	__atomic_add_fetch(&t->gen, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->tid = dd_gettid();
+	t->self = pthread_self();
+	t->started = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+	t->logs = 0;
+	t->allocs = 0;
+	t->frees = 0;
+	t->alloc_bytes = 0;
+	dd_thread_set_name(t, name);
+	__atomic_add_fetch(&t->gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->state, DD_THREAD_LIVE, __ATOMIC_RELEASE);
+
+	dd_thread_self_id = i + 1;
+	pthread_setspecific(dd_thread_key, t);
+
+	return i + 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Unregister calling thread. Its slot and id may be given to another
+ * thread after this, so dd_thread_unregister_hook is called first.
+ */
+void dd_thread_unregister(void)
+{
+	void (*hook)(void);
+	int id = dd_thread_self_id;
+
+	dd_thread_self_id = 0;
+	if (id <= 0)
+	{
+		return;
+	}
+	hook = __atomic_load_n(&dd_thread_unregister_hook, __ATOMIC_ACQUIRE);
+	if (hook)
+	{
+		hook();
+	}
+	pthread_setspecific(dd_thread_key, NULL);
+	__atomic_store_n(&dd_threads[id - 1].state, DD_THREAD_FREE, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Get name of thread. Name of exited thread is kept until its id is
+ * given to another thread.
+ *
+ * @return name, "?" for unknown id
+ */
+const char *dd_thread_name(int id)
+{
+	if (id <= 0 || id > DD_THREAD_MAX || !dd_threads[id - 1].name[0])
+	{
+		return "?";
+	}
+	return dd_threads[id - 1].name;
+}
+
+
+/******************************************************************************/
+/**
+ * Find live thread by kernel thread id.
+ *
+ * @return id of thread, 0 if not registered
+ */
+int dd_thread_find_tid(pid_t tid)
+{
+	int i;
+
+	for (i = 0; i < DD_THREAD_MAX; i++)
+	{
+		if (__atomic_load_n(&dd_threads[i].state, __ATOMIC_ACQUIRE) == DD_THREAD_LIVE &&
+		    dd_threads[i].tid == tid)
+		{
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Get consistent copy of block of live thread.
+ *
+ * @return 0 on success, -1 if there is no live thread with this id
+ */
+int dd_thread_info(int id, struct dd_thread_info *info)
+{
+	struct dd_thread *t;
+	uint32_t gen;
+	int tries;
+
+	if (id <= 0 || id > DD_THREAD_MAX)
+	{
+		return -1;
+	}
+	t = &dd_threads[id - 1];
+	for (tries = 0; tries < 100; tries++)
+	{
+		gen = __atomic_load_n(&t->gen, __ATOMIC_ACQUIRE);
+		if (gen & 1)
+		{
+			continue;
+		}
+		if (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != DD_THREAD_LIVE)
+		{
+			return -1;
+		}
+		info->id = id;
+		info->tid = t->tid;
+		memcpy(info->name, t->name, sizeof(info->name));
+		info->started = t->started;
+		info->logs = __atomic_load_n(&t->logs, __ATOMIC_RELAXED);
+		info->allocs = __atomic_load_n(&t->allocs, __ATOMIC_RELAXED);
+		info->frees = __atomic_load_n(&t->frees, __ATOMIC_RELAXED);
+		info->alloc_bytes = __atomic_load_n(&t->alloc_bytes, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&t->gen, __ATOMIC_RELAXED) == gen)
+		{
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/******************************************************************************/
+/**
+ * Get copies of blocks of all live threads.
+ *
+ * @param list where to store, may be NULL to only count
+ * @param max size of list
+ * @return number of threads stored
+ */
+size_t dd_thread_list(struct dd_thread_info *list, size_t max)
+{
+	struct dd_thread_info info;
+	size_t n = 0;
+	int i;
+
+	for (i = 1; i <= DD_THREAD_MAX; i++)
+	{
+		if (dd_thread_info(i, list && n < max ? &list[n] : &info) == 0)
+		{
+			n++;
+		}
+	}
+
+	return list && n > max ? max : n;
+}
+
+
+/******************************************************************************/
+/**
+ * Print all live threads into file descriptor.
+ */
+void dd_thread_report(int fd)
+{
+	struct dd_thread_info *list;
+	size_t i, n;
+
+	list = malloc(DD_THREAD_MAX * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	n = dd_thread_list(list, DD_THREAD_MAX);
+	dprintf(fd, "%5s %8s %-32s %10s %10s %10s %14s\n",
+	        "id", "tid", "name", "logs", "allocs", "frees", "alloc bytes");
+	for (i = 0; i < n; i++)
+	{
+		dprintf(fd, "%5d %8d %-32s %10llu %10llu %10llu %14llu\n",
+		        list[i].id, (int)list[i].tid, list[i].name,
+		        (unsigned long long)list[i].logs, (unsigned long long)list[i].allocs,
+		        (unsigned long long)list[i].frees, (unsigned long long)list[i].alloc_bytes);
+	}
+	free(list);
+}
+
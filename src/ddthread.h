@@ -0,0 +1,163 @@
+/*
+ * DDebuglib
+ *
+ * Thread registry. Each thread gets a small integer id and a block for
+ * its name and statistics, so that logs, profiles and allocation records
+ * can refer to threads by id. Registering and exiting take no global lock.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef DDTHREAD_H
+#define DDTHREAD_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of threads alive at the same time. */
+#define DD_THREAD_MAX 1024
+
+/** Calls of dd_thread_id() before registration is tried again when registry was full. */
+#define DD_THREAD_RETRY 1024
+
+/** Maximum length of thread name. */
+#define DD_THREAD_NAME 32
+
+/** Slot states. */
+enum {
+	DD_THREAD_FREE = 0,
+	/** Being filled by registering thread. */
+	DD_THREAD_CLAIMED,
+	DD_THREAD_LIVE,
+};
+
+/**
+ * Block of one thread. Statistics are written only by the thread itself,
+ * so they need no locked instructions. Slot of exited thread is reused,
+ * gen tells readers whether slot changed while it was read.
+ */
+struct dd_thread
+{
+	int state;
+	uint32_t gen;
+	pid_t tid;
+	pthread_t self;
+	char name[DD_THREAD_NAME];
+	/** CLOCK_REALTIME nanoseconds when registered. */
+	uint64_t started;
+	/** Messages logged with DLog. */
+	uint64_t logs;
+	/** Allocations and frees through rec_*. */
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t alloc_bytes;
+} __attribute__((aligned(64)));
+
+/** Copy of thread block. */
+struct dd_thread_info
+{
+	int id;
+	pid_t tid;
+	char name[DD_THREAD_NAME];
+	uint64_t started;
+	uint64_t logs;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t alloc_bytes;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_thread_register(const char *);
+void dd_thread_unregister(void);
+const char *dd_thread_name(int);
+int dd_thread_find_tid(pid_t);
+int dd_thread_info(int, struct dd_thread_info *);
+size_t dd_thread_list(struct dd_thread_info *, size_t);
+void dd_thread_report(int);
+
+/** Thread blocks, id of thread is its index plus one. */
+extern struct dd_thread dd_threads[DD_THREAD_MAX];
+
+/**
+ * Id of calling thread, 0 until registered. Below zero when registry was
+ * full, then dd_thread_id() counts it up to zero and tries again.
+ */
+extern __thread int dd_thread_self_id;
+
+/** Cached kernel thread id of calling thread, 0 until first asked. */
+extern __thread pid_t dd_thread_tid_cached;
+
+/**
+ * Called by exiting thread before its id is freed, for state that is
+ * indexed by thread id.
+ */
+extern void (*dd_thread_unregister_hook)(void);
+
+/**
+ * @return kernel thread id of calling thread, without system call after
+ *         the first time
+ */
+static __inline__ pid_t dd_gettid(void)
+{
+	if (__builtin_expect(dd_thread_tid_cached == 0, 0))
+	{
+		dd_thread_tid_cached = (pid_t)syscall(SYS_gettid);
+	}
+	return dd_thread_tid_cached;
+}
+
+/**
+ * @return id of calling thread, thread is registered under its pthread
+ *         name if it was not yet, 0 if registry is full
+ */
+static __inline__ int dd_thread_id(void)
+{
+	int id = dd_thread_self_id;
+
+	if (__builtin_expect(id <= 0, 0))
+	{
+		/* Back off while registry was full, other threads may exit meanwhile. */
+		if (id < 0 && ++dd_thread_self_id < 0)
+		{
+			return 0;
+		}
+		id = dd_thread_register(NULL);
+	}
+	return id > 0 ? id : 0;
+}
+
+/**
+ * @return block of calling thread or NULL if registry is full
+ */
+static __inline__ struct dd_thread *dd_thread_self(void)
+{
+	int id = dd_thread_id();
+	return id > 0 ? &dd_threads[id - 1] : NULL;
+}
+
+/**
+ * Add to statistic of calling thread. Only the thread itself writes to its
+ * block, so no locked instruction is needed.
+ */
+static __inline__ void dd_thread_count(uint64_t *counter, uint64_t v)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
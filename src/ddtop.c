@@ -0,0 +1,229 @@
+/*
+ * DDebuglib
+ *
+ * ddtop, shows metrics that a process publishes with dd_shm_start().
+ * Shared memory is only read, so watching costs the process nothing.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmstats.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/** Current and previous snapshot. */
+static struct dd_shm ddtop_cur;
+static struct dd_shm ddtop_prev;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void ddtop_usage(const char *argv0)
+{
+	fprintf(stderr,
+	        "usage: %s [-i milliseconds] [-n count] [-b] <pid|name>\n"
+	        "  -i  milliseconds between updates, default 1000\n"
+	        "  -n  exit after this many updates\n"
+	        "  -b  batch mode, do not clear screen between updates\n",
+	        argv0);
+}
+
+
+/******************************************************************************/
+/**
+ * Map shared memory of process read-only and check its layout.
+ *
+ * @return mapped memory or NULL on errors
+ */
+static const struct dd_shm *ddtop_attach(const char *arg)
+{
+	const struct dd_shm *shm;
+	struct stat st;
+	char name[256];
+	int fd;
+
+	if (strspn(arg, "0123456789") == strlen(arg))
+	{
+		snprintf(name, sizeof(name), DD_SHM_PATH, atoi(arg));
+	}
+	else
+	{
+		snprintf(name, sizeof(name), "%s%s", arg[0] == '/' ? "" : "/", arg);
+	}
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr, "ddtop: %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*shm))
+	{
+		fprintf(stderr, "ddtop: %s: too small\n", name);
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		fprintf(stderr, "ddtop: %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	if (__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) != DD_SHM_MAGIC ||
+	    shm->header.version != DD_SHM_VERSION ||
+	    shm->header.header_size != sizeof(shm->header) ||
+	    shm->header.entry_size != sizeof(struct dd_shm_entry) ||
+	    shm->header.entries_max != DD_SHM_ENTRIES)
+	{
+		fprintf(stderr, "ddtop: %s: unknown layout, version %u\n", name,
+		        (unsigned int)shm->header.version);
+		munmap((void *)shm, sizeof(*shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+
+/******************************************************************************/
+/**
+ * Print one snapshot. Rates are calculated from the previous snapshot
+ * for counters and for numbers of histogram values.
+ */
+static void ddtop_print(int first)
+{
+	struct dd_shm_header *h = &ddtop_cur.header;
+	struct dd_shm_entry *e, *p;
+	char name[DD_SHM_NAME + DD_SHM_LABELS + 2];
+	double dt = 0.0, rate;
+	unsigned int i;
+
+	if (!first && h->time > ddtop_prev.header.time)
+	{
+		dt = (double)(h->time - ddtop_prev.header.time) / 1e9;
+	}
+	printf("pid %d, %u metrics, update %llu, interval %u ms\n\n", (int)h->pid,
+	       (unsigned int)h->count, (unsigned long long)h->updates, (unsigned int)h->interval);
+	printf("%-56s %16s %12s %10s %10s %10s\n", "metric", "value", "rate/s", "p50", "p99", "max");
+	for (i = 0; i < h->count && i < DD_SHM_ENTRIES; i++)
+	{
+		e = &ddtop_cur.entries[i];
+		p = &ddtop_prev.entries[i];
+		if (e->labels[0])
+		{
+			snprintf(name, sizeof(name), "%s{%s}", e->name, e->labels);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "%s", e->name);
+		}
+		printf("%-56s %16lld", name, (long long)e->value);
+		if (e->type == DD_SHM_GAUGE)
+		{
+			printf(" %12s", "");
+		}
+		else if (dt > 0.0 && i < ddtop_prev.header.count && strcmp(e->name, p->name) == 0)
+		{
+			rate = (double)(e->value - p->value) / dt;
+			printf(" %12.1f", rate);
+		}
+		else
+		{
+			printf(" %12s", "-");
+		}
+		if (e->type == DD_SHM_HISTOGRAM)
+		{
+			printf(" %10llu %10llu %10llu", (unsigned long long)e->p50,
+			       (unsigned long long)e->p99, (unsigned long long)e->max);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+
+/******************************************************************************/
+int main(int argc, char *argv[])
+{
+	const struct dd_shm *shm;
+	int opt, interval = 1000, count = -1, batch = 0, n;
+
+	while ((opt = getopt(argc, argv, "i:n:bh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		default:
+			ddtop_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || interval <= 0)
+	{
+		ddtop_usage(argv[0]);
+		return 1;
+	}
+
+	shm = ddtop_attach(argv[optind]);
+	if (!shm)
+	{
+		return 1;
+	}
+
+	for (n = 0; count < 0 || n < count; n++)
+	{
+		if (n > 0)
+		{
+			usleep((useconds_t)interval * 1000);
+		}
+		if (dd_shm_read(shm, &ddtop_cur, 1000))
+		{
+			fprintf(stderr, "ddtop: could not read consistent snapshot\n");
+			continue;
+		}
+		if (!batch)
+		{
+			printf("\033[H\033[J");
+		}
+		else if (n > 0)
+		{
+			printf("\n");
+		}
+		ddtop_print(n == 0);
+		memcpy(&ddtop_prev, &ddtop_cur, sizeof(ddtop_prev));
+
+		if (kill(ddtop_cur.header.pid, 0) && errno == ESRCH)
+		{
+			printf("\nprocess %d has exited\n", (int)ddtop_cur.header.pid);
+			break;
+		}
+	}
+
+	return 0;
+}
+
@@ -8,294 +8,1304 @@
 /******************************************************************************/
 /* INCLUDES */
 #include "debug.h"
+#include "heapprof.h"
+#include "guard.h"
+#include "memtag.h"
+#include "metrics.h"
+#include "ddthread.h"
+#include <sys/mman.h>
+
+/* Memory behind rec_malloc(), slab allocator when built with _DD_MALLOC. */
+#ifdef _DD_MALLOC
+#include "ddmalloc.h"
+#define REC_MEM_ALLOC(n) dd_malloc(n)
+#define REC_MEM_FREE(x) dd_free(x)
+#else
+#define REC_MEM_ALLOC(n) _mm_malloc(n, 16)
+#define REC_MEM_FREE(x) _mm_free(x)
+#endif
+
+
+/******************************************************************************/
+/**
+ * Allocate memory for rec_malloc(). Sampled allocations go to guarded
+ * pages when dd_guard_start() has been called.
+ */
+static __inline__ void *rec_mem_alloc(size_t n, const char *file, int line)
+{
+	void *x = dd_guard_alloc(n, file, line);
+	return x ? x : REC_MEM_ALLOC(n);
+}
+
+
+/******************************************************************************/
+static __inline__ void rec_mem_free(void *x, const char *file, int line)
+{
+	if (dd_guard_owns(x))
+	{
+		dd_guard_free(x, file, line);
+	}
+	else
+	{
+		REC_MEM_FREE(x);
+	}
+}
+
+
+/** Header in front of tagged allocations, keeps 16 byte alignment. */
+struct rec_tag_head
+{
+	uint32_t tag;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+
+/* If debugging is turned off. */
+#ifndef _DEBUG_REC
+void *rec_malloc(int x)
+{
+	void *p = rec_mem_alloc(x, NULL, 0);
+	heapprof_alloc(p, x);
+	return (p);
+}
+void rec_mfree(void *x)
+{
+	heapprof_free(x);
+	rec_mem_free(x, NULL, 0);
+}
+void *rec_malloc_tagged(int tag, int x)
+{
+	struct rec_tag_head *h = rec_malloc(x + sizeof(*h));
+	if (!h)
+	{
+		return (NULL);
+	}
+	h->tag = tag;
+	h->size = x;
+	dd_tag_alloc(tag, x);
+	return (h + 1);
+}
+void rec_mfree_tagged(void *x)
+{
+	struct rec_tag_head *h = x;
+	if (h)
+	{
+		h--;
+		dd_tag_free(h->tag, h->size);
+		rec_mfree(h);
+	}
+}
+int rec_allocs(void) { return (-1); }
+int rec_frees(void) { return (-1); }
+char *rec_dump(void) { return ("Not in debug mode."); }
+
+
+/* Dont use anything from here if debugging is off. */
+#else
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/** Counter that keeps track of different allocations. */
+int rec_allocsn = 0;
+
+/** Counter that keeps track of different frees. */
+int rec_freesn = 0;
+
+/**
+ * Text rendering of the records, created by rec_dump(). One for each
+ * thread, so concurrent dumps never free a buffer another thread holds.
+ */
+static __thread char *rec_log = NULL;
+
+/** Frees buffer of rec_dump() when its thread exits. */
+static pthread_once_t rec_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rec_log_key;
+
+/** Whether recording has been initialized. */
+int rec_active = 0;
+
+/** Live allocations and resources. */
+static struct ptrtable rec_live;
+
+/** Memory statistics per allocation site. */
+static struct sitestats rec_sites;
+
+/** Live counts of resources from rec_alloc() and rec_free(), by name. */
+static struct resgauge rec_gauges;
+
+/** Deduplicated call stacks of allocations. */
+static struct stacktab rec_stacktab;
+
+/** Depth of call stacks captured, 0 when disabled. */
+static int rec_stack_depth = 0;
+
+/** Fork handlers are registered only once. */
+static pthread_once_t rec_atfork_once = PTHREAD_ONCE_INIT;
+
+/** Metrics are registered only once. */
+static pthread_once_t rec_metrics_once = PTHREAD_ONCE_INIT;
+
+/** Enable debug recording or not. */
+int debug_enable = 1;
+
+/** All record chunks from all threads, newest first. */
+static struct rec_chunk *rec_chunks = NULL;
+
+/** Current record chunk of this thread. */
+static __thread struct rec_chunk *rec_chunk_cur = NULL;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+/** Lock tracking tables before fork(). */
+static void rec_atfork_prepare(void)
+{
+	stacktab_lock_all(&rec_stacktab);
+	ptrtable_lock_all(&rec_live);
+}
+
+
+/******************************************************************************/
+/** Unlock tracking tables after fork(), in both parent and child. */
+static void rec_atfork_release(void)
+{
+	ptrtable_unlock_all(&rec_live);
+	stacktab_unlock_all(&rec_stacktab);
+}
+
+
+/******************************************************************************/
+static void rec_atfork_register(void)
+{
+	pthread_atfork(rec_atfork_prepare, rec_atfork_release, rec_atfork_release);
+}
+
+
+/******************************************************************************/
+static double rec_metric_allocs(void *arg)
+{
+	(void)arg;
+	return (double)__atomic_load_n(&rec_allocsn, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+static double rec_metric_frees(void *arg)
+{
+	(void)arg;
+	return (double)__atomic_load_n(&rec_freesn, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/** Export resource gauges of rec_alloc() and rec_free() into metrics. */
+static void rec_metrics_collect(int fd, void *arg)
+{
+	static const char *names[] = {
+		"dd_rec_resources", "dd_rec_resources_peak",
+		"dd_rec_resource_allocs_total", "dd_rec_resource_frees_total"
+	};
+	static const char *helps[] = {
+		"Live resources from rec_alloc(), by name.",
+		"Highest number of live resources, by name.",
+		"Calls to rec_alloc(), by name.",
+		"Calls to rec_free(), by name."
+	};
+	struct resgauge_info *list;
+	char labels[64];
+	size_t i, n;
+	int j;
+
+	(void)arg;
+	list = malloc(RESGAUGE_SLOTS * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	n = resgauge_list(&rec_gauges, list, RESGAUGE_SLOTS);
+	for (j = 0; n > 0 && j < 4; j++)
+	{
+		dd_metrics_family(fd, names[j], j < 2 ? DD_METRIC_GAUGE : DD_METRIC_COUNTER, helps[j]);
+		for (i = 0; i < n; i++)
+		{
+			labels[0] = '\0';
+			dd_metrics_label(labels, sizeof(labels), "name", list[i].name);
+			dd_metrics_sample(fd, names[j], labels,
+			                  j == 0 ? (double)list[i].live :
+			                  j == 1 ? (double)list[i].peak :
+			                  j == 2 ? (double)list[i].allocs : (double)list[i].frees);
+		}
+	}
+	free(list);
+}
+
+
+/******************************************************************************/
+static void rec_metrics_register(void)
+{
+	dd_metric_callback(DD_METRIC_COUNTER, "dd_rec_allocs_total", NULL,
+	                   "Calls to allocation functions since rec_init().", rec_metric_allocs, NULL);
+	dd_metric_callback(DD_METRIC_COUNTER, "dd_rec_frees_total", NULL,
+	                   "Calls to free functions since rec_init().", rec_metric_frees, NULL);
+	dd_metrics_collector(rec_metrics_collect, NULL);
+}
+
+
+/******************************************************************************/
+/**
+	Initialize allocation record logging. Counters and resource gauges
+	are published into metrics, see dd_metrics_export().
+*/
+void rec_init(void)
+{
+	pthread_once(&rec_atfork_once, rec_atfork_register);
+	pthread_once(&rec_metrics_once, rec_metrics_register);
+
+	rec_allocsn = 0;
+	rec_freesn = 0;
+	ptrtable_clear(&rec_live);
+	__atomic_store_n(&rec_active, 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+	Deinitialize allocation record logging.
+	Notice! This will NOT free debug record log so that it can be used
+	even after calling NET_Quit(). Use only in debug mode, generates
+	a memory leak.
+*/
+void rec_quit(void)
+{
+	__atomic_store_n(&rec_active, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+	Get monotonic timestamp in nanoseconds for records.
+*/
+static uint64_t rec_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/******************************************************************************/
+/**
+	Get cheap timestamp in nanoseconds for live allocations. Resolution
+	is only a few milliseconds but reading it costs next to nothing.
+*/
+static uint64_t rec_time_coarse(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/******************************************************************************/
+/**
+	Reserve next free record entry for this thread. Chunks are owned by
+	one thread only, so no locking is needed. New chunks are pushed into
+	the global chunk list without locks so that rec_dump() can find them.
+
+	@return Pointer to entry or NULL if out of memory.
+*/
+static struct rec_entry *rec_entry_get(void)
+{
+	struct rec_chunk *c = rec_chunk_cur;
+
+	if (c && c->n < REC_CHUNK_ENTRIES)
+	{
+		return (&c->entries[c->n]);
+	}
+
+	c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+	{
+		return (NULL);
+	}
+	c->thread = dd_thread_id();
+	c->n = 0;
+	c->next = __atomic_load_n(&rec_chunks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rec_chunks, &c->next, c, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	rec_chunk_cur = c;
+
+	return (&c->entries[0]);
+}
+
+
+/******************************************************************************/
+/**
+	Publish entry reserved with rec_entry_get().
+*/
+static void rec_entry_put(void)
+{
+	struct rec_chunk *c = rec_chunk_cur;
+	__atomic_store_n(&c->n, c->n + 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+	Add binary record. Strings given must stay valid for the lifetime
+	of the process (string literals and __FILE__ are fine).
+*/
+static void rec_event(int type, const char *name, const char *str, void *id,
+                      size_t size, char *file, int line)
+{
+	struct rec_entry *e;
+
+	if (!__atomic_load_n(&rec_active, __ATOMIC_ACQUIRE) || debug_enable == 0)
+	{
+		return;
+	}
+
+	e = rec_entry_get();
+	if (!e)
+	{
+		return;
+	}
+	e->time = rec_time();
+	e->type = type;
+	e->thread = rec_chunk_cur->thread;
+	e->name = name;
+	e->str = str;
+	e->id = id;
+	e->size = size;
+	e->file = file;
+	e->line = line;
+	rec_entry_put();
+}
+
+
+/******************************************************************************/
+/**
+	Add record to log buffer. Only a fixed size binary entry is stored,
+	text is created when rec_dump() is called.
+	
+	@param name Log name identifier.
+	@param str Pointer to string to be added. It is copied and truncated
+	           to REC_TEXT_SIZE - 1 characters.
+*/
+void rec_add(const char *name, const char *str, void *id, char *file, int line)
+{
+	struct rec_entry *e;
+
+	if (!__atomic_load_n(&rec_active, __ATOMIC_ACQUIRE) || debug_enable == 0)
+	{
+		return;
+	}
+
+	e = rec_entry_get();
+	if (!e)
+	{
+		return;
+	}
+	e->time = rec_time();
+	e->type = REC_TYPE_TEXT;
+	e->thread = rec_chunk_cur->thread;
+	e->name = name;
+	e->str = NULL;
+	strncpy(e->text, str, sizeof(e->text) - 1);
+	e->text[sizeof(e->text) - 1] = '\0';
+	e->id = id;
+	e->size = 0;
+	e->file = file;
+	e->line = line;
+	rec_entry_put();
+}
+
+
+/******************************************************************************/
+/**
+	Capture call stack into stack table if enabled with rec_stacks().
+
+	@param skip Number of callers to skip, 0 to start from the caller.
+	@return Stack id or 0 if stack capture is disabled.
+*/
+__attribute__((noinline)) uint32_t rec_stack_capture(int skip)
+{
+	int depth = __atomic_load_n(&rec_stack_depth, __ATOMIC_RELAXED);
+	uint32_t id = 0;
+
+	if (depth > 0)
+	{
+		id = stacktab_capture(&rec_stacktab, depth, skip + 1);
+	}
+	/* Keep this frame on stack, a tail call would break skip count. */
+	__asm__ __volatile__("" ::: "memory");
+
+	return id;
+}
+
+
+/******************************************************************************/
+/**
+	Add allocation into live allocations table.
+*/
+static void rec_live_add(const char *name, void *ptr, size_t size,
+                         uint32_t stack, const char *file, uintptr_t line)
+{
+	struct ptrtable_entry e;
+
+	if (!__atomic_load_n(&rec_active, __ATOMIC_ACQUIRE) || debug_enable == 0)
+	{
+		return;
+	}
+
+	e.ptr = ptr;
+	e.size = size;
+	e.name = name;
+	e.file = file;
+	e.line = line;
+	e.stack = stack;
+	e.thread = dd_thread_id();
+	e.time = rec_time_coarse();
+	ptrtable_insert(&rec_live, &e);
+}
+
+
+/******************************************************************************/
+/**
+	Track allocation made outside rec_malloc(), without adding a record
+	into the record log. Used by malloc() replacements.
+
+	@param ptr Allocated memory.
+	@param size Size of allocation.
+	@param stack Stack id from rec_stack_capture() or 0.
+	@param file File of allocation site or NULL.
+	@param line Line of allocation site, or return address if file is NULL.
+*/
+void rec_track_alloc(void *ptr, size_t size, uint32_t stack,
+                     const char *file, uintptr_t line)
+{
+	if (ptr && __atomic_load_n(&rec_active, __ATOMIC_ACQUIRE) && debug_enable)
+	{
+		struct dd_thread *t = dd_thread_self();
+
+		rec_live_add("malloc", ptr, size, stack, file, line);
+		sitestats_alloc(&rec_sites, file, line, size);
+		if (t)
+		{
+			dd_thread_count(&t->allocs, 1);
+			dd_thread_count(&t->alloc_bytes, size);
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+	Stop tracking allocation, see rec_track_alloc().
+
+	@return 0 if allocation was tracked, -1 if not.
+*/
+int rec_track_free(void *ptr)
+{
+	struct ptrtable_entry e;
+
+	return rec_track_take(ptr, &e);
+}
+
+
+/******************************************************************************/
+/**
+	Stop tracking allocation and get its entry, so that it can be given
+	back with rec_track_restore() if releasing the memory fails.
+
+	@return 0 if allocation was tracked, -1 if not.
+*/
+int rec_track_take(void *ptr, struct ptrtable_entry *e)
+{
+	struct dd_thread *t;
+
+	if (ptrtable_remove(&rec_live, ptr, e))
+	{
+		return (-1);
+	}
+	sitestats_free(&rec_sites, e->file, e->line, e->size);
+	t = dd_thread_self();
+	if (t)
+	{
+		dd_thread_count(&t->frees, 1);
+	}
+
+	return (0);
+}
+
+
+/******************************************************************************/
+/**
+	Track allocation again with entry from rec_track_take(). Site
+	statistics count it as a new allocation from the same site.
+*/
+void rec_track_restore(const struct ptrtable_entry *e)
+{
+	ptrtable_insert(&rec_live, e);
+	sitestats_alloc(&rec_sites, e->file, e->line, e->size);
+}
+
+
+/******************************************************************************/
+/**
+	Allocate memory and add debugging record. This is same as malloc()
+	but adds DNET internal resource allocation record automatically.
+
+	@param n Amount of memory to be allocated.
+	@return Pointer to memory allocated ot NULL on errors.
+*/
+void *_rec_malloc(unsigned int n, char *file, int line)
+{
+	/* Variables. */
+	void *x;
+
+	/* Allocate. */
+	x = rec_mem_alloc(n, file, line);
+	heapprof_alloc(x, n);
+	__atomic_add_fetch(&rec_allocsn, 1, __ATOMIC_RELAXED);
+	rec_event(REC_TYPE_MALLOC, "malloc", "Allocated new memory %lu bytes.",
+	          x, n, file, line);
+	rec_track_alloc(x, n, rec_stack_capture(1), file, line);
+
+	/* Return. */
+	return (x);
+}
+
+
+/******************************************************************************/
+/**
+	Free memory and add debugging record. Same as free(). (see: rec_malloc())
+	
+	@param x Pointer to memory to be freed.
+*/
+void _rec_mfree(void *x, char *file, int line)
+{
+	if (x)
+	{
+		rec_event(REC_TYPE_MFREE, "free", "Memory freed.", x, 0, file, line);
+		__atomic_add_fetch(&rec_freesn, 1, __ATOMIC_RELAXED);
+
+		/* Forget address before releasing it, malloc may hand it out again at once. */
+		if (rec_track_free(x))
+		{
+			rec_event(REC_TYPE_ERROR, "free error",
+			          "Tried to free unallocated memory.", x, 0, file, line);
+		}
+		heapprof_free(x);
+		rec_mem_free(x, file, line);
+	}
+}
+
+
+/******************************************************************************/
+/**
+	Allocate memory charged to tag, see dd_tag_register(). Must be freed
+	with rec_mfree_tagged().
+
+	@param tag Tag to charge.
+	@param n Amount of memory to be allocated.
+	@return Pointer to memory allocated ot NULL on errors.
+*/
+void *_rec_malloc_tagged(int tag, unsigned int n, char *file, int line)
+{
+	struct rec_tag_head *h;
+
+	h = _rec_malloc(n + sizeof(*h), file, line);
+	if (!h)
+	{
+		return (NULL);
+	}
+	h->tag = tag;
+	h->size = n;
+	dd_tag_alloc(tag, n);
+
+	return (h + 1);
+}
+
+
+/******************************************************************************/
+/**
+	Free memory allocated with rec_malloc_tagged().
+
+	@param x Pointer to memory to be freed.
+*/
+void _rec_mfree_tagged(void *x, char *file, int line)
+{
+	struct rec_tag_head *h = x;
+
+	if (h)
+	{
+		h--;
+		dd_tag_free(h->tag, h->size);
+		_rec_mfree(h, file, line);
+	}
+}
+
+
+/******************************************************************************/
+/**
+	Add record to DNET internal allocation record. Used example when creating
+	new thread or allocating new semaphore. First parameter should be name
+	of the resource allocated and same name should be used in rec_free().
+
+	@param name Name of resource just allocated.
+	@param pointer Pointer identifier for allocation.
+*/
+void _rec_alloc(const char *name, void *pointer, char *file, int line)
+{
+	__atomic_add_fetch(&rec_allocsn, 1, __ATOMIC_RELAXED);
+	resgauge_alloc(&rec_gauges, name);
+	rec_event(REC_TYPE_ALLOC, name, "Resource allocated.", pointer, 0,
+	          file, line);
+	rec_live_add(name, pointer, 0, rec_stack_capture(1), file, line);
+}
+
+
+/******************************************************************************/
+/**
+	See rec_alloc().
+
+	@param name Name of resource just freed.
+	@param pointer Pointer identifier for free.
+*/
+void _rec_free(const char *name, void *pointer, char *file, int line)
+{
+	__atomic_add_fetch(&rec_freesn, 1, __ATOMIC_RELAXED);
+	resgauge_free(&rec_gauges, name);
+	rec_event(REC_TYPE_FREE, name, "Resource freed.", pointer, 0,
+	          file, line);
+
+	if (ptrtable_remove(&rec_live, pointer, NULL))
+	{
+		rec_event(REC_TYPE_ERROR, "free error",
+		          "Tried to free unallocated resource.", pointer, 0,
+		          file, line);
+	}
+}
+
+
+/******************************************************************************/
+/**
+	Compare records by time, used when merging records of all threads.
+*/
+static int rec_entry_cmp(const void *a, const void *b)
+{
+	const struct rec_entry *ea = *(const struct rec_entry **)a;
+	const struct rec_entry *eb = *(const struct rec_entry **)b;
+
+	if (ea->time < eb->time) return (-1);
+	if (ea->time > eb->time) return (1);
+	return ((ea < eb) ? -1 : (ea > eb));
+}
+
+
+/******************************************************************************/
+static void rec_log_free(void *buf)
+{
+	free(buf);
+	rec_log = NULL;
+}
+
+
+/******************************************************************************/
+static void rec_log_setup(void)
+{
+	pthread_key_create(&rec_log_key, rec_log_free);
+}
+
+
+/******************************************************************************/
+/**
+	Dump current debug records log. Records of all threads are merged
+	in time order and rendered as text.
+
+	@return Pointer to log buffer, valid until next call to rec_dump()
+	        from the same thread.
+*/
+char *rec_dump(void)
+{
+	struct rec_chunk *c, *head;
+	struct rec_entry **list;
+	size_t count = 0, i, len = 0, size = 0;
+	char *buf = NULL, *t;
+	int n;
+
+	head = __atomic_load_n(&rec_chunks, __ATOMIC_ACQUIRE);
+	for (c = head; c; c = c->next)
+	{
+		count += __atomic_load_n(&c->n, __ATOMIC_ACQUIRE);
+	}
+	if (count == 0)
+	{
+		return ("Log is empty.");
+	}
+
+	list = malloc(count * sizeof(*list));
+	if (!list)
+	{
+		return ("Out of memory.");
+	}
+	/* Chunks may have grown since counting, never take more than counted. */
+	for (c = head, i = 0; c && i < count; c = c->next)
+	{
+		unsigned int j, m = __atomic_load_n(&c->n, __ATOMIC_ACQUIRE);
+		for (j = 0; j < m && i < count; j++)
+		{
+			list[i++] = &c->entries[j];
+		}
+	}
+	count = i;
+	qsort(list, count, sizeof(*list), rec_entry_cmp);
+
+	for (i = 0; i < count; i++)
+	{
+		struct rec_entry *e = list[i];
+		char str[REC_TEXT_SIZE + 64];
+
+		if (e->type == REC_TYPE_MALLOC)
+		{
+			snprintf(str, sizeof(str), e->str, (unsigned long)e->size);
+		}
+		else
+		{
+			snprintf(str, sizeof(str), "%s", e->str ? e->str : e->text);
+		}
+
+		while (1)
+		{
+			n = snprintf(buf ? buf + len : NULL, buf ? size - len : 0,
+			             "0x%08lx - %s: %s (%s@%d) [%s]\n", (unsigned long)e->id,
+			             e->name, str, e->file, e->line, dd_thread_name(e->thread));
+			if (buf && len + n < size)
+			{
+				break;
+			}
+			size = size ? size * 2 : 4096;
+			while (size <= len + n) size *= 2;
+			t = realloc(buf, size);
+			if (!t)
+			{
+				free(list);
+				free(buf);
+				return ("Out of memory.");
+			}
+			buf = t;
+		}
+		len += n;
+	}
+	free(list);
+
+	pthread_once(&rec_log_once, rec_log_setup);
+	free(rec_log);
+	rec_log = buf;
+	pthread_setspecific(rec_log_key, rec_log);
+
+	return (rec_log);
+}
+
+
+/******************************************************************************/
+/**
+	Returns number of current calls to allocation functions.
+	
+	@return Number of allocations.
+*/
+int rec_allocs(void)
+{
+	return (rec_allocsn);
+}
 
 
-/* If debugging is turned off. */
-#ifndef _DEBUG_REC
-void *rec_malloc(int x) { return (_mm_malloc(x, 16)); }
-void rec_mfree(void *x) { _mm_free(x); }
-int rec_allocs(void) { return (-1); }
-int rec_frees(void) { return (-1); }
-char *rec_dump(void) { return ("Not in debug mode."); }
+/******************************************************************************/
+/**
+	Returns number of current calls to free functions.
+	
+	@return Number of frees.
+*/
+int rec_frees(void)
+{
+	return (rec_freesn);
+}
 
 
-/* Dont use anything from here if debugging is off. */
-#else
+/******************************************************************************/
+/**
+	Returns snapshot of allocations and resources not freed.
+	Walk it with ptrtable_iter_next() and release with ptrtable_iter_free().
+
+	@return Snapshot or NULL if out of memory.
+*/
+struct ptrtable_iter *rec_respointers(void)
+{
+	return (ptrtable_snapshot(&rec_live));
+}
 
 
 /******************************************************************************/
-/* VARIABLES */
+/**
+	Print memory statistics of top allocation sites.
 
-/** Counter that keeps track of different allocations. */
-int rec_allocsn = 0;
+	@param fd Where to print.
+	@param n Number of sites to print, 0 for all.
+	@param order SITESTATS_ORDER_LIVE to sort by live bytes or
+	             SITESTATS_ORDER_CHURN to sort by total bytes allocated.
+*/
+void rec_report(int fd, int n, int order)
+{
+	sitestats_report(&rec_sites, fd, n > 0 ? n : 0, order);
+}
 
-/** Counter that keeps track of different frees. */
-int rec_freesn = 0;
 
-/** Log buffer. Record everything as text in here. */
-char *rec_log = NULL;
+/******************************************************************************/
+/**
+	Enable or disable call stack capture for rec_malloc() and rec_alloc().
+	Each allocation stores only an id of the stack, stacks themselves are
+	stored once into a deduplicated stack table.
+
+	@param depth Maximum number of frames to capture, 0 to disable.
+*/
+void rec_stacks(int depth)
+{
+	void *frames[1];
 
-/** Size of record log currently. */
-int rec_logn = 1;
+	if (depth > STACKTAB_DEPTH)
+	{
+		depth = STACKTAB_DEPTH;
+	}
+	/* First backtrace() may load libraries and allocate, do it here. */
+	if (depth > 0)
+	{
+		stacktab_backtrace(frames, 1, 0);
+	}
+	__atomic_store_n(&rec_stack_depth, depth > 0 ? depth : 0, __ATOMIC_RELAXED);
+}
 
-/** Record loggging semaphore. */
-semt rec_sem = SEM_ERROR;
 
-/** Address buffer. */
-unsigned int addrs[1024];
+/******************************************************************************/
+/**
+	Print call stack captured for allocation.
 
-/** Enable debug recording or not. */
-int debug_enable = 1;
+	@param id Stack id from struct ptrtable_entry.
+	@param fd Where to print.
+*/
+void rec_stack_print(uint32_t id, int fd)
+{
+	stacktab_print(&rec_stacktab, id, fd);
+}
 
 
 /******************************************************************************/
-/* FUNCTIONS */
+/**
+	Get live count and high-water mark of resource allocated with
+	rec_alloc(), such as "semaphore" or "thread".
+
+	@param name Name of resource.
+	@param info Where to store state.
+	@return 0 on success, -1 if resource has never been allocated.
+*/
+int rec_gauge(const char *name, struct resgauge_info *info)
+{
+	return resgauge_info(&rec_gauges, name, info);
+}
+
 
 /******************************************************************************/
 /**
-	Initialize allocation record logging.
+	Get live counts and high-water marks of all resources.
+
+	@param list Where to store states.
+	@param max Size of list.
+	@return Number of resources stored.
 */
-void rec_init(void)
+size_t rec_gauges_list(struct resgauge_info *list, size_t max)
 {
-	rec_allocsn = 0;
-	rec_freesn = 0;
-	rec_log = NULL;
-	rec_logn = 1;
-	rec_sem = semt_create(1);
-	rec_allocsn--;
-	memset(addrs, 0, sizeof(addrs));
+	return resgauge_list(&rec_gauges, list, max);
 }
 
 
 /******************************************************************************/
 /**
-	Deinitialize allocation record logging.
-	Notice! This will NOT free debug record log so that it can be used
-	even after calling NET_Quit(). Use only in debug mode, generates
-	a memory leak.
+	Print live counts and high-water marks of all resources.
+
+	@param fd Where to print.
 */
-void rec_quit(void)
+void rec_report_gauges(int fd)
 {
-	/* Variables. */
-	semt t;
-	
-	t = rec_sem;
-	rec_sem = NULL;
-	semt_free(t);
-	rec_freesn--;
+	resgauge_report(&rec_gauges, fd);
+}
+
+
+/** Live allocations summed per call stack, used by rec_report_stacks(). */
+struct rec_stack_sum
+{
+	uint32_t stack;
+	size_t count;
+	size_t bytes;
+};
+
+
+/******************************************************************************/
+static int rec_stack_cmp_id(const void *a, const void *b)
+{
+	const struct ptrtable_entry *ea = a, *eb = b;
+	return (ea->stack > eb->stack) - (ea->stack < eb->stack);
+}
+
+
+/******************************************************************************/
+static int rec_stack_cmp_bytes(const void *a, const void *b)
+{
+	const struct rec_stack_sum *sa = a, *sb = b;
+	return (sb->bytes > sa->bytes) - (sb->bytes < sa->bytes);
 }
 
 
 /******************************************************************************/
 /**
-	Add record to log buffer.
-	
-	@param name Log name identifier.
-	@param str Pointer to string to be added.
+	Print live allocations grouped by call stack, largest first.
+	Stack capture must have been enabled with rec_stacks().
+
+	@param fd Where to print.
+	@param n Number of stacks to print, 0 for all.
 */
-void rec_add(const char *name, const char *str, void *id, char *file, int line)
+void rec_report_stacks(int fd, int n)
 {
-	/* Variables. */
-	char buf[320];
-	char *t;
-	
-	if (rec_sem == NULL || debug_enable == 0)
+	struct ptrtable_iter *it;
+	struct rec_stack_sum *sums;
+	size_t i, j;
+
+	it = ptrtable_snapshot(&rec_live);
+	if (!it)
 	{
 		return;
 	}
-
-	semt_wait(rec_sem);
-
-	sprintf(buf, "0x%08x - %s: %s (%s@%d)\n", (unsigned long)id, name,
-	        str, file, line);
-
-	if (rec_log)
+	sums = malloc((it->count + 1) * sizeof(*sums));
+	if (!sums)
 	{
-		t = realloc(rec_log, rec_logn + strlen(buf));
+		ptrtable_iter_free(it);
+		return;
 	}
-	else
+
+	qsort(it->entries, it->count, sizeof(*it->entries), rec_stack_cmp_id);
+	for (i = 0, j = 0; i < it->count; i++)
 	{
-		t = realloc(rec_log, rec_logn + strlen(buf));
-		if (t)
+		if (j == 0 || sums[j - 1].stack != it->entries[i].stack)
 		{
-			memset(t, '\0', rec_logn + strlen(buf));
+			sums[j].stack = it->entries[i].stack;
+			sums[j].count = 0;
+			sums[j].bytes = 0;
+			j++;
 		}
+		sums[j - 1].count++;
+		sums[j - 1].bytes += it->entries[i].size;
 	}
-	
-	if (t)
+	ptrtable_iter_free(it);
+	qsort(sums, j, sizeof(*sums), rec_stack_cmp_bytes);
+
+	for (i = 0; i < j && (n <= 0 || i < (size_t)n); i++)
 	{
-		rec_log = t;
-		rec_logn += (int)strlen(buf);
-		strcat(rec_log, buf);
+		dprintf(fd, "%lu bytes in %lu allocations from stack #%u:\n",
+		        (unsigned long)sums[i].bytes, (unsigned long)sums[i].count,
+		        sums[i].stack);
+		if (sums[i].stack)
+		{
+			rec_stack_print(sums[i].stack, fd);
+		}
+		else
+		{
+			dprintf(fd, "(no stack)\n");
+		}
 	}
 
-	semt_post(rec_sem);
+	free(sums);
 }
 
 
 /******************************************************************************/
-/**
-	Allocate memory and add debugging record. This is same as malloc()
-	but adds DNET internal resource allocation record automatically.
-
-	@param n Amount of memory to be allocated.
-	@return Pointer to memory allocated ot NULL on errors.
-*/
-void *_rec_malloc(unsigned int n, char *file, int line)
+static __inline__ int rec_snapshot_bucket(size_t size)
 {
-	/* Variables. */
-	void *x;
-	char str[320];
-	int i;
+	int b = size ? 64 - __builtin_clzll((unsigned long long)size) : 0;
+	return (b < SITESTATS_BUCKETS) ? b : SITESTATS_BUCKETS - 1;
+}
 
-	/* Allocate. */
-	x = _mm_malloc(n, 16);
-	rec_allocsn++;
-	sprintf(str, "Allocated new memory %d bytes.", n);
-	rec_add("malloc", str, x, file, line);
-	
-	for (i = 0; addrs[i] != NULL && i < 1024; i++);
-	addrs[i] = x;
-	
-	/* Return. */
-	return (x);
+
+/******************************************************************************/
+static __inline__ size_t rec_snapshot_hash(const char *file, uintptr_t line, int bucket)
+{
+	uint64_t h = (uint64_t)(uintptr_t)file * 0x9e3779b97f4a7c15ull;
+	h ^= ((uint64_t)line << 6 | (uint64_t)bucket) * 0xff51afd7ed558ccdull;
+	h ^= h >> 29;
+	return (size_t)h;
 }
 
 
 /******************************************************************************/
 /**
-	Free memory and add debugging record. Same as free(). (see: rec_malloc())
-	
-	@param x Pointer to memory to be freed.
-*/
-void _rec_mfree(void *x, char *file, int line)
+ * Find aggregate of site and size class, add new if not found.
+ *
+ * @return aggregate or NULL if out of memory
+ */
+static struct rec_snapshot_site *rec_snapshot_get(struct rec_snapshot *s, const char *file,
+                                                  uintptr_t line, int bucket)
 {
-	int i;
+	struct rec_snapshot_site *site;
+	size_t i;
 
-	if (x)
+	if ((s->n + 1) * 4 > s->size * 3)
 	{
-		rec_add("free", "Memory freed.", x, file, line);
-		_mm_free(x);
-		rec_freesn++;
-		
-		for (i = 0; i < 1024; i++)
+		struct rec_snapshot_site *old = s->sites;
+		size_t n = s->size;
+
+		s->size = s->size ? s->size * 2 : 256;
+		s->sites = calloc(s->size, sizeof(*s->sites));
+		if (!s->sites)
 		{
-			if (addrs[i] == x)
+			s->sites = old;
+			s->size = n;
+			return NULL;
+		}
+		s->n = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (old[i].used)
 			{
-				addrs[i] = NULL;
-				break;
+				site = rec_snapshot_get(s, old[i].file, old[i].line, old[i].bucket);
+				site->count = old[i].count;
+				site->bytes = old[i].bytes;
 			}
 		}
-		
-		if (i >= 1024)
+		free(old);
+	}
+
+	i = rec_snapshot_hash(file, line, bucket);
+	while (1)
+	{
+		i &= s->size - 1;
+		site = &s->sites[i];
+		if (!site->used)
+		{
+			site->used = 1;
+			site->file = file;
+			site->line = line;
+			site->bucket = bucket;
+			s->n++;
+			return site;
+		}
+		if (site->file == file && site->line == line && site->bucket == bucket)
 		{
-			rec_add("free error", "Tried to free unallocated memory.",
-			        x, file, line);
+			return site;
 		}
+		i++;
+	}
+}
+
+
+/******************************************************************************/
+static void rec_snapshot_add(const struct ptrtable_entry *e, void *arg)
+{
+	struct rec_snapshot *s = arg;
+	struct rec_snapshot_site *site;
+
+	site = rec_snapshot_get(s, e->file, e->line, rec_snapshot_bucket(e->size));
+	if (site)
+	{
+		site->count++;
+		site->bytes += (int64_t)e->size;
+		s->count++;
+		s->bytes += (int64_t)e->size;
 	}
 }
 
 
 /******************************************************************************/
 /**
-	Add record to DNET internal allocation record. Used example when creating
-	new thread or allocating new semaphore. First parameter should be name
-	of the resource allocated and same name should be used in rec_free().
+	Take snapshot of live allocations aggregated by allocation site and
+	size class. Live table is walked one shard at a time, so only a small
+	part of it is locked at once.
 
-	@param name Name of resource just allocated.
-	@param pointer Pointer identifier for allocation.
+	@return snapshot to be released with rec_snapshot_free(), NULL on errors
 */
-void _rec_alloc(const char *name, void *pointer, char *file, int line)
+struct rec_snapshot *rec_snapshot(void)
 {
-	int i;
+	struct rec_snapshot *s;
 
-	rec_allocsn++;
-	rec_add(name, "Resource allocated.", pointer, file, line);
+	s = calloc(1, sizeof(*s));
+	if (!s)
+	{
+		return NULL;
+	}
+	s->time = rec_time();
+	if (ptrtable_foreach(&rec_live, rec_snapshot_add, s))
+	{
+		rec_snapshot_free(s);
+		return NULL;
+	}
 
-	for (i = 0; addrs[i] != NULL && i < 1024; i++);
-	addrs[i] = pointer;
+	return s;
 }
 
 
 /******************************************************************************/
 /**
-	See rec_alloc().
+	Get growth from snapshot a to snapshot b. Result contains sites and size
+	classes that have more live bytes or allocations in b than in a.
 
-	@param name Name of resource just freed.
-	@param pointer Pointer identifier for free.
+	@return difference to be released with rec_snapshot_free(), NULL on errors
 */
-void _rec_free(const char *name, void *pointer, char *file, int line)
+struct rec_snapshot *rec_snapshot_diff(const struct rec_snapshot *a, const struct rec_snapshot *b)
 {
-	int i;
+	struct rec_snapshot *d, *old;
+	struct rec_snapshot_site *site;
+	size_t i;
 
-	rec_freesn++;
-	rec_add(name, "Resource freed.", pointer, file, line);
+	d = calloc(1, sizeof(*d));
+	old = calloc(1, sizeof(*old));
+	if (!d || !old)
+	{
+		free(d);
+		free(old);
+		return NULL;
+	}
+	d->time = b->time - a->time;
+	d->diff = 1;
 
-	for (i = 0; i < 1024; i++)
+	/* Index of a, so that sites of b can be looked up from it. */
+	for (i = 0; i < a->size; i++)
 	{
-		if (addrs[i] == pointer)
+		if (a->sites[i].used)
 		{
-			addrs[i] = NULL;
-			break;
+			site = rec_snapshot_get(old, a->sites[i].file, a->sites[i].line, a->sites[i].bucket);
+			if (!site)
+			{
+				goto out_err;
+			}
+			site->count = a->sites[i].count;
+			site->bytes = a->sites[i].bytes;
 		}
+	}
+	for (i = 0; i < b->size; i++)
+	{
+		int64_t count, bytes;
 
-		if (i >= 1024)
+		if (!b->sites[i].used)
+		{
+			continue;
+		}
+		site = rec_snapshot_get(old, b->sites[i].file, b->sites[i].line, b->sites[i].bucket);
+		if (!site)
 		{
-			rec_add("free error", "Tried to free unallocated resource.",
-			        pointer, file, line);
+			goto out_err;
+		}
+		count = b->sites[i].count - site->count;
+		bytes = b->sites[i].bytes - site->bytes;
+		if (count > 0 || bytes > 0)
+		{
+			site = rec_snapshot_get(d, b->sites[i].file, b->sites[i].line, b->sites[i].bucket);
+			if (!site)
+			{
+				goto out_err;
+			}
+			site->count = count;
+			site->bytes = bytes;
 		}
 	}
-}
-
+	d->count = b->count - a->count;
+	d->bytes = b->bytes - a->bytes;
+	rec_snapshot_free(old);
 
-/******************************************************************************/
-/**
-	Dump current debug records log.
+	return d;
 
-	@return Pointer to log buffer.
-*/
-char *rec_dump(void)
-{
-	if (rec_log == NULL)
-	{
-		return ("Log is empty.");
-	}
-	
-	return (rec_log);
+out_err:
+	rec_snapshot_free(old);
+	rec_snapshot_free(d);
+	return NULL;
 }
 
 
 /******************************************************************************/
-/**
-	Returns number of current calls to allocation functions.
-	
-	@return Number of allocations.
-*/
-int rec_allocs(void)
+static int rec_snapshot_cmp(const void *a, const void *b)
 {
-	return (rec_allocsn);
+	const struct rec_snapshot_site *sa = a, *sb = b;
+	return (sb->bytes > sa->bytes) - (sb->bytes < sa->bytes);
 }
 
 
 /******************************************************************************/
 /**
-	Returns number of current calls to free functions.
-	
-	@return Number of frees.
+	Print snapshot or difference of snapshots, largest sites first.
+
+	@param fd where to print
+	@param n number of sites to print, 0 for all
 */
-int rec_frees(void)
+void rec_snapshot_print(const struct rec_snapshot *s, int fd, int n)
 {
-	return (rec_freesn);
+	struct rec_snapshot_site *list;
+	size_t i, count = 0;
+
+	list = malloc((s->n + 1) * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	for (i = 0; i < s->size; i++)
+	{
+		if (s->sites[i].used)
+		{
+			list[count++] = s->sites[i];
+		}
+	}
+	qsort(list, count, sizeof(*list), rec_snapshot_cmp);
+
+	if (s->diff)
+	{
+		dprintf(fd, "growth in %llu ms: %+lld bytes, %+lld allocations\n",
+		        (unsigned long long)(s->time / 1000000), (long long)s->bytes, (long long)s->count);
+	}
+	else
+	{
+		dprintf(fd, "live: %lld bytes, %lld allocations\n", (long long)s->bytes, (long long)s->count);
+	}
+	dprintf(fd, "%12s %10s %12s  %s\n", "bytes", "count", "sizes below", "site");
+	for (i = 0; i < count && (n <= 0 || i < (size_t)n); i++)
+	{
+		struct rec_snapshot_site *site = &list[i];
+		if (site->file)
+		{
+			dprintf(fd, "%12lld %10lld %12llu  %s:%lu\n", (long long)site->bytes,
+			        (long long)site->count, 1ull << site->bucket, site->file,
+			        (unsigned long)site->line);
+		}
+		else
+		{
+			dprintf(fd, "%12lld %10lld %12llu  0x%lx\n", (long long)site->bytes,
+			        (long long)site->count, 1ull << site->bucket, (unsigned long)site->line);
+		}
+	}
+
+	free(list);
 }
 
 
 /******************************************************************************/
-/**
-	Returns array to pointers not freed.
-*/
-unsigned int rec_respointers(void)
+/** Release snapshot. */
+void rec_snapshot_free(struct rec_snapshot *s)
 {
-	return (addrs);
+	if (s)
+	{
+		free(s->sites);
+		free(s);
+	}
 }
 
 
@@ -321,13 +1331,12 @@ void rec_disable(void)
 /** Start timing recording. */
 void dd_timerec_start(struct timerec *tr)
 {
-	struct timeval tv;
-	
-	gettimeofday(&tv, NULL);
-	tr->ticks_start = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	tr->ticks = 0;
+	tr->ns = 0;
 	tr->sec = 0;
 	tr->msec = 0;
+	tr->perf_ok = dd_perf_on && dd_perf_read(&tr->perf_start) == 0;
+	tr->ticks_start = dd_clock_ticks();
 }
 
 
@@ -335,32 +1344,56 @@ void dd_timerec_start(struct timerec *tr)
 /** Get current timing recording. */
 void dd_timerec_time(struct timerec *tr)
 {
-	struct timeval tv;
-	uint32_t start;
-	
-	gettimeofday(&tv, NULL);
-	tr->ticks = (tv.tv_sec * 1000 + tv.tv_usec / 1000) - tr->ticks_start;
-	tr->sec = tr->ticks / 1000;
-	tr->msec = tr->ticks % 1000;
+	int i;
+
+	tr->ticks = dd_clock_ticks() - tr->ticks_start;
+	tr->ns = dd_clock_ns(tr->ticks);
+	tr->sec = tr->ns / 1000000000ull;
+	tr->msec = (tr->ns / 1000000ull) % 1000;
+	if (tr->perf_ok && dd_perf_read(&tr->perf) == 0)
+	{
+		for (i = 0; i < DD_PERF_COUNTERS; i++)
+		{
+			tr->perf.v[i] -= tr->perf_start.v[i];
+		}
+	}
 }
 
 
 /******************************************************************************/
-/** Print timing recording. */
+/** Print timing recording into file descriptor. */
 void dd_timerec_print(struct timerec *tr, int fd)
 {
-	struct timeval tv;
-	int h, m, s, ms;
-	
-	gettimeofday(&tv, NULL);
-	tr->ticks = (tv.tv_sec * 1000 + tv.tv_usec / 1000) - tr->ticks_start;
-	tr->sec = tr->ticks / 1000;
-	tr->msec = tr->ticks % 1000;
-	h = tr->sec / 3600;
-	m = (tr->sec % 3600) / 60;
-	s = tr->sec % 60;
-	ms = tr->msec;
-	printf("%0.2d:%0.2d:%0.2d.%0.3d\n", h, m, s, ms);
+	unsigned int h, m, s;
+	int i;
+
+	dd_timerec_time(tr);
+	h = (unsigned int)(tr->sec / 3600);
+	m = (unsigned int)((tr->sec % 3600) / 60);
+	s = (unsigned int)(tr->sec % 60);
+	dprintf(fd, "%02u:%02u:%02u.%09llu", h, m, s,
+	        (unsigned long long)(tr->ns % 1000000000ull));
+	if (tr->perf_ok)
+	{
+		for (i = 0; i < DD_PERF_COUNTERS; i++)
+		{
+			dprintf(fd, " %s %llu", dd_perf_name(i), (unsigned long long)tr->perf.v[i]);
+		}
+		if (dd_perf_kind() == DD_PERF_HW && tr->perf.v[0])
+		{
+			dprintf(fd, " IPC %.2f", (double)tr->perf.v[1] / (double)tr->perf.v[0]);
+		}
+	}
+	dprintf(fd, "\n");
+}
+
+
+/******************************************************************************/
+/** Record time since dd_timerec_start() into histogram, in nanoseconds. */
+void dd_timerec_record(struct timerec *tr, struct dd_histogram *h)
+{
+	dd_timerec_time(tr);
+	dd_histogram_record(h, tr->ns);
 }
 
 
@@ -19,6 +19,14 @@
 #include <sys/time.h>
 
 #include "synchro.h"
+#include "ptrtable.h"
+#include "sitestats.h"
+#include "stacktab.h"
+#include "resgauge.h"
+#include "ddclock.h"
+#include "histogram.h"
+#include "cputime.h"
+#include "perfctr.h"
 
 
 /******************************************************************************/
@@ -30,29 +38,31 @@
 #endif
 
 
-/** Macro for recording thread CPU consume. */
-#ifdef _DEBUG__
-/* UNFINISHED: TODO! (or maybe not)... */
+/**
+ * Macro for recording thread CPU consume. Registers calling thread for
+ * CPU accounting under its pthread name, see dd_cputime_register().
+ */
+#ifdef _DEBUG
 #define CPU_TIME_RECORD \
-{ \
-	static long _cpu_time_s = -10000, _cpu_time_us = -10000; \
-	static long _cpu_print = -1;
-	struct timeval _cpu_now; gettimeofday(&_cpu_now, NULL); \
-	if (_cpu_time_s == -10000) { \
-	    _cpu_time_s = now.tv_sec; _cpu_time_us = now.tv_usec; } \
-	if (_cpu_print < (_cpu_time_s * 1000l + _cpu_time_us / 1000l)) { \
-	    _cpu_print = _cpu_time_s * 1000l + _cpu_time_us / 1000l + 1000; } \
-}
+do { \
+	if (!dd_cputime_registered) dd_cputime_register(NULL); \
+} while (0)
 #else
 #define CPU_TIME_RECORD
 #endif
 
+/** Timing recording, see dd_timerec_start(). Ticks are from dd_clock_ticks(). */
 struct timerec
 {
 	uint64_t ticks_start;
 	uint64_t ticks;
+	uint64_t ns;
 	uint64_t sec;
 	uint64_t msec;
+	/** Counter deltas when dd_perf_enable() is on, perf_ok tells if valid. */
+	int perf_ok;
+	struct dd_perf_sample perf_start;
+	struct dd_perf_sample perf;
 };
 
 
@@ -61,21 +71,105 @@ struct timerec
 const char *create_guid(void);
 
 #ifdef _DEBUG_REC
+/** Record entry types. */
+enum {
+	REC_TYPE_TEXT = 0,
+	REC_TYPE_MALLOC,
+	REC_TYPE_MFREE,
+	REC_TYPE_ALLOC,
+	REC_TYPE_FREE,
+	REC_TYPE_ERROR,
+};
+
+/** Maximum length of text copied by rec_add(). */
+#define REC_TEXT_SIZE 48
+
+/** One allocation record, rendered to text only in rec_dump(). */
+struct rec_entry
+{
+	uint64_t time;
+	void *id;
+	const char *name;
+	const char *str;
+	const char *file;
+	size_t size;
+	int line;
+	int type;
+	/** Id of thread, see dd_thread_id(). */
+	int thread;
+	char text[REC_TEXT_SIZE];
+};
+
+/** Number of entries in one record chunk. */
+#define REC_CHUNK_ENTRIES 1023
+
+/** Per-thread chunk of records. */
+struct rec_chunk
+{
+	struct rec_chunk *next;
+	unsigned int thread;
+	unsigned int n;
+	struct rec_entry entries[REC_CHUNK_ENTRIES];
+};
+
+/** Live allocations of one site and size class in snapshot. */
+struct rec_snapshot_site
+{
+	const char *file;
+	uintptr_t line;
+	int bucket;
+	int used;
+	int64_t count;
+	int64_t bytes;
+};
+
+/** Snapshot of live allocations, or difference of two snapshots. */
+struct rec_snapshot
+{
+	uint64_t time;
+	int diff;
+	int64_t count;
+	int64_t bytes;
+	size_t n;
+	size_t size;
+	struct rec_snapshot_site *sites;
+};
+
 void rec_init(void);
 void rec_quit(void);
 void rec_add(const char *, const char *, void *, char *, int);
 void DLLEXP *_rec_malloc(unsigned int, char *, int);
 void DLLEXP _rec_mfree(void *, char *, int);
+void DLLEXP *_rec_malloc_tagged(int, unsigned int, char *, int);
+void DLLEXP _rec_mfree_tagged(void *, char *, int);
 void DLLEXP _rec_alloc(const char *, void *, char *, int);
 void DLLEXP _rec_free(const char *, void *, char *, int);
 #define rec_malloc(n) _rec_malloc(n, __FILE__, __LINE__)
 #define rec_mfree(n) _rec_mfree(n, __FILE__, __LINE__)
+#define rec_malloc_tagged(t, n) _rec_malloc_tagged(t, n, __FILE__, __LINE__)
+#define rec_mfree_tagged(n) _rec_mfree_tagged(n, __FILE__, __LINE__)
 #define rec_alloc(n, m) _rec_alloc(n, m, __FILE__, __LINE__)
 #define rec_free(n, m) _rec_free(n, m, __FILE__, __LINE__)
 char *rec_dump(void);
 int rec_allocs(void);
 int rec_frees(void);
-unsigned int rec_respointers(void);
+struct ptrtable_iter *rec_respointers(void);
+void rec_report(int, int, int);
+void rec_stacks(int);
+uint32_t rec_stack_capture(int);
+void rec_track_alloc(void *, size_t, uint32_t, const char *, uintptr_t);
+int rec_track_free(void *);
+int rec_track_take(void *, struct ptrtable_entry *);
+void rec_track_restore(const struct ptrtable_entry *);
+void rec_stack_print(uint32_t, int);
+void rec_report_stacks(int, int);
+int rec_gauge(const char *, struct resgauge_info *);
+size_t rec_gauges_list(struct resgauge_info *, size_t);
+void rec_report_gauges(int);
+struct rec_snapshot *rec_snapshot(void);
+struct rec_snapshot *rec_snapshot_diff(const struct rec_snapshot *, const struct rec_snapshot *);
+void rec_snapshot_print(const struct rec_snapshot *, int, int);
+void rec_snapshot_free(struct rec_snapshot *);
 
 void rec_enable(void);
 void rec_disable(void);
@@ -86,12 +180,24 @@ void rec_disable(void);
 #define rec_add(x,y,z)
 #define rec_alloc(x,y)
 #define rec_free(x,y)
+#define rec_report(fd,n,order)
+#define rec_stacks(depth)
+#define rec_report_stacks(fd,n)
+#define rec_gauge(name,info) (-1)
+#define rec_gauges_list(list,max) 0
+#define rec_report_gauges(fd)
+#define rec_snapshot() NULL
+#define rec_snapshot_diff(a,b) NULL
+#define rec_snapshot_print(s,fd,n)
+#define rec_snapshot_free(s)
 
 #define rec_enable()
 #define rec_disable()
 
 void *rec_malloc(int x);
 void rec_mfree(void *x);
+void *rec_malloc_tagged(int tag, int x);
+void rec_mfree_tagged(void *x);
 int rec_allocs(void);
 int rec_frees(void);
 char *rec_dump(void);
@@ -101,6 +207,7 @@ char *rec_dump(void);
 void dd_timerec_start(struct timerec *tr);
 void dd_timerec_time(struct timerec *tr);
 void dd_timerec_print(struct timerec *tr, int fd);
+void dd_timerec_record(struct timerec *tr, struct dd_histogram *h);
 char *hexdump(const unsigned char *p, size_t size);
 
 
@@ -17,6 +17,15 @@
 #include "synchro.h"
 #include "linkedlist.h"
 #include "dio.h"
+#include "arena.h"
+#include "pool.h"
+#include "memtag.h"
+#include "profile.h"
+#include "cpuprof.h"
+#include "metrics.h"
+#include "shmstats.h"
+#include "ddthread.h"
+#include "watchdog.h"
 
 
 /* allocate memory for struct, use IF_ERR() to report errors and set memory to zero */
@@ -47,6 +56,62 @@ do { \
 } while (0)
 
 
+/* allocate memory for struct from arena, use IF_ERR() to report errors and set memory to zero */
+#define DD_ARENA_SALLOC(p_arena, p_item) \
+do { \
+	p_item = dd_arena_alloc((p_arena), sizeof(*p_item)); \
+	IF_ERR(p_item == NULL, -1, "dd_arena_alloc() failed"); \
+	memset(p_item, 0, sizeof(*p_item)); \
+} while (0)
+
+
+/* allocate memory from arena, use IF_ERR() to report errors and set memory to zero */
+#define DD_ARENA_ALLOC(p_arena, p_item, size) \
+do { \
+	p_item = dd_arena_alloc((p_arena), (size)); \
+	IF_ERR(p_item == NULL, -1, "dd_arena_alloc() failed"); \
+	memset(p_item, 0, (size)); \
+} while (0)
+
+
+/* copy string into arena, use IF_ERR() to report errors */
+#define DD_ARENA_STRDUP(p_arena, p_item, p_dup) \
+do { \
+	p_item = dd_arena_strdup((p_arena), (p_dup)); \
+	IF_ERR(p_item == NULL, -1, "strdup into arena failed"); \
+} while (0)
+
+
+/* get object from pool declared with DD_POOL_DECLARE(type), use IF_ERR() to report errors */
+#define DD_POOL_ALLOC(type, p_item) \
+do { \
+	p_item = type##_pool_get(); \
+	IF_ERR(p_item == NULL, -1, "pool of " #type " is out of memory"); \
+} while (0)
+
+
+/* allocate memory for struct charged to tag, use IF_ERR() to report errors and set memory to zero */
+#define DD_SALLOC_TAG(tag, p_item) \
+do { \
+	p_item = rec_malloc_tagged((tag), sizeof(*p_item)); \
+	IF_ERR(p_item == NULL, -1, "malloc() failed: %s", strerror(errno)); \
+	memset(p_item, 0, sizeof(*p_item)); \
+} while (0)
+
+
+/* allocate memory charged to tag, use IF_ERR() to report errors and set memory to zero */
+#define DD_ALLOC_TAG(tag, p_item, size) \
+do { \
+	p_item = rec_malloc_tagged((tag), (size)); \
+	IF_ERR(p_item == NULL, -1, "malloc() failed: %s", strerror(errno)); \
+	memset(p_item, 0, (size)); \
+} while (0)
+
+
+/* free memory allocated with DD_SALLOC_TAG() or DD_ALLOC_TAG() */
+#define DD_FREE_TAG(p_item) rec_mfree_tagged(p_item)
+
+
 #endif /* DEBUGLIB_H */
 /******************************************************************************/
 
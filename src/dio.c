@@ -9,17 +9,21 @@
 #include "dio.h"
 
 
+/******************************************************************************/
+DD_POOL_DECLARE_ZERO(dio_object)
+
+
 /******************************************************************************/
 struct dio_object *dio_fopen(const char *file, const char *mode)
 {
     int err = 0;
     struct dio_object *dio = NULL;
 
-    DD_SALLOC(dio);
+    DD_POOL_ALLOC(dio_object, dio);
     dio->type = DIO_TYPE_FILE;
     dio->f = fopen(file, mode);
     if (!dio->f) {
-        free(dio);
+        dio_object_pool_put(dio);
         return NULL;
     }
 
@@ -34,12 +38,12 @@ struct dio_object *dio_mopen(unsigned char *data, size_t len, int dup)
     int err = 0;
     struct dio_object *dio = NULL;
 
-    DD_SALLOC(dio);
+    DD_POOL_ALLOC(dio_object, dio);
     dio->type = DIO_TYPE_MEM;
     if (dup) {
         dio->data = malloc(len);
         if (!dio->data) {
-            free(dio);
+            dio_object_pool_put(dio);
             return NULL;
         }
         memcpy(dio->data, data, len);
@@ -61,10 +65,10 @@ int dio_close(struct dio_object *dio)
 
     if (dio->type == DIO_TYPE_FILE) {
         err = fclose(dio->f);
-        free(dio);
+        dio_object_pool_put(dio);
     } else if (dio->type == DIO_TYPE_MEM) {
         free(dio->data);
-        free(dio);
+        dio_object_pool_put(dio);
     }
 
 out_err:
@@ -5,7 +5,15 @@
  * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
  */
 
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
 #include "dlog.h"
+#include "metrics.h"
+#include "ddthread.h"
+#include "ddclock.h"
 
 
 /******************************************************************************/
@@ -46,6 +54,65 @@ int print_syslog = 0;
 /** whether to use colors or not */
 int colors_enable = 1;
 
+/** whether to start messages with name of thread or not */
+int print_thread = 0;
+
+/** raw descriptor of the log file, used by the signal safe functions */
+static int dlog_fd = -1;
+
+/** extra descriptor for the signal safe functions, see DLog_sigsafe_fd() */
+static int dlog_sigsafe_fd = -1;
+
+/** fork handlers are registered only once */
+static pthread_once_t dlog_atfork_once = PTHREAD_ONCE_INIT;
+
+/** log file stream that was locked before fork() */
+static FILE *dlog_fork_file = NULL;
+
+/** message counters are registered only once */
+static pthread_once_t dlog_metrics_once = PTHREAD_ONCE_INIT;
+
+/** message counters by level, see dlog_count() */
+static int dlog_metrics[5] = { -1, -1, -1, -1, -1 };
+
+/** flight recorder, last messages whether printed or not */
+static struct dlog_flight_entry dlog_flight[DLOG_FLIGHT];
+static uint64_t dlog_flight_next = 0;
+
+
+/******************************************************************************/
+/**
+ * Lock stdio streams used by the log before fork(), so that no other
+ * thread is in the middle of writing to them when the process is copied.
+ */
+static void dlog_atfork_prepare(void)
+{
+	flockfile(stderr);
+	dlog_fork_file = dlog_file;
+	if (dlog_fork_file) flockfile(dlog_fork_file);
+}
+
+
+/******************************************************************************/
+/**
+ * Release stream locks after fork(), both in parent and in child.
+ * In the child the forking thread is the only one left and it owns
+ * the locks, so this leaves the streams usable there too.
+ */
+static void dlog_atfork_release(void)
+{
+	if (dlog_fork_file) funlockfile(dlog_fork_file);
+	dlog_fork_file = NULL;
+	funlockfile(stderr);
+}
+
+
+/******************************************************************************/
+static void dlog_atfork_register(void)
+{
+	pthread_atfork(dlog_atfork_prepare, dlog_atfork_release, dlog_atfork_release);
+}
+
 
 /******************************************************************************/
 /**
@@ -53,8 +120,11 @@ int colors_enable = 1;
  */
 void DLog_init(char *file)
 {
+	pthread_once(&dlog_atfork_once, dlog_atfork_register);
+
 	/* Set log stream. */
 	if (file) dlog_file = fopen(file, "a");
+	dlog_fd = dlog_file ? fileno(dlog_file) : -1;
 	print_stderr = 1;
 	print_syslog = 0;
 }
@@ -66,8 +136,11 @@ void DLog_init(char *file)
  */
 void DLog_init_syslog(char *ident)
 {
+	pthread_once(&dlog_atfork_once, dlog_atfork_register);
+
 	/* Set log stream. */
 	dlog_file = NULL;
+	dlog_fd = -1;
 #ifdef _WIN32
 	print_syslog = 0;
 	print_stderr = 1;
@@ -85,8 +158,11 @@ void DLog_init_syslog(char *ident)
  */
 void DLog_init_callback(void (*callback)(const char *file, const char *function, int line, const char *type, const char *message))
 {
+	pthread_once(&dlog_atfork_once, dlog_atfork_register);
+
 	/* Set log stream. */
 	dlog_file = NULL;
+	dlog_fd = -1;
 	print_syslog = 0;
 	print_stderr = 0;
 	dlog_callback = callback;
@@ -100,6 +176,7 @@ void DLog_init_callback(void (*callback)(const char *file, const char *function,
 void DLog_quit(void)
 {
 	/* Set log stream. */
+	dlog_fd = -1;
 	if (dlog_file) fclose(dlog_file);
 #ifdef _WIN32
 	if (print_syslog) closelog();
@@ -107,6 +184,122 @@ void DLog_quit(void)
 }
 
 
+/******************************************************************************/
+static void dlog_metrics_register(void)
+{
+	static const char *levels[] = { "none", "error", "warning", "info", "debug" };
+	char labels[32];
+	int i;
+
+	for (i = 0; i < 5; i++)
+	{
+		snprintf(labels, sizeof(labels), "level=\"%s\"", levels[i]);
+		dlog_metrics[i] = dd_metric_counter("dd_log_messages_total", labels,
+		                                    "Messages logged with DLog, by level.");
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Count message into metrics.
+ *
+ * @param level 0 for no level, then error, warning, info and debug
+ */
+static void dlog_count(int level)
+{
+	struct dd_thread *t = dd_thread_self();
+
+	pthread_once(&dlog_metrics_once, dlog_metrics_register);
+	dd_counter_inc(dlog_metrics[level]);
+	if (t)
+	{
+		dd_thread_count(&t->logs, 1);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Keep message in flight recorder. Each message gets its own entry by
+ * sequence number, so writers do not wait for each other. Sequence of
+ * entry is odd while it is written.
+ */
+static void dlog_flight_add(int level, int thread, const char *message)
+{
+	uint64_t i = __atomic_fetch_add(&dlog_flight_next, 1, __ATOMIC_RELAXED);
+	struct dlog_flight_entry *e = &dlog_flight[i % DLOG_FLIGHT];
+
+	__atomic_store_n(&e->seq, 2 * i + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->time = dd_clock_now();
+	e->thread = thread;
+	e->level = level;
+	snprintf(e->message, sizeof(e->message), "%s", message);
+	__atomic_store_n(&e->seq, 2 * i + 2, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Format message, starting with name and id of thread if enabled, and
+ * keep it in flight recorder.
+ */
+static void dlog_vformat(int level, char *buf, size_t size, const char *string, va_list args)
+{
+	int n = 0, id = dd_thread_id();
+
+	if (print_thread)
+	{
+		n = snprintf(buf, size, "[%s:%d] ", dd_thread_name(id), id);
+		n = n < 0 ? 0 : ((size_t)n >= size ? (int)size - 1 : n);
+	}
+	vsnprintf(buf + n, size - n, string, args);
+	dlog_flight_add(level, id, buf + n);
+}
+
+
+/******************************************************************************/
+/**
+ * Get copy of flight recorder, oldest message first. Messages that are
+ * being written while copying are left out.
+ *
+ * @param list where to copy, DLOG_FLIGHT entries is always enough
+ * @param max size of list
+ * @return number of messages copied
+ */
+int DLog_flight_get(struct dlog_flight_entry *list, int max)
+{
+	uint64_t i, next = __atomic_load_n(&dlog_flight_next, __ATOMIC_ACQUIRE);
+	struct dlog_flight_entry *e;
+	int n = 0;
+
+	i = next > DLOG_FLIGHT ? next - DLOG_FLIGHT : 0;
+	if (next - i > (uint64_t)max)
+	{
+		i = next - (uint64_t)max;
+	}
+	for (; i < next; i++)
+	{
+		e = &dlog_flight[i % DLOG_FLIGHT];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != 2 * i + 2)
+		{
+			continue;
+		}
+		memcpy(&list[n], e, sizeof(*e));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != 2 * i + 2)
+		{
+			continue;
+		}
+		list[n].message[sizeof(list[n].message) - 1] = '\0';
+		n++;
+	}
+
+	return n;
+}
+
+
 /******************************************************************************/
 /**
  * Print string to LOG. Use like printf().
@@ -116,9 +309,12 @@ void DLog(const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(0);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(0, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -147,9 +343,12 @@ void DLog_flf(char *file, int line, char *func, const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(0);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(0, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -179,9 +378,12 @@ void DLog_e(const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(1);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(1, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -211,9 +413,12 @@ void DLog_flfe(const char *file, int line, const char *func, const char *string,
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(1);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(1, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -244,9 +449,12 @@ void DLog_w(const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(2);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(2, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -276,9 +484,12 @@ void DLog_flfw(const char *file, int line, const char *func, const char *string,
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(2);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(2, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -309,9 +520,12 @@ void DLog_i(const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(3);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(3, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -341,9 +555,12 @@ void DLog_flfi(const char *file, int line, const char *func, const char *string,
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(3);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(3, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -374,9 +591,12 @@ void DLog_d(const char *string, ...)
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(4);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(4, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -406,9 +626,12 @@ void DLog_flfd(const char *file, int line, const char *func, const char *string,
 	va_list args;
 	char buf[512];
 
+	/* Count message. */
+	dlog_count(4);
+
 	/* Get args. */
 	va_start(args, string);
-	vsnprintf(buf, sizeof(buf), string, args);
+	dlog_vformat(4, buf, sizeof(buf), string, args);
 
 	/* Print to log. */
 	if (print_enable)
@@ -430,6 +653,245 @@ void DLog_flfd(const char *file, int line, const char *func, const char *string,
 }
 
 
+/******************************************************************************/
+/**
+ * Append unsigned integer to buffer in given base. Signal safe.
+ */
+static size_t dlog_sigsafe_uint(char *buf, size_t size, size_t n,
+                                unsigned long long v, unsigned int base,
+                                int upper, int width, char pad)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[24];
+	int i = 0;
+
+	do
+	{
+		tmp[i++] = digits[v % base];
+		v /= base;
+	} while (v && i < (int)sizeof(tmp));
+
+	for (; width > i && n < size; width--) buf[n++] = pad;
+	while (i > 0 && n < size) buf[n++] = tmp[--i];
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Minimal printf-style formatter that only touches the stack.
+ * Supports %s, %c, %d, %i, %u, %x, %X, %p and %% with optional
+ * zero padding, width and l, ll or z length modifiers.
+ *
+ * @return length of formatted string, never more than size
+ */
+static size_t dlog_sigsafe_vformat(char *buf, size_t size, const char *fmt, va_list args)
+{
+	size_t n = 0;
+	const char *s;
+	long long sv;
+	unsigned long long uv;
+	int width, lng;
+	char pad;
+
+	for (; *fmt && n < size; fmt++)
+	{
+		if (*fmt != '%')
+		{
+			buf[n++] = *fmt;
+			continue;
+		}
+
+		fmt++;
+		pad = ' ';
+		width = 0;
+		lng = 0;
+		if (*fmt == '0')
+		{
+			pad = '0';
+			fmt++;
+		}
+		for (; *fmt >= '0' && *fmt <= '9'; fmt++) width = width * 10 + (*fmt - '0');
+		for (; *fmt == 'l' || *fmt == 'z'; fmt++) lng += (*fmt == 'z') ? 2 : 1;
+
+		switch (*fmt)
+		{
+		case 's':
+			s = va_arg(args, const char *);
+			if (!s) s = "(null)";
+			while (*s && n < size) buf[n++] = *s++;
+			break;
+		case 'c':
+			buf[n++] = (char)va_arg(args, int);
+			break;
+		case 'd':
+		case 'i':
+			if (lng >= 2) sv = va_arg(args, long long);
+			else if (lng == 1) sv = va_arg(args, long);
+			else sv = va_arg(args, int);
+			if (sv < 0)
+			{
+				buf[n++] = '-';
+				uv = -(unsigned long long)sv;
+				if (width > 0) width--;
+			}
+			else uv = sv;
+			n = dlog_sigsafe_uint(buf, size, n, uv, 10, 0, width, pad);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			if (lng >= 2) uv = va_arg(args, unsigned long long);
+			else if (lng == 1) uv = va_arg(args, unsigned long);
+			else uv = va_arg(args, unsigned int);
+			n = dlog_sigsafe_uint(buf, size, n, uv, *fmt == 'u' ? 10 : 16,
+			                      *fmt == 'X', width, pad);
+			break;
+		case 'p':
+			uv = (unsigned long long)(unsigned long)va_arg(args, void *);
+			if (n + 2 <= size)
+			{
+				buf[n++] = '0';
+				buf[n++] = 'x';
+			}
+			n = dlog_sigsafe_uint(buf, size, n, uv, 16, 0, width, pad);
+			break;
+		case '%':
+			buf[n++] = '%';
+			break;
+		case '\0':
+			return n;
+		default:
+			buf[n++] = '%';
+			if (n < size) buf[n++] = *fmt;
+			break;
+		}
+	}
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Write whole buffer into descriptor, retry on interrupts. Signal safe.
+ */
+static void dlog_sigsafe_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		buf += n;
+		len -= (size_t)n;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Format one log line and write it with a single write() into every
+ * descriptor that is open for signal safe logging.
+ */
+static void dlog_sigsafe_vlog(const char *level, const char *string, va_list args)
+{
+	char buf[512];
+	size_t n = 0;
+	int saved_errno = errno;
+
+	if (!print_enable) return;
+
+	if (level)
+	{
+		while (*level && n < sizeof(buf) - 1) buf[n++] = *level++;
+		buf[n++] = ':';
+	}
+	n += dlog_sigsafe_vformat(buf + n, sizeof(buf) - n - 1, string, args);
+	buf[n++] = '\n';
+
+	if (dlog_fd >= 0) dlog_sigsafe_write(dlog_fd, buf, n);
+	if (print_stderr) dlog_sigsafe_write(STDERR_FILENO, buf, n);
+	if (dlog_sigsafe_fd >= 0) dlog_sigsafe_write(dlog_sigsafe_fd, buf, n);
+
+	errno = saved_errno;
+}
+
+
+/******************************************************************************/
+/**
+ * Print string to LOG from signal handler or from child after fork().
+ * Does not allocate, lock or use stdio. Only writes to log file and
+ * stderr, never to syslog or callback. Supports only a restricted set
+ * of printf() conversions, see dlog_sigsafe_vformat().
+ */
+void DLog_sigsafe(const char *string, ...)
+{
+	va_list args;
+	va_start(args, string);
+	dlog_sigsafe_vlog(NULL, string, args);
+	va_end(args);
+}
+
+
+/******************************************************************************/
+/** Signal safe DLog_e(), see DLog_sigsafe(). */
+void DLog_sigsafe_e(const char *string, ...)
+{
+	va_list args;
+	va_start(args, string);
+	dlog_sigsafe_vlog(el_string, string, args);
+	va_end(args);
+}
+
+
+/******************************************************************************/
+/** Signal safe DLog_w(), see DLog_sigsafe(). */
+void DLog_sigsafe_w(const char *string, ...)
+{
+	va_list args;
+	va_start(args, string);
+	dlog_sigsafe_vlog(wl_string, string, args);
+	va_end(args);
+}
+
+
+/******************************************************************************/
+/** Signal safe DLog_i(), see DLog_sigsafe(). */
+void DLog_sigsafe_i(const char *string, ...)
+{
+	va_list args;
+	va_start(args, string);
+	dlog_sigsafe_vlog(il_string, string, args);
+	va_end(args);
+}
+
+
+/******************************************************************************/
+/** Signal safe DLog_d(), see DLog_sigsafe(). */
+void DLog_sigsafe_d(const char *string, ...)
+{
+	va_list args;
+	va_start(args, string);
+	dlog_sigsafe_vlog(dl_string, string, args);
+	va_end(args);
+}
+
+
+/******************************************************************************/
+/**
+ * Set extra descriptor where signal safe log functions write to,
+ * for example a crash log opened at startup. Use -1 to disable.
+ */
+void DLog_sigsafe_fd(int fd)
+{
+	dlog_sigsafe_fd = fd;
+}
+
+
 /******************************************************************************/
 /** Flush log. */
 void DLog_flush(void)
@@ -486,3 +948,19 @@ void DLog_disable_colors(void)
 }
 
 
+/******************************************************************************/
+/** Start messages with name and id of thread, see dd_thread_register(). */
+void DLog_enable_threads(void)
+{
+	print_thread = 1;
+}
+
+
+/******************************************************************************/
+/** Do not start messages with name of thread. */
+void DLog_disable_threads(void)
+{
+	print_thread = 0;
+}
+
+
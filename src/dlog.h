@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <stdint.h>
 
 
 /******************************************************************************/
@@ -166,6 +167,25 @@ if (colors_enable) fprintf(stderr, LDC_DEFAULT); \
 #endif
 
 
+/******************************************************************************/
+
+/** Number of messages kept in flight recorder. */
+#define DLOG_FLIGHT 64
+
+/** One message in flight recorder, see DLog_flight_get(). */
+struct dlog_flight_entry
+{
+	uint64_t seq;
+	/** Time from dd_clock_now(). */
+	uint64_t time;
+	/** Id of thread in thread registry. */
+	int thread;
+	/** 0 for no level, then error, warning, info and debug. */
+	int level;
+	char message[232];
+};
+
+
 /******************************************************************************/
 /* FUNCTION DEFINITIONS */
 void DLLEXP DLog_init(char *);
@@ -186,7 +206,15 @@ void DLLEXP DLog_flfi(const char *, int, const char *, const char *, ...);
 void DLLEXP DLog_d(const char *, ...);
 void DLLEXP DLog_flfd(const char *, int, const char *, const char *, ...);
 
+void DLLEXP DLog_sigsafe(const char *, ...);
+void DLLEXP DLog_sigsafe_e(const char *, ...);
+void DLLEXP DLog_sigsafe_w(const char *, ...);
+void DLLEXP DLog_sigsafe_i(const char *, ...);
+void DLLEXP DLog_sigsafe_d(const char *, ...);
+void DLLEXP DLog_sigsafe_fd(int);
+
 void DLLEXP DLog_flush(void);
+int DLLEXP DLog_flight_get(struct dlog_flight_entry *, int);
 
 void DLLEXP DLog_enable_stderr(void);
 void DLLEXP DLog_disable_stderr(void);
@@ -194,6 +222,8 @@ void DLLEXP DLog_enable(void);
 void DLLEXP DLog_disable(void);
 void DLLEXP DLog_enable_colors(void);
 void DLLEXP DLog_disable_colors(void);
+void DLLEXP DLog_enable_threads(void);
+void DLLEXP DLog_disable_threads(void);
 
 
 #endif /* END OF HEADER FILE */
@@ -0,0 +1,443 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "guard.h"
+#include "synchro.h"
+#include "dlog.h"
+#include "stacktab.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/*
+ * Guarded area has a guard page, then slot page and guard page for each
+ * slot. Slot pages are accessible only while allocated. Allocations are
+ * placed at the end of their page by random choice, so that either
+ * overflow or underflow hits a guard page. Freed slots go to the tail of
+ * the queue of free slots and are reused last, which keeps them
+ * inaccessible as long as possible.
+ */
+
+__thread int dd_guard_countdown = 0;
+unsigned int dd_guard_gen = 0;
+__thread unsigned int dd_guard_gen_self = 0;
+char *dd_guard_begin = NULL;
+char *dd_guard_end = NULL;
+
+/** Mean allocations between samples, 0 when stopped. */
+static int dd_guard_rate = 0;
+
+static struct dd_guard_slot *dd_guard_slots = NULL;
+static int dd_guard_nslots = 0;
+static size_t dd_guard_page = 0;
+
+/** Queue of free slots, oldest freed first. */
+static int *dd_guard_queue = NULL;
+static int dd_guard_head = 0;
+static int dd_guard_count = 0;
+static int dd_guard_lock_v = 0;
+
+/** Random state of this thread. */
+static __thread uint32_t dd_guard_rnd = 0;
+
+/** Handler that was installed before ours. */
+static struct sigaction dd_guard_old_action;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static uint32_t dd_guard_random(void)
+{
+	uint32_t x = dd_guard_rnd;
+
+	if (x == 0)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		x = (uint32_t)((uintptr_t)&dd_guard_rnd >> 4) ^ (uint32_t)ts.tv_nsec;
+		x |= 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	dd_guard_rnd = x;
+
+	return x;
+}
+
+
+/******************************************************************************/
+static __inline__ char *dd_guard_slot_page(int i)
+{
+	return dd_guard_begin + (size_t)(2 * i + 1) * dd_guard_page;
+}
+
+
+/******************************************************************************/
+static void dd_guard_print_frames(const char *what, void *const *frames, int depth)
+{
+	int i;
+
+	for (i = 0; i < depth; i++)
+	{
+		DLog_sigsafe_e("guard:   %s #%d %p", what, i, frames[i]);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Print allocation and free sites of slot.
+ */
+static void dd_guard_print_slot(struct dd_guard_slot *s)
+{
+	if (s->alloc_file)
+	{
+		DLog_sigsafe_e("guard: allocated at %s:%d", s->alloc_file, s->alloc_line);
+	}
+	else
+	{
+		DLog_sigsafe_e("guard: allocated at");
+	}
+	dd_guard_print_frames("alloc", s->alloc_frames, s->alloc_depth);
+	if (s->state == DD_GUARD_SLOT_FREED)
+	{
+		if (s->free_file)
+		{
+			DLog_sigsafe_e("guard: freed at %s:%d", s->free_file, s->free_line);
+		}
+		else
+		{
+			DLog_sigsafe_e("guard: freed at");
+		}
+		dd_guard_print_frames("free", s->free_frames, s->free_depth);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Find slot that fault address belongs to and describe the error.
+ */
+static void dd_guard_report(char *addr)
+{
+	size_t page = (size_t)(addr - dd_guard_begin) / dd_guard_page;
+	struct dd_guard_slot *s = NULL, *l = NULL, *r = NULL;
+	const char *what = "wild access";
+	char *p;
+
+	if (page & 1)
+	{
+		s = &dd_guard_slots[page / 2];
+		if (s->state == DD_GUARD_SLOT_FREED)
+		{
+			what = "use after free";
+		}
+		else
+		{
+			s = NULL;
+		}
+	}
+	else
+	{
+		/* Guard page, blame closest allocation. */
+		if (page > 0)
+		{
+			l = &dd_guard_slots[page / 2 - 1];
+		}
+		if ((int)(page / 2) < dd_guard_nslots)
+		{
+			r = &dd_guard_slots[page / 2];
+		}
+		if (l && l->state != DD_GUARD_SLOT_FREE &&
+		    (!r || r->state == DD_GUARD_SLOT_FREE ||
+		     addr - ((char *)l->ptr + l->size) <= (char *)r->ptr - addr))
+		{
+			s = l;
+			what = (s->state == DD_GUARD_SLOT_USED) ? "buffer overflow" : "use after free";
+		}
+		else if (r && r->state != DD_GUARD_SLOT_FREE)
+		{
+			s = r;
+			what = (s->state == DD_GUARD_SLOT_USED) ? "buffer underflow" : "use after free";
+		}
+	}
+
+	if (!s)
+	{
+		DLog_sigsafe_e("guard: %s at %p", what, addr);
+		return;
+	}
+	p = s->ptr;
+	if (addr < p)
+	{
+		DLog_sigsafe_e("guard: %s at %p, %u bytes before %u byte allocation %p",
+		               what, addr, (unsigned)(p - addr), (unsigned)s->size, p);
+	}
+	else if (addr >= p + s->size)
+	{
+		DLog_sigsafe_e("guard: %s at %p, %u bytes after %u byte allocation %p",
+		               what, addr, (unsigned)(addr - p - s->size), (unsigned)s->size, p);
+	}
+	else
+	{
+		DLog_sigsafe_e("guard: %s at %p, offset %u of %u byte allocation %p",
+		               what, addr, (unsigned)(addr - p), (unsigned)s->size, p);
+	}
+	dd_guard_print_slot(s);
+}
+
+
+/******************************************************************************/
+/**
+ * SIGSEGV handler. Faults inside guarded area are reported, then previous
+ * handler is restored and the faulting access runs again, which crashes
+ * the process the same way as without guarding.
+ */
+static void dd_guard_handler(int sig, siginfo_t *info, void *ctx)
+{
+	char *addr = info->si_addr;
+
+	if (addr >= dd_guard_begin && addr < dd_guard_end)
+	{
+		dd_guard_report(addr);
+		sigaction(SIGSEGV, &dd_guard_old_action, NULL);
+		return;
+	}
+
+	if (dd_guard_old_action.sa_flags & SA_SIGINFO)
+	{
+		dd_guard_old_action.sa_sigaction(sig, info, ctx);
+	}
+	else if (dd_guard_old_action.sa_handler != SIG_DFL &&
+	         dd_guard_old_action.sa_handler != SIG_IGN)
+	{
+		dd_guard_old_action.sa_handler(sig);
+	}
+	else
+	{
+		sigaction(SIGSEGV, &dd_guard_old_action, NULL);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Start guarding sampled allocations. Guarded area is allocated on first
+ * call and kept after that, later calls only change sampling rate.
+ *
+ * @param slots number of guarded allocations at once, 0 for DD_GUARD_SLOTS
+ * @param rate mean number of allocations between samples, 0 for DD_GUARD_RATE
+ * @return 0 on success, -1 on errors
+ */
+int dd_guard_start(int slots, int rate)
+{
+	struct sigaction sa;
+	size_t size;
+	void *frames[2];
+	char *area;
+	int i;
+
+	if (!dd_guard_begin)
+	{
+		dd_guard_nslots = slots > 0 ? slots : DD_GUARD_SLOTS;
+		dd_guard_page = (size_t)sysconf(_SC_PAGESIZE);
+
+		size = (size_t)dd_guard_nslots * sizeof(*dd_guard_slots);
+		dd_guard_slots = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (dd_guard_slots == MAP_FAILED)
+		{
+			dd_guard_slots = NULL;
+			return -1;
+		}
+		dd_guard_queue = mmap(NULL, dd_guard_nslots * sizeof(int), PROT_READ | PROT_WRITE,
+		                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (dd_guard_queue == MAP_FAILED)
+		{
+			munmap(dd_guard_slots, size);
+			dd_guard_slots = NULL;
+			dd_guard_queue = NULL;
+			return -1;
+		}
+		for (i = 0; i < dd_guard_nslots; i++)
+		{
+			dd_guard_queue[i] = i;
+		}
+		dd_guard_count = dd_guard_nslots;
+
+		size = (size_t)(2 * dd_guard_nslots + 1) * dd_guard_page;
+		area = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (area == MAP_FAILED)
+		{
+			/* Retry must start from scratch, do not leave half set up. */
+			munmap(dd_guard_slots, (size_t)dd_guard_nslots * sizeof(*dd_guard_slots));
+			munmap(dd_guard_queue, (size_t)dd_guard_nslots * sizeof(int));
+			dd_guard_slots = NULL;
+			dd_guard_queue = NULL;
+			dd_guard_nslots = 0;
+			dd_guard_count = 0;
+			return -1;
+		}
+
+		/* First backtrace() loads libgcc and allocates, do it here. */
+		stacktab_backtrace(frames, 2, 0);
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = dd_guard_handler;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &dd_guard_old_action);
+
+		/* Begin first, range is empty until end is set. */
+		__atomic_store_n(&dd_guard_begin, area, __ATOMIC_RELEASE);
+		__atomic_store_n(&dd_guard_end, area + size, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&dd_guard_rate, rate > 0 ? rate : DD_GUARD_RATE, __ATOMIC_RELEASE);
+	/* Makes every thread restart its countdown, also idle ones. */
+	__atomic_add_fetch(&dd_guard_gen, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop sampling new allocations. Already guarded allocations stay guarded
+ * until they are freed.
+ */
+void dd_guard_stop(void)
+{
+	__atomic_store_n(&dd_guard_rate, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of dd_guard_alloc().
+ *
+ * @return guarded memory or NULL if allocation is not sampled
+ */
+void * __attribute__((noinline)) dd_guard_sample(size_t size, const char *file, int line)
+{
+	struct dd_guard_slot *s;
+	char *page;
+	int i, rate;
+
+	dd_guard_gen_self = __atomic_load_n(&dd_guard_gen, __ATOMIC_ACQUIRE);
+	rate = __atomic_load_n(&dd_guard_rate, __ATOMIC_ACQUIRE);
+	if (!rate)
+	{
+		dd_guard_countdown = DD_GUARD_IDLE;
+		return NULL;
+	}
+	dd_guard_countdown = (int)(dd_guard_random() % (2 * (uint32_t)rate));
+	if (size > dd_guard_page || size == 0)
+	{
+		return NULL;
+	}
+
+	dd_spin_lock(&dd_guard_lock_v);
+	if (dd_guard_count == 0)
+	{
+		dd_spin_unlock(&dd_guard_lock_v);
+		return NULL;
+	}
+	i = dd_guard_queue[dd_guard_head];
+	dd_guard_head = (dd_guard_head + 1) % dd_guard_nslots;
+	dd_guard_count--;
+	dd_spin_unlock(&dd_guard_lock_v);
+
+	page = dd_guard_slot_page(i);
+	if (mprotect(page, dd_guard_page, PROT_READ | PROT_WRITE))
+	{
+		dd_spin_lock(&dd_guard_lock_v);
+		dd_guard_queue[(dd_guard_head + dd_guard_count) % dd_guard_nslots] = i;
+		dd_guard_count++;
+		dd_spin_unlock(&dd_guard_lock_v);
+		return NULL;
+	}
+
+	s = &dd_guard_slots[i];
+	s->size = size;
+	if (dd_guard_random() & 1)
+	{
+		/* End of allocation at end of page, rounded to keep alignment. */
+		s->ptr = page + ((dd_guard_page - size) & ~(size_t)15);
+	}
+	else
+	{
+		s->ptr = page;
+	}
+	s->alloc_file = file;
+	s->alloc_line = line;
+	s->alloc_depth = stacktab_backtrace(s->alloc_frames, DD_GUARD_DEPTH, 1);
+	s->free_file = NULL;
+	s->free_line = 0;
+	s->free_depth = 0;
+	__atomic_store_n(&s->state, DD_GUARD_SLOT_USED, __ATOMIC_RELEASE);
+
+	return s->ptr;
+}
+
+
+/******************************************************************************/
+/**
+ * Free guarded memory. Page is made inaccessible and slot is put at the
+ * end of queue of free slots. Invalid and double frees are reported and
+ * the process is aborted.
+ */
+void dd_guard_free(void *ptr, const char *file, int line)
+{
+	size_t page = (size_t)((char *)ptr - dd_guard_begin) / dd_guard_page;
+	struct dd_guard_slot *s;
+	int i = (int)(page / 2);
+
+	if (!(page & 1) || i >= dd_guard_nslots)
+	{
+		DLog_sigsafe_e("guard: invalid free of %p", ptr);
+		abort();
+	}
+	s = &dd_guard_slots[i];
+	if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != DD_GUARD_SLOT_USED || s->ptr != ptr)
+	{
+		DLog_sigsafe_e("guard: %s of %p",
+		               s->state == DD_GUARD_SLOT_FREED && s->ptr == ptr ? "double free" : "invalid free",
+		               ptr);
+		if (s->state != DD_GUARD_SLOT_FREE)
+		{
+			dd_guard_print_slot(s);
+		}
+		abort();
+	}
+
+	s->free_file = file;
+	s->free_line = line;
+	s->free_depth = stacktab_backtrace(s->free_frames, DD_GUARD_DEPTH, 1);
+	__atomic_store_n(&s->state, DD_GUARD_SLOT_FREED, __ATOMIC_RELEASE);
+	mprotect(dd_guard_slot_page(i), dd_guard_page, PROT_NONE);
+	madvise(dd_guard_slot_page(i), dd_guard_page, MADV_DONTNEED);
+
+	dd_spin_lock(&dd_guard_lock_v);
+	dd_guard_queue[(dd_guard_head + dd_guard_count) % dd_guard_nslots] = i;
+	dd_guard_count++;
+	dd_spin_unlock(&dd_guard_lock_v);
+}
+
@@ -0,0 +1,111 @@
+/*
+ * DDebuglib
+ *
+ * Sampled guard page allocator. A small random sample of allocations is
+ * placed on their own pages between inaccessible guard pages, and freed
+ * pages are kept inaccessible for a while. Overflows and use after free
+ * of sampled allocations fault immediately and are reported.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef GUARD_H
+#define GUARD_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default number of guarded slots. */
+#define DD_GUARD_SLOTS 256
+
+/** Default mean number of allocations between samples. */
+#define DD_GUARD_RATE 5000
+
+/** Depth of call stacks saved for allocation and free. */
+#define DD_GUARD_DEPTH 16
+
+/**
+ * Allocations between checks whether guarding was stopped and started
+ * again with the same rate. Other starts are seen at once through
+ * dd_guard_gen.
+ */
+#define DD_GUARD_IDLE (1 << 20)
+
+/** Slot states. */
+enum {
+	DD_GUARD_SLOT_FREE = 0,
+	DD_GUARD_SLOT_USED,
+	DD_GUARD_SLOT_FREED,
+};
+
+/** Metadata of one slot. */
+struct dd_guard_slot
+{
+	void *ptr;
+	size_t size;
+	int state;
+	int alloc_depth;
+	int free_depth;
+	int alloc_line;
+	int free_line;
+	const char *alloc_file;
+	const char *free_file;
+	void *alloc_frames[DD_GUARD_DEPTH];
+	void *free_frames[DD_GUARD_DEPTH];
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_guard_start(int, int);
+void dd_guard_stop(void);
+void *dd_guard_sample(size_t, const char *, int);
+void dd_guard_free(void *, const char *, int);
+
+/** Allocations left until next sample in this thread. */
+extern __thread int dd_guard_countdown;
+
+/** Changed by dd_guard_start(), threads restart countdown when it does. */
+extern unsigned int dd_guard_gen;
+
+/** Value of dd_guard_gen when this thread last started countdown. */
+extern __thread unsigned int dd_guard_gen_self;
+
+/** Address range of guarded pages. */
+extern char *dd_guard_begin;
+extern char *dd_guard_end;
+
+/**
+ * Allocation hook. Returns guarded memory when this allocation is sampled.
+ *
+ * @return memory or NULL when allocation must be done normally
+ */
+static __inline__ void *dd_guard_alloc(size_t size, const char *file, int line)
+{
+	if (__builtin_expect(--dd_guard_countdown < 0 ||
+	                     dd_guard_gen_self != __atomic_load_n(&dd_guard_gen, __ATOMIC_RELAXED), 0))
+	{
+		return dd_guard_sample(size, file, line);
+	}
+	return NULL;
+}
+
+/**
+ * @return 1 if pointer was allocated by dd_guard_alloc()
+ */
+static __inline__ int dd_guard_owns(void *ptr)
+{
+	return (char *)ptr >= dd_guard_begin && (char *)ptr < dd_guard_end;
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,367 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "heapprof.h"
+#include "ptrtable.h"
+#include "stacktab.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/*
+ * Sampling works like in tcmalloc: every thread counts down bytes
+ * allocated and takes a sample when the count goes below zero. Distance
+ * to next sample is drawn from exponential distribution with mean of
+ * sampling rate, so every byte has the same chance of being sampled and
+ * the samples form a Poisson process. Profile is written with raw sample
+ * counts and pprof scales them back using the rate in profile header.
+ */
+
+__thread int64_t heapprof_countdown = 0;
+unsigned int heapprof_gen = 0;
+__thread unsigned int heapprof_gen_self = 0;
+uint16_t heapprof_filter[HEAPPROF_FILTER];
+
+/** Mean bytes between samples, 0 when stopped. */
+static size_t heapprof_rate = 0;
+
+/** Random state of this thread. */
+static __thread uint64_t heapprof_rnd = 0;
+
+/** Set while taking sample, allocations made meanwhile are not sampled. */
+static __thread int heapprof_busy = 0;
+
+/** Sampled allocations that are still alive. */
+static struct ptrtable heapprof_live;
+
+/** Stacks of samples. */
+static struct stacktab heapprof_stacks;
+
+/** Counters of each stack id, id 0 is used when stack is not available. */
+static struct heapprof_bucket *heapprof_buckets[(STACKTAB_SLOTS / 4 * 3) / HEAPPROF_BLOCK + 1];
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+/**
+ * Pick number of bytes to next sample.
+ */
+static int64_t heapprof_next(size_t rate)
+{
+	uint64_t x = heapprof_rnd;
+	double u;
+
+	if (x == 0)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		x = ((uint64_t)(uintptr_t)&heapprof_rnd * 0x9e3779b97f4a7c15ull) ^
+		    (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32);
+		x |= 1;
+	}
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	heapprof_rnd = x;
+
+	/* Uniform in (0, 1] from top 53 bits. */
+	u = (double)(((x * 0x2545f4914f6cdd1dull) >> 11) + 1) / 9007199254740992.0;
+
+	return (int64_t)(-log(u) * (double)rate) + 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Get counters of stack, allocating counter block when needed.
+ */
+static struct heapprof_bucket *heapprof_bucket(uint32_t stack)
+{
+	struct heapprof_bucket *block, *fresh;
+	size_t n = stack / HEAPPROF_BLOCK;
+
+	if (n >= sizeof(heapprof_buckets) / sizeof(heapprof_buckets[0]))
+	{
+		return NULL;
+	}
+	block = __atomic_load_n(&heapprof_buckets[n], __ATOMIC_ACQUIRE);
+	if (!block)
+	{
+		fresh = mmap(NULL, HEAPPROF_BLOCK * sizeof(*fresh), PROT_READ | PROT_WRITE,
+		             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fresh == MAP_FAILED)
+		{
+			return NULL;
+		}
+		if (__atomic_compare_exchange_n(&heapprof_buckets[n], &block, fresh, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			block = fresh;
+		}
+		else
+		{
+			munmap(fresh, HEAPPROF_BLOCK * sizeof(*fresh));
+		}
+	}
+
+	return &block[stack % HEAPPROF_BLOCK];
+}
+
+
+/******************************************************************************/
+/**
+ * Start sampling allocations.
+ *
+ * @param rate mean number of bytes between samples, 0 for default
+ */
+void heapprof_start(size_t rate)
+{
+	void *frames[2];
+
+	/* First backtrace() loads libgcc and allocates, do it here. */
+	stacktab_backtrace(frames, 2, 0);
+	__atomic_store_n(&heapprof_rate, rate ? rate : HEAPPROF_RATE_DEFAULT, __ATOMIC_RELEASE);
+	/* Makes every thread restart its countdown, also idle ones. */
+	__atomic_add_fetch(&heapprof_gen, 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Stop sampling. Frees of already sampled allocations are still
+ * accounted and profile can be written after stopping.
+ */
+void heapprof_stop(void)
+{
+	__atomic_store_n(&heapprof_rate, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+int heapprof_running(void)
+{
+	return __atomic_load_n(&heapprof_rate, __ATOMIC_ACQUIRE) != 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of heapprof_alloc(). Called when countdown of this thread
+ * has run out: take sample of this allocation and pick next distance.
+ * Also called when profiler was started after countdown was picked,
+ * then only new distance is picked.
+ */
+void __attribute__((noinline)) heapprof_sample(void *ptr, size_t size)
+{
+	unsigned int gen = __atomic_load_n(&heapprof_gen, __ATOMIC_ACQUIRE);
+	size_t rate = __atomic_load_n(&heapprof_rate, __ATOMIC_ACQUIRE);
+	struct ptrtable_entry e;
+	struct heapprof_bucket *b;
+	int64_t overshoot = -heapprof_countdown;
+	int restart = gen != heapprof_gen_self;
+
+	heapprof_gen_self = gen;
+	if (!rate)
+	{
+		heapprof_countdown = HEAPPROF_IDLE;
+		return;
+	}
+	/* Countdown of zero means thread was not sampling yet. */
+	if (restart || overshoot == (int64_t)size || heapprof_busy || !ptr)
+	{
+		heapprof_countdown = heapprof_next(rate);
+		return;
+	}
+
+	heapprof_busy = 1;
+	memset(&e, 0, sizeof(e));
+	e.ptr = ptr;
+	e.size = size;
+	e.stack = stacktab_capture(&heapprof_stacks, HEAPPROF_DEPTH, 1);
+	b = heapprof_bucket(e.stack);
+	if (b && ptrtable_insert(&heapprof_live, &e) == 0)
+	{
+		__atomic_add_fetch(&heapprof_filter[heapprof_filter_slot(ptr)], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&b->alloc_objs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&b->alloc_bytes, size, __ATOMIC_RELAXED);
+	}
+	heapprof_countdown = heapprof_next(rate);
+	heapprof_busy = 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of heapprof_free(). Called when pointer may have been sampled.
+ */
+void __attribute__((noinline)) heapprof_unsample(void *ptr)
+{
+	struct ptrtable_entry e;
+	struct heapprof_bucket *b;
+
+	if (ptrtable_remove(&heapprof_live, ptr, &e))
+	{
+		return;
+	}
+	__atomic_sub_fetch(&heapprof_filter[heapprof_filter_slot(ptr)], 1, __ATOMIC_RELAXED);
+	b = heapprof_bucket(e.stack);
+	__atomic_add_fetch(&b->free_objs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&b->free_bytes, e.size, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Copy memory mappings of process into file descriptor so that pprof can
+ * symbolize addresses.
+ */
+static void heapprof_maps(int fd)
+{
+	char buf[4096];
+	ssize_t n;
+	int mfd;
+
+	mfd = open("/proc/self/maps", O_RDONLY);
+	if (mfd < 0)
+	{
+		return;
+	}
+	while ((n = read(mfd, buf, sizeof(buf))) > 0)
+	{
+		if (write(fd, buf, n) != n)
+		{
+			break;
+		}
+	}
+	close(mfd);
+}
+
+
+/******************************************************************************/
+/**
+ * Write profile in pprof legacy heap format. Profile contains both
+ * in-use (live) and cumulative allocation counts:
+ *   pprof -inuse_space / -alloc_space <program> <profile>
+ *
+ * @param fd where to write
+ * @return 0 on success, -1 on errors
+ */
+int heapprof_dump(int fd)
+{
+	struct heapprof_bucket b, total;
+	uint32_t i, count;
+	size_t rate;
+	int j, n;
+
+	rate = __atomic_load_n(&heapprof_rate, __ATOMIC_ACQUIRE);
+	if (!rate)
+	{
+		rate = HEAPPROF_RATE_DEFAULT;
+	}
+	count = __atomic_load_n(&heapprof_stacks.count, __ATOMIC_ACQUIRE);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i <= count; i++)
+	{
+		struct heapprof_bucket *p = heapprof_buckets[i / HEAPPROF_BLOCK];
+		if (!p)
+		{
+			continue;
+		}
+		p += i % HEAPPROF_BLOCK;
+		total.alloc_objs += __atomic_load_n(&p->alloc_objs, __ATOMIC_RELAXED);
+		total.alloc_bytes += __atomic_load_n(&p->alloc_bytes, __ATOMIC_RELAXED);
+		total.free_objs += __atomic_load_n(&p->free_objs, __ATOMIC_RELAXED);
+		total.free_bytes += __atomic_load_n(&p->free_bytes, __ATOMIC_RELAXED);
+	}
+
+	if (dprintf(fd, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%lu\n",
+	            (unsigned long long)(total.alloc_objs - total.free_objs),
+	            (unsigned long long)(total.alloc_bytes - total.free_bytes),
+	            (unsigned long long)total.alloc_objs,
+	            (unsigned long long)total.alloc_bytes,
+	            (unsigned long)rate) < 0)
+	{
+		return -1;
+	}
+
+	for (i = 0; i <= count; i++)
+	{
+		struct heapprof_bucket *p = heapprof_buckets[i / HEAPPROF_BLOCK];
+		void *const *frames = NULL;
+		if (!p)
+		{
+			continue;
+		}
+		p += i % HEAPPROF_BLOCK;
+		b.alloc_objs = __atomic_load_n(&p->alloc_objs, __ATOMIC_RELAXED);
+		b.alloc_bytes = __atomic_load_n(&p->alloc_bytes, __ATOMIC_RELAXED);
+		b.free_objs = __atomic_load_n(&p->free_objs, __ATOMIC_RELAXED);
+		b.free_bytes = __atomic_load_n(&p->free_bytes, __ATOMIC_RELAXED);
+		if (b.alloc_objs == 0)
+		{
+			continue;
+		}
+
+		dprintf(fd, "%llu: %llu [%llu: %llu] @",
+		        (unsigned long long)(b.alloc_objs - b.free_objs),
+		        (unsigned long long)(b.alloc_bytes - b.free_bytes),
+		        (unsigned long long)b.alloc_objs,
+		        (unsigned long long)b.alloc_bytes);
+		n = i ? stacktab_get(&heapprof_stacks, i, &frames) : 0;
+		for (j = 0; j < n; j++)
+		{
+			dprintf(fd, " %p", frames[j]);
+		}
+		dprintf(fd, "\n");
+	}
+
+	dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+	heapprof_maps(fd);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Write profile into file.
+ *
+ * @param path file to write, replaced if exists
+ * @return 0 on success, -1 on errors
+ */
+int heapprof_dump_file(const char *path)
+{
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	err = heapprof_dump(fd);
+	if (close(fd))
+	{
+		err = -1;
+	}
+
+	return err;
+}
+
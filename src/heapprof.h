@@ -0,0 +1,109 @@
+/*
+ * DDebuglib
+ *
+ * Sampling heap profiler. Samples on average one allocation per given
+ * number of bytes and writes profiles in pprof legacy heap format.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default mean number of bytes between samples. */
+#define HEAPPROF_RATE_DEFAULT (512 * 1024)
+
+/** Stack depth captured for samples. */
+#define HEAPPROF_DEPTH 32
+
+/** Size of counting filter used to skip lookups of unsampled frees. */
+#define HEAPPROF_FILTER 65536
+
+/** Number of stacks in one counter block. */
+#define HEAPPROF_BLOCK 4096
+
+/**
+ * Bytes between checks whether profiler was stopped and started again
+ * with the same rate. Other starts are seen at once through heapprof_gen.
+ */
+#define HEAPPROF_IDLE (64 * 1024 * 1024)
+
+/** Sampled counters of one stack. */
+struct heapprof_bucket
+{
+	uint64_t alloc_objs;
+	uint64_t alloc_bytes;
+	uint64_t free_objs;
+	uint64_t free_bytes;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+void heapprof_start(size_t);
+void heapprof_stop(void);
+int heapprof_running(void);
+void heapprof_sample(void *, size_t);
+void heapprof_unsample(void *);
+int heapprof_dump(int);
+int heapprof_dump_file(const char *);
+
+/** Bytes left until next sample in this thread. */
+extern __thread int64_t heapprof_countdown;
+
+/** Changed by heapprof_start(), threads restart countdown when it does. */
+extern unsigned int heapprof_gen;
+
+/** Value of heapprof_gen when this thread last started countdown. */
+extern __thread unsigned int heapprof_gen_self;
+
+/** Number of sampled allocations in each filter slot. */
+extern uint16_t heapprof_filter[HEAPPROF_FILTER];
+
+/** Counting filter slot of pointer. */
+static __inline__ unsigned int heapprof_filter_slot(void *ptr)
+{
+	uintptr_t h = ((uintptr_t)ptr >> 4) * 0x9e3779b1u;
+	return (unsigned int)(h >> 8) & (HEAPPROF_FILTER - 1);
+}
+
+/**
+ * Allocation hook. Fast path only decrements a thread local counter,
+ * a sample is taken when it drops below zero.
+ */
+static __inline__ void heapprof_alloc(void *ptr, size_t size)
+{
+	if (__builtin_expect((heapprof_countdown -= (int64_t)size) < 0 ||
+	                     heapprof_gen_self != __atomic_load_n(&heapprof_gen, __ATOMIC_RELAXED), 0))
+	{
+		heapprof_sample(ptr, size);
+	}
+}
+
+/**
+ * Free hook. Fast path is one load from the counting filter, table
+ * of sampled allocations is searched only if the filter has a hit.
+ */
+static __inline__ void heapprof_free(void *ptr)
+{
+	if (__builtin_expect(__atomic_load_n(&heapprof_filter[heapprof_filter_slot(ptr)],
+	                                     __ATOMIC_RELAXED) != 0, 0))
+	{
+		heapprof_unsample(ptr);
+	}
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
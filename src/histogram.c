@@ -0,0 +1,535 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "histogram.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/** Mask of shards in use by threads, given back at thread exit. */
+static uint64_t dd_histogram_used = 0;
+
+/** Number of shards, set once from number of processors. */
+static unsigned int dd_histogram_shards = DD_HISTOGRAM_SHARDS_MIN;
+
+static pthread_once_t dd_histogram_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_histogram_key;
+
+__thread int dd_histogram_shard_n = -1;
+__thread int dd_histogram_shard_own = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_histogram_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_shard_release(&dd_histogram_used, dd_histogram_shard_n, dd_histogram_shard_own);
+	/* Destructors that run after this one may still record. */
+	dd_histogram_shard_n = (int)dd_histogram_shards - 1;
+	dd_histogram_shard_own = 0;
+}
+
+
+/******************************************************************************/
+static void dd_histogram_atfork_child(void)
+{
+	dd_shard_reset(&dd_histogram_used, dd_histogram_shard_n, dd_histogram_shard_own);
+}
+
+
+/******************************************************************************/
+static void dd_histogram_setup(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	unsigned int n = cpus > 0 ? (unsigned int)cpus * 2 + 1 : DD_HISTOGRAM_SHARDS_MIN;
+
+	n = n < DD_HISTOGRAM_SHARDS_MIN ? DD_HISTOGRAM_SHARDS_MIN : n;
+	dd_histogram_shards = n > DD_SHARD_MAX ? DD_SHARD_MAX : n;
+	pthread_key_create(&dd_histogram_key, dd_histogram_thread_exit);
+	pthread_atfork(NULL, NULL, dd_histogram_atfork_child);
+}
+
+
+/******************************************************************************/
+/**
+ * Pick shard for calling thread, used by dd_histogram_record(). Shard is
+ * given back when the thread exits.
+ */
+int dd_histogram_shard_new(void)
+{
+	pthread_once(&dd_histogram_once, dd_histogram_setup);
+	dd_histogram_shard_n = dd_shard_pick(&dd_histogram_used, dd_histogram_shards,
+	                                     &dd_histogram_shard_own);
+	if (dd_histogram_shard_own)
+	{
+		pthread_setspecific(dd_histogram_key, &dd_histogram_used);
+	}
+	return dd_histogram_shard_n;
+}
+
+
+/******************************************************************************/
+/**
+ * @return lowest value of bucket
+ */
+static uint64_t dd_histogram_low(int precision, unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < (1u << precision))
+	{
+		return i;
+	}
+	shift = (i >> (precision - 1)) - 1;
+	return (uint64_t)(i - (shift << (precision - 1))) << shift;
+}
+
+
+/******************************************************************************/
+/**
+ * @return highest value of bucket
+ */
+static uint64_t dd_histogram_high(int precision, unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < (1u << precision))
+	{
+		return i;
+	}
+	shift = (i >> (precision - 1)) - 1;
+	return dd_histogram_low(precision, i) + ((1ull << shift) - 1);
+}
+
+
+/******************************************************************************/
+static void dd_histogram_clear(struct dd_histogram *h)
+{
+	unsigned int i;
+
+	memset(h->counts, 0, (size_t)h->nshards * h->stride * sizeof(uint64_t));
+	for (i = 0; i < h->nshards; i++)
+	{
+		h->shards[i].count = 0;
+		h->shards[i].sum = 0;
+		h->shards[i].min = UINT64_MAX;
+		h->shards[i].max = 0;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Create histogram. Memory used depends only on precision: each shard
+ * has (66 - precision) * 2^(precision - 1) counters.
+ *
+ * @param name name of histogram, not copied
+ * @param precision significant bits of values, 0 for DD_HISTOGRAM_PRECISION
+ * @return histogram or NULL on errors
+ */
+struct dd_histogram *dd_histogram_create(const char *name, int precision)
+{
+	struct dd_histogram *h;
+	unsigned int buckets, stride, i;
+	size_t size;
+
+	if (precision == 0)
+	{
+		precision = DD_HISTOGRAM_PRECISION;
+	}
+	if (precision < 1 || precision > DD_HISTOGRAM_PRECISION_MAX)
+	{
+		return NULL;
+	}
+	pthread_once(&dd_histogram_once, dd_histogram_setup);
+	buckets = (66 - precision) << (precision - 1);
+	/* Keep bucket arrays of shards on separate cache lines. */
+	stride = (buckets + 7) & ~7u;
+	size = sizeof(*h) + (size_t)dd_histogram_shards * stride * sizeof(uint64_t);
+
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (h == MAP_FAILED)
+	{
+		return NULL;
+	}
+	h->name = name;
+	h->precision = precision;
+	h->buckets = buckets;
+	h->stride = stride;
+	h->size = size;
+	h->nshards = dd_histogram_shards;
+	h->counts = (uint64_t *)(h + 1);
+	/* Counts are zero from mmap, leave untouched pages of idle shards alone. */
+	for (i = 0; i < h->nshards; i++)
+	{
+		h->shards[i].min = UINT64_MAX;
+	}
+
+	return h;
+}
+
+
+/******************************************************************************/
+/**
+ * Free histogram.
+ */
+void dd_histogram_destroy(struct dd_histogram *h)
+{
+	if (h)
+	{
+		munmap(h, h->size);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Clear all recorded values. Values recorded at the same time by other
+ * threads may be partially lost.
+ */
+void dd_histogram_reset(struct dd_histogram *h)
+{
+	dd_histogram_clear(h);
+}
+
+
+/******************************************************************************/
+/**
+ * Sum bucket counts of all shards.
+ *
+ * @return array of h->buckets counts to be released with free(), NULL on errors
+ */
+static uint64_t *dd_histogram_collect(struct dd_histogram *h, struct dd_histogram_shard *total)
+{
+	uint64_t *counts, v;
+	unsigned int i, j;
+
+	counts = calloc(h->buckets, sizeof(*counts));
+	if (!counts)
+	{
+		return NULL;
+	}
+	total->count = 0;
+	total->sum = 0;
+	total->min = UINT64_MAX;
+	total->max = 0;
+	for (i = 0; i < h->nshards; i++)
+	{
+		uint64_t *c = &h->counts[i * h->stride];
+		for (j = 0; j < h->buckets; j++)
+		{
+			counts[j] += __atomic_load_n(&c[j], __ATOMIC_RELAXED);
+		}
+		total->count += __atomic_load_n(&h->shards[i].count, __ATOMIC_RELAXED);
+		total->sum += __atomic_load_n(&h->shards[i].sum, __ATOMIC_RELAXED);
+		v = __atomic_load_n(&h->shards[i].min, __ATOMIC_RELAXED);
+		total->min = v < total->min ? v : total->min;
+		v = __atomic_load_n(&h->shards[i].max, __ATOMIC_RELAXED);
+		total->max = v > total->max ? v : total->max;
+	}
+
+	return counts;
+}
+
+
+/******************************************************************************/
+/**
+ * Add all values of src into dst. Precisions may differ.
+ *
+ * @return 0 on success, -1 on errors
+ */
+int dd_histogram_merge(struct dd_histogram *dst, struct dd_histogram *src)
+{
+	struct dd_histogram_shard total, *s;
+	uint64_t *counts, m;
+	unsigned int i;
+	int n = dd_histogram_shard_n;
+
+	counts = dd_histogram_collect(src, &total);
+	if (!counts)
+	{
+		return -1;
+	}
+	/* Values are added into shard of calling thread, as if recorded by it. */
+	if (n < 0)
+	{
+		n = dd_histogram_shard_new();
+	}
+	s = &dst->shards[n];
+	for (i = 0; i < src->buckets; i++)
+	{
+		if (counts[i])
+		{
+			uint64_t v = dd_histogram_low(src->precision, i);
+			dd_histogram_add(&dst->counts[n * dst->stride + dd_histogram_index(dst->precision, v)],
+			                 counts[i]);
+		}
+	}
+	free(counts);
+
+	dd_histogram_add(&s->count, total.count);
+	dd_histogram_add(&s->sum, total.sum);
+	m = __atomic_load_n(&s->min, __ATOMIC_RELAXED);
+	while (total.min < m && !__atomic_compare_exchange_n(&s->min, &m, total.min, 1,
+	                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	m = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+	while (total.max > m && !__atomic_compare_exchange_n(&s->max, &m, total.max, 1,
+	                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * @return number of values recorded
+ */
+uint64_t dd_histogram_count(struct dd_histogram *h)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < h->nshards; i++)
+	{
+		count += __atomic_load_n(&h->shards[i].count, __ATOMIC_RELAXED);
+	}
+
+	return count;
+}
+
+
+/******************************************************************************/
+/**
+ * Find value at percentile from merged counts. Highest value of the
+ * bucket is returned, limited to range of recorded values.
+ */
+static uint64_t dd_histogram_find(struct dd_histogram *h, uint64_t *counts,
+                                  struct dd_histogram_shard *total, double q)
+{
+	uint64_t target, seen = 0, count = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < h->buckets; i++)
+	{
+		count += counts[i];
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+	if (q <= 0.0)
+	{
+		return total->min;
+	}
+	target = (uint64_t)(q / 100.0 * (double)count + 0.5);
+	target = target < 1 ? 1 : (target > count ? count : target);
+	for (i = 0; i < h->buckets; i++)
+	{
+		seen += counts[i];
+		if (seen >= target)
+		{
+			break;
+		}
+	}
+	v = dd_histogram_high(h->precision, i < h->buckets ? i : h->buckets - 1);
+	v = v > total->max ? total->max : v;
+
+	return v < total->min ? total->min : v;
+}
+
+
+/******************************************************************************/
+/**
+ * Get value at percentile.
+ *
+ * @param q percentile from 0 to 100
+ * @return value, 0 if histogram is empty
+ */
+uint64_t dd_histogram_percentile(struct dd_histogram *h, double q)
+{
+	struct dd_histogram_shard total;
+	uint64_t *counts, v;
+
+	counts = dd_histogram_collect(h, &total);
+	if (!counts)
+	{
+		return 0;
+	}
+	v = dd_histogram_find(h, counts, &total, q);
+	free(counts);
+
+	return v;
+}
+
+
+/******************************************************************************/
+/**
+ * Get summary of histogram.
+ */
+void dd_histogram_stats(struct dd_histogram *h, struct dd_histogram_stats *stats)
+{
+	struct dd_histogram_shard total;
+	uint64_t *counts;
+
+	memset(stats, 0, sizeof(*stats));
+	counts = dd_histogram_collect(h, &total);
+	if (!counts)
+	{
+		return;
+	}
+	stats->count = total.count;
+	if (total.count > 0)
+	{
+		stats->min = total.min;
+		stats->max = total.max;
+		stats->mean = (double)total.sum / (double)total.count;
+		stats->p50 = dd_histogram_find(h, counts, &total, 50.0);
+		stats->p90 = dd_histogram_find(h, counts, &total, 90.0);
+		stats->p99 = dd_histogram_find(h, counts, &total, 99.0);
+		stats->p999 = dd_histogram_find(h, counts, &total, 99.9);
+	}
+	free(counts);
+}
+
+
+/******************************************************************************/
+/**
+ * Print summary and percentiles of histogram into file descriptor.
+ */
+void dd_histogram_print(struct dd_histogram *h, int fd)
+{
+	static const double q[] = { 0.0, 25.0, 50.0, 75.0, 90.0, 95.0, 99.0, 99.9, 99.99, 100.0 };
+	struct dd_histogram_shard total;
+	uint64_t *counts;
+	unsigned int i;
+
+	counts = dd_histogram_collect(h, &total);
+	if (!counts)
+	{
+		return;
+	}
+	dprintf(fd, "%s: count %llu", h->name ? h->name : "histogram",
+	        (unsigned long long)total.count);
+	if (total.count > 0)
+	{
+		dprintf(fd, " min %llu mean %.1f max %llu",
+		        (unsigned long long)total.min, (double)total.sum / (double)total.count,
+		        (unsigned long long)total.max);
+	}
+	dprintf(fd, "\n");
+	for (i = 0; total.count > 0 && i < sizeof(q) / sizeof(q[0]); i++)
+	{
+		dprintf(fd, "%10.2f%% %16llu\n", q[i],
+		        (unsigned long long)dd_histogram_find(h, counts, &total, q[i]));
+	}
+	free(counts);
+}
+
+
+/******************************************************************************/
+/**
+ * Print non-empty buckets of histogram as CSV into file descriptor.
+ * Columns are lowest value, highest value, count and cumulative fraction.
+ */
+void dd_histogram_csv(struct dd_histogram *h, int fd)
+{
+	struct dd_histogram_shard total;
+	uint64_t *counts, seen = 0, count = 0;
+	unsigned int i;
+
+	counts = dd_histogram_collect(h, &total);
+	if (!counts)
+	{
+		return;
+	}
+	for (i = 0; i < h->buckets; i++)
+	{
+		count += counts[i];
+	}
+	dprintf(fd, "low,high,count,cumulative\n");
+	for (i = 0; i < h->buckets; i++)
+	{
+		if (counts[i])
+		{
+			seen += counts[i];
+			dprintf(fd, "%llu,%llu,%llu,%.6f\n",
+			        (unsigned long long)dd_histogram_low(h->precision, i),
+			        (unsigned long long)dd_histogram_high(h->precision, i),
+			        (unsigned long long)counts[i], (double)seen / (double)count);
+		}
+	}
+	free(counts);
+}
+
+
+
+/******************************************************************************/
+/**
+ * Count values up to each limit, for exporting as cumulative buckets.
+ * Buckets are not split: only buckets that lie entirely at or below limit
+ * are counted, so a value above limit is never counted in it. Values in
+ * the bucket that reaches over limit are counted only in the next limit.
+ * Error is within precision of histogram, and there is none for limits
+ * below 2^precision.
+ *
+ * @param limits ascending limits
+ * @param counts where to store counts, one for each limit
+ * @param n number of limits
+ * @param sum where to store sum of values, may be NULL
+ * @return number of values recorded, 0 on errors
+ */
+uint64_t dd_histogram_cumulative(struct dd_histogram *h, const uint64_t *limits,
+                                 uint64_t *counts, int n, uint64_t *sum)
+{
+	struct dd_histogram_shard total;
+	uint64_t *c, seen = 0;
+	unsigned int i;
+	int j = 0;
+
+	c = dd_histogram_collect(h, &total);
+	if (!c)
+	{
+		memset(counts, 0, n * sizeof(*counts));
+		if (sum)
+		{
+			*sum = 0;
+		}
+		return 0;
+	}
+	for (i = 0; i < h->buckets; i++)
+	{
+		while (j < n && dd_histogram_high(h->precision, i) > limits[j])
+		{
+			counts[j++] = seen;
+		}
+		seen += c[i];
+	}
+	while (j < n)
+	{
+		counts[j++] = seen;
+	}
+	free(c);
+	if (sum)
+	{
+		*sum = total.sum;
+	}
+
+	return seen;
+}
@@ -0,0 +1,185 @@
+/*
+ * DDebuglib
+ *
+ * Latency histograms with log-linear buckets. Each power of two range is
+ * split into 2^(precision - 1) linear buckets, so recorded values are
+ * kept with relative error of at most 2^-(precision - 1).
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ddclock.h"
+#include "ddshard.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default precision in significant bits, relative error below 1.6%. */
+#define DD_HISTOGRAM_PRECISION 7
+
+/** Maximum precision in significant bits. */
+#define DD_HISTOGRAM_PRECISION_MAX 14
+
+/**
+ * Minimum number of shards. Histograms have two shards for each processor
+ * and one shared, within this and DD_SHARD_MAX, see ddshard.h.
+ */
+#define DD_HISTOGRAM_SHARDS_MIN 8
+
+/** Summary counters of one shard, each shard on its own cache line. */
+struct dd_histogram_shard
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} __attribute__((aligned(64)));
+
+/** Histogram, create with dd_histogram_create(). */
+struct dd_histogram
+{
+	const char *name;
+	int precision;
+	/** Number of buckets. */
+	unsigned int buckets;
+	/** Distance between bucket arrays of shards in counts. */
+	unsigned int stride;
+	size_t size;
+	/** Number of shards in use, same for all histograms. */
+	unsigned int nshards;
+	struct dd_histogram_shard shards[DD_SHARD_MAX];
+	/** Bucket counts of all shards. */
+	uint64_t *counts;
+};
+
+/** Summary of histogram. */
+struct dd_histogram_stats
+{
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+/** Timer that records into histogram when it goes out of scope. */
+struct dd_histogram_scope
+{
+	struct dd_histogram *h;
+	uint64_t start;
+};
+
+#define DD_HISTOGRAM_CAT2(a, b) a##b
+#define DD_HISTOGRAM_CAT(a, b) DD_HISTOGRAM_CAT2(a, b)
+
+/**
+ * Record time in nanoseconds from this point until end of enclosing
+ * scope into histogram.
+ */
+#define DD_HISTOGRAM_SCOPE(hist) \
+	struct dd_histogram_scope DD_HISTOGRAM_CAT(dd_histogram_scope_, __LINE__) \
+	__attribute__((cleanup(dd_histogram_scope_end))) = { (hist), dd_clock_ticks() }
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+struct dd_histogram *dd_histogram_create(const char *, int);
+void dd_histogram_destroy(struct dd_histogram *);
+void dd_histogram_reset(struct dd_histogram *);
+int dd_histogram_merge(struct dd_histogram *, struct dd_histogram *);
+uint64_t dd_histogram_count(struct dd_histogram *);
+uint64_t dd_histogram_percentile(struct dd_histogram *, double);
+void dd_histogram_stats(struct dd_histogram *, struct dd_histogram_stats *);
+void dd_histogram_print(struct dd_histogram *, int);
+void dd_histogram_csv(struct dd_histogram *, int);
+uint64_t dd_histogram_cumulative(struct dd_histogram *, const uint64_t *, uint64_t *, int, uint64_t *);
+int dd_histogram_shard_new(void);
+
+/** Shard of this thread, -1 until first record. */
+extern __thread int dd_histogram_shard_n;
+
+/** Whether this thread is the only one using its shard. */
+extern __thread int dd_histogram_shard_own;
+
+/**
+ * Add to counter in shard of calling thread, see dd_shard_add().
+ */
+static __inline__ void dd_histogram_add(uint64_t *counter, uint64_t v)
+{
+	dd_shard_add(dd_histogram_shard_own, counter, v);
+}
+
+/**
+ * @return bucket of value
+ */
+static __inline__ unsigned int dd_histogram_index(int precision, uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < (1ull << precision))
+	{
+		return (unsigned int)v;
+	}
+	shift = 63 - __builtin_clzll(v) - (precision - 1);
+	return (shift << (precision - 1)) + (unsigned int)(v >> shift);
+}
+
+/**
+ * Record value n times. Only counters of the shard of calling thread are
+ * written, so recording never waits for other threads.
+ */
+static __inline__ void dd_histogram_record_n(struct dd_histogram *h, uint64_t v, uint64_t n)
+{
+	struct dd_histogram_shard *s;
+	uint64_t m;
+	int i = dd_histogram_shard_n;
+
+	if (__builtin_expect(i < 0, 0))
+	{
+		i = dd_histogram_shard_new();
+	}
+	s = &h->shards[i];
+	dd_histogram_add(&h->counts[i * h->stride + dd_histogram_index(h->precision, v)], n);
+	dd_histogram_add(&s->count, n);
+	dd_histogram_add(&s->sum, v * n);
+
+	/* New minimum or maximum is rare, so these almost never loop. */
+	m = __atomic_load_n(&s->min, __ATOMIC_RELAXED);
+	while (v < m && !__atomic_compare_exchange_n(&s->min, &m, v, 1,
+	                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	m = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+	while (v > m && !__atomic_compare_exchange_n(&s->max, &m, v, 1,
+	                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Record value.
+ */
+static __inline__ void dd_histogram_record(struct dd_histogram *h, uint64_t v)
+{
+	dd_histogram_record_n(h, v, 1);
+}
+
+/** Used by DD_HISTOGRAM_SCOPE(). */
+static __inline__ void dd_histogram_scope_end(struct dd_histogram_scope *s)
+{
+	dd_histogram_record(s->h, dd_clock_ns(dd_clock_ticks() - s->start));
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,299 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "memtag.h"
+#include "synchro.h"
+#include "metrics.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+static struct dd_tag dd_tags[DD_TAG_MAX];
+static int dd_tag_count = 0;
+static int dd_tag_lock = 0;
+static struct dd_tag_shard dd_tag_shards[DD_TAG_SHARDS];
+
+/** Whether collector has been added to metrics. */
+static int dd_tag_metrics = 0;
+
+/** CPU of this thread, refreshed every 64 calls since threads migrate. */
+static __thread unsigned int dd_tag_cpu = 0;
+static __thread unsigned int dd_tag_cpu_age = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static __inline__ struct dd_tag_shard *dd_tag_shard(void)
+{
+	if ((dd_tag_cpu_age++ & 63) == 0)
+	{
+		int cpu = sched_getcpu();
+		dd_tag_cpu = cpu < 0 ? 0 : (unsigned int)cpu;
+	}
+	return &dd_tag_shards[dd_tag_cpu & (DD_TAG_SHARDS - 1)];
+}
+
+
+/******************************************************************************/
+/** Export all tags into metrics. */
+static void dd_tag_collect(int fd, void *arg)
+{
+	static const char *names[] = {
+		"dd_tag_bytes", "dd_tag_allocations", "dd_tag_peak_bytes", "dd_tag_budget_bytes"
+	};
+	static const char *helps[] = {
+		"Bytes allocated with memory tag.",
+		"Live allocations with memory tag.",
+		"Highest number of bytes allocated with memory tag.",
+		"Budget of memory tag, 0 when there is none."
+	};
+	struct dd_tag_info info;
+	char labels[128];
+	int i, j;
+
+	(void)arg;
+	for (j = 0; j < 4; j++)
+	{
+		dd_metrics_family(fd, names[j], DD_METRIC_GAUGE, helps[j]);
+		for (i = 0; dd_tag_info(i, &info) == 0; i++)
+		{
+			labels[0] = '\0';
+			dd_metrics_label(labels, sizeof(labels), "tag", info.name);
+			dd_metrics_sample(fd, names[j], labels,
+			                  j == 0 ? (double)info.bytes :
+			                  j == 1 ? (double)info.count :
+			                  j == 2 ? (double)info.peak : (double)info.budget);
+		}
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Register new tag. Tags are published into metrics, see
+ * dd_metrics_export().
+ *
+ * @param name name of tag, existing tag is returned if name is in use
+ * @return tag or -1 if there are too many tags
+ */
+int dd_tag_register(const char *name)
+{
+	int tag;
+
+	dd_spin_lock(&dd_tag_lock);
+	tag = dd_tag_find(name);
+	if (tag < 0 && dd_tag_count < DD_TAG_MAX)
+	{
+		tag = dd_tag_count;
+		dd_tags[tag].name = strdup(name);
+		if (dd_tags[tag].name)
+		{
+			__atomic_store_n(&dd_tag_count, tag + 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			tag = -1;
+		}
+	}
+	dd_spin_unlock(&dd_tag_lock);
+
+	if (tag >= 0 && !__atomic_exchange_n(&dd_tag_metrics, 1, __ATOMIC_RELAXED))
+	{
+		dd_metrics_collector(dd_tag_collect, NULL);
+	}
+
+	return tag;
+}
+
+
+/******************************************************************************/
+/**
+ * Find tag by name.
+ *
+ * @return tag or -1 if not found
+ */
+int dd_tag_find(const char *name)
+{
+	int i, n = __atomic_load_n(&dd_tag_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+	{
+		if (strcmp(dd_tags[i].name, name) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/******************************************************************************/
+/**
+ * Set budget of tag. Callback is called once when tag goes over budget,
+ * and again after it has first dropped below budget.
+ *
+ * @param budget bytes, 0 for no budget
+ * @param cb callback, may be called from any thread allocating with tag
+ * @param arg passed to callback
+ */
+void dd_tag_budget(int tag, int64_t budget, dd_tag_cb cb, void *arg)
+{
+	if (tag < 0 || tag >= DD_TAG_MAX)
+	{
+		return;
+	}
+	dd_tags[tag].cb = cb;
+	dd_tags[tag].arg = arg;
+	__atomic_store_n(&dd_tags[tag].over, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dd_tags[tag].budget, budget, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Move byte change collected in shard into tag total, update peak and
+ * check budget.
+ */
+static void dd_tag_flush(int tag, struct dd_tag_shard *s)
+{
+	struct dd_tag *t = &dd_tags[tag];
+	int64_t bytes, peak, budget;
+	int over = 0;
+
+	bytes = __atomic_add_fetch(&t->bytes, __atomic_exchange_n(&s->delta[tag], 0, __ATOMIC_RELAXED),
+	                           __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&t->peak, __ATOMIC_RELAXED);
+	while (bytes > peak &&
+	       !__atomic_compare_exchange_n(&t->peak, &peak, bytes, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	budget = __atomic_load_n(&t->budget, __ATOMIC_ACQUIRE);
+	if (budget <= 0)
+	{
+		return;
+	}
+	if (bytes >= budget)
+	{
+		if (__atomic_compare_exchange_n(&t->over, &over, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) &&
+		    t->cb)
+		{
+			t->cb(tag, t->name, bytes, budget, t->arg);
+		}
+	}
+	else
+	{
+		__atomic_store_n(&t->over, 0, __ATOMIC_RELAXED);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Charge allocation to tag.
+ */
+void dd_tag_alloc(int tag, size_t size)
+{
+	struct dd_tag_shard *s;
+
+	if ((unsigned int)tag >= DD_TAG_MAX)
+	{
+		return;
+	}
+	s = dd_tag_shard();
+	__atomic_add_fetch(&s->count[tag], 1, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&s->delta[tag], (int64_t)size, __ATOMIC_RELAXED) >= DD_TAG_BATCH)
+	{
+		dd_tag_flush(tag, s);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Remove charge of freed allocation from tag.
+ */
+void dd_tag_free(int tag, size_t size)
+{
+	struct dd_tag_shard *s;
+
+	if ((unsigned int)tag >= DD_TAG_MAX)
+	{
+		return;
+	}
+	s = dd_tag_shard();
+	__atomic_sub_fetch(&s->count[tag], 1, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&s->delta[tag], (int64_t)size, __ATOMIC_RELAXED) <= -DD_TAG_BATCH)
+	{
+		dd_tag_flush(tag, s);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Get current state of tag.
+ *
+ * @return 0 on success, -1 if tag does not exist
+ */
+int dd_tag_info(int tag, struct dd_tag_info *info)
+{
+	struct dd_tag *t;
+	int i;
+
+	if (tag < 0 || tag >= __atomic_load_n(&dd_tag_count, __ATOMIC_ACQUIRE))
+	{
+		return -1;
+	}
+	t = &dd_tags[tag];
+	info->name = t->name;
+	info->bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+	info->count = 0;
+	for (i = 0; i < DD_TAG_SHARDS; i++)
+	{
+		info->bytes += __atomic_load_n(&dd_tag_shards[i].delta[tag], __ATOMIC_RELAXED);
+		info->count += __atomic_load_n(&dd_tag_shards[i].count[tag], __ATOMIC_RELAXED);
+	}
+	info->peak = __atomic_load_n(&t->peak, __ATOMIC_RELAXED);
+	if (info->bytes > info->peak)
+	{
+		info->peak = info->bytes;
+	}
+	info->budget = __atomic_load_n(&t->budget, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Print all tags into file descriptor.
+ */
+void dd_tag_report(int fd)
+{
+	struct dd_tag_info info;
+	int i;
+
+	dprintf(fd, "%-20s %14s %10s %14s %14s\n", "tag", "bytes", "count", "peak", "budget");
+	for (i = 0; dd_tag_info(i, &info) == 0; i++)
+	{
+		dprintf(fd, "%-20s %14lld %10lld %14lld %14lld\n", info.name,
+		        (long long)info.bytes, (long long)info.count,
+		        (long long)info.peak, (long long)info.budget);
+	}
+}
+
@@ -0,0 +1,83 @@
+/*
+ * DDebuglib
+ *
+ * Memory accounting by tag, for example by subsystem, with budgets.
+ * Cheap enough to be used in release builds.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef MEMTAG_H
+#define MEMTAG_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of tags. */
+#define DD_TAG_MAX 64
+
+/** Number of counter shards, power of two. Shard is chosen by CPU. */
+#define DD_TAG_SHARDS 16
+
+/**
+ * Byte changes are collected in shards and moved into tag totals in
+ * batches of this many bytes. Budgets are checked when moving, so a
+ * budget may be exceeded by up to DD_TAG_SHARDS * DD_TAG_BATCH bytes
+ * before callback is called.
+ */
+#define DD_TAG_BATCH (64 * 1024)
+
+/** Callback called when tag goes over its budget. */
+typedef void (*dd_tag_cb)(int tag, const char *name, int64_t bytes, int64_t budget, void *arg);
+
+/** Counters of one shard. */
+struct dd_tag_shard
+{
+	int64_t delta[DD_TAG_MAX];
+	int64_t count[DD_TAG_MAX];
+} __attribute__((aligned(64)));
+
+/** One tag. */
+struct dd_tag
+{
+	const char *name;
+	int64_t bytes;
+	int64_t peak;
+	int64_t budget;
+	int over;
+	dd_tag_cb cb;
+	void *arg;
+};
+
+/** Current state of tag. */
+struct dd_tag_info
+{
+	const char *name;
+	int64_t bytes;
+	int64_t count;
+	int64_t peak;
+	int64_t budget;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_tag_register(const char *);
+int dd_tag_find(const char *);
+void dd_tag_budget(int, int64_t, dd_tag_cb, void *);
+void dd_tag_alloc(int, size_t);
+void dd_tag_free(int, size_t);
+int dd_tag_info(int, struct dd_tag_info *);
+void dd_tag_report(int);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,585 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "synchro.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Number of histogram buckets in export, limits are powers of four. */
+#define DD_METRIC_LIMITS 21
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+struct dd_metric dd_metrics[DD_METRIC_MAX];
+struct dd_metric_shard dd_metric_shards[DD_METRIC_SHARDS];
+__thread int dd_metric_shard_n = -1;
+__thread int dd_metric_shard_own = 0;
+
+static int dd_metric_count = 0;
+static int dd_metric_lock = 0;
+
+/** Shards in use by threads, given back by key destructor at thread exit. */
+static uint64_t dd_metric_used = 0;
+static pthread_once_t dd_metric_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_metric_key;
+
+static struct
+{
+	dd_metrics_collector_fn fn;
+	void *arg;
+} dd_metric_collectors[DD_METRIC_COLLECTORS];
+static int dd_metric_collector_count = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_metric_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_shard_release(&dd_metric_used, dd_metric_shard_n, dd_metric_shard_own);
+	/* Destructors that run after this one may still update metrics. */
+	dd_metric_shard_n = DD_METRIC_SHARDS - 1;
+	dd_metric_shard_own = 0;
+}
+
+
+/******************************************************************************/
+static void dd_metric_atfork_child(void)
+{
+	dd_shard_reset(&dd_metric_used, dd_metric_shard_n, dd_metric_shard_own);
+}
+
+
+/******************************************************************************/
+static void dd_metric_setup(void)
+{
+	pthread_key_create(&dd_metric_key, dd_metric_thread_exit);
+	pthread_atfork(NULL, NULL, dd_metric_atfork_child);
+}
+
+
+/******************************************************************************/
+/**
+ * Pick shard for calling thread, used by dd_metric_add(). Shard is given
+ * back when the thread exits.
+ */
+int dd_metric_shard_new(void)
+{
+	pthread_once(&dd_metric_once, dd_metric_setup);
+	dd_metric_shard_n = dd_shard_pick(&dd_metric_used, DD_METRIC_SHARDS, &dd_metric_shard_own);
+	if (dd_metric_shard_own)
+	{
+		pthread_setspecific(dd_metric_key, &dd_metric_shards[dd_metric_shard_n]);
+	}
+	return dd_metric_shard_n;
+}
+
+
+/******************************************************************************/
+/**
+ * @return 1 if name is valid Prometheus metric name
+ */
+static int dd_metric_valid(const char *name)
+{
+	const char *p;
+
+	if (!name || !*name || (*name >= '0' && *name <= '9'))
+	{
+		return 0;
+	}
+	for (p = name; *p; p++)
+	{
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+		      (*p >= '0' && *p <= '9') || *p == '_' || *p == ':'))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+/******************************************************************************/
+static int dd_metric_match(struct dd_metric *m, const char *name, const char *labels)
+{
+	return strcmp(m->name, name) == 0 && strcmp(m->labels, labels ? labels : "") == 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Register new metric, or return existing one with same name and labels.
+ */
+static int dd_metric_register(int type, const char *name, const char *labels, const char *help,
+                              int precision, dd_metric_fn fn, void *arg)
+{
+	struct dd_metric *m;
+	int i, id = -1;
+
+	if (!dd_metric_valid(name))
+	{
+		return -1;
+	}
+
+	dd_spin_lock(&dd_metric_lock);
+	for (i = 0; i < dd_metric_count; i++)
+	{
+		m = &dd_metrics[i];
+		if (strcmp(m->name, name) == 0 && m->type != type)
+		{
+			/* Same name must always have same type. */
+			goto out;
+		}
+		if (dd_metric_match(m, name, labels))
+		{
+			id = m->fn == fn ? i : -1;
+			goto out;
+		}
+	}
+	if (dd_metric_count >= DD_METRIC_MAX)
+	{
+		goto out;
+	}
+
+	m = &dd_metrics[dd_metric_count];
+	memset(m, 0, sizeof(*m));
+	m->type = type;
+	m->name = strdup(name);
+	m->labels = strdup(labels ? labels : "");
+	m->help = strdup(help ? help : "");
+	m->fn = fn;
+	m->arg = arg;
+	if (type == DD_METRIC_HISTOGRAM)
+	{
+		m->h = dd_histogram_create(m->name, precision);
+	}
+	if (!m->name || !m->labels || !m->help || (type == DD_METRIC_HISTOGRAM && !m->h))
+	{
+		free((char *)m->name);
+		free((char *)m->labels);
+		free((char *)m->help);
+		if (m->h)
+		{
+			dd_histogram_destroy(m->h);
+		}
+		memset(m, 0, sizeof(*m));
+		goto out;
+	}
+	id = dd_metric_count;
+	__atomic_store_n(&dd_metric_count, id + 1, __ATOMIC_RELEASE);
+
+out:
+	dd_spin_unlock(&dd_metric_lock);
+	return id;
+}
+
+
+/******************************************************************************/
+/**
+ * Register counter. Registering same name and labels again returns the
+ * same metric, so subsystems can register lazily.
+ *
+ * @param name metric name, for example "dd_log_messages_total"
+ * @param labels labels without braces, for example "level=\"error\"", or NULL
+ * @param help description of metric, or NULL
+ * @return metric id or -1 on errors
+ */
+int dd_metric_counter(const char *name, const char *labels, const char *help)
+{
+	return dd_metric_register(DD_METRIC_COUNTER, name, labels, help, 0, NULL, NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * Register gauge, see dd_metric_counter().
+ */
+int dd_metric_gauge(const char *name, const char *labels, const char *help)
+{
+	return dd_metric_register(DD_METRIC_GAUGE, name, labels, help, 0, NULL, NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * Register histogram, see dd_metric_counter(). Record with
+ * dd_metric_observe().
+ *
+ * @param precision see dd_histogram_create()
+ */
+int dd_metric_histogram(const char *name, const char *labels, const char *help, int precision)
+{
+	return dd_metric_register(DD_METRIC_HISTOGRAM, name, labels, help, precision, NULL, NULL);
+}
+
+
+/******************************************************************************/
+/**
+ * Register counter or gauge whose value is read from function when
+ * exported, for values that are already kept somewhere else.
+ *
+ * @param type DD_METRIC_COUNTER or DD_METRIC_GAUGE
+ * @param fn called from thread that exports
+ * @param arg passed to fn
+ * @return metric id or -1 on errors
+ */
+int dd_metric_callback(int type, const char *name, const char *labels, const char *help,
+                       dd_metric_fn fn, void *arg)
+{
+	if ((type != DD_METRIC_COUNTER && type != DD_METRIC_GAUGE) || !fn)
+	{
+		return -1;
+	}
+	return dd_metric_register(type, name, labels, help, 0, fn, arg);
+}
+
+
+/******************************************************************************/
+/**
+ * Find metric by name and labels.
+ *
+ * @return metric id or -1 if not found
+ */
+int dd_metric_find(const char *name, const char *labels)
+{
+	int i, n = __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+	{
+		if (dd_metric_match(&dd_metrics[i], name, labels))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/******************************************************************************/
+/**
+ * @return number of registered metrics, ids are from 0 to this - 1
+ */
+int dd_metrics_count(void)
+{
+	return __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE);
+}
+
+
+/******************************************************************************/
+/**
+ * Get current value of counter or gauge by summing all shards.
+ *
+ * @return value, 0 for unknown metrics
+ */
+int64_t dd_metric_value(int id)
+{
+	int64_t v;
+	int i;
+
+	if (id < 0 || id >= __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	if (dd_metrics[id].fn)
+	{
+		return (int64_t)dd_metrics[id].fn(dd_metrics[id].arg);
+	}
+	v = __atomic_load_n(&dd_metrics[id].base, __ATOMIC_RELAXED);
+	for (i = 0; i < DD_METRIC_SHARDS; i++)
+	{
+		v += __atomic_load_n(&dd_metric_shards[i].v[id], __ATOMIC_RELAXED);
+	}
+
+	return v;
+}
+
+
+/******************************************************************************/
+/**
+ * @return histogram of metric or NULL if metric is not a histogram
+ */
+struct dd_histogram *dd_metric_get_histogram(int id)
+{
+	if (id < 0 || id >= __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	return dd_metrics[id].h;
+}
+
+
+/******************************************************************************/
+/**
+ * Set gauge to value. Setting is slower than adding since all shards are
+ * read, and adds done by other threads at the same time may be lost.
+ */
+void dd_gauge_set(int id, int64_t v)
+{
+	int64_t now;
+
+	if (id < 0 || id >= __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+	now = dd_metric_value(id);
+	__atomic_add_fetch(&dd_metrics[id].base, v - now, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Add collector that is called on every export after registered metrics.
+ *
+ * @return 0 on success, -1 if there are too many collectors
+ */
+int dd_metrics_collector(dd_metrics_collector_fn fn, void *arg)
+{
+	int err = -1;
+
+	dd_spin_lock(&dd_metric_lock);
+	if (dd_metric_collector_count < DD_METRIC_COLLECTORS)
+	{
+		dd_metric_collectors[dd_metric_collector_count].fn = fn;
+		dd_metric_collectors[dd_metric_collector_count].arg = arg;
+		__atomic_store_n(&dd_metric_collector_count, dd_metric_collector_count + 1,
+		                 __ATOMIC_RELEASE);
+		err = 0;
+	}
+	dd_spin_unlock(&dd_metric_lock);
+
+	return err;
+}
+
+
+/******************************************************************************/
+/**
+ * Write HELP and TYPE lines of metric family, used by collectors before
+ * samples of the family.
+ */
+void dd_metrics_family(int fd, const char *name, int type, const char *help)
+{
+	static const char *types[] = { "counter", "gauge", "histogram" };
+	char *buf;
+	size_t n = 0;
+
+	/* Escaped help can be at most twice as long. */
+	buf = (help && *help) ? malloc(strlen(help) * 2 + 1) : NULL;
+	if (buf)
+	{
+		for (; *help; help++)
+		{
+			if (*help == '\\' || *help == '\n')
+			{
+				buf[n++] = '\\';
+				buf[n++] = *help == '\n' ? 'n' : '\\';
+			}
+			else
+			{
+				buf[n++] = *help;
+			}
+		}
+		buf[n] = '\0';
+		dprintf(fd, "# HELP %s %s\n# TYPE %s %s\n", name, buf, name, types[type]);
+		free(buf);
+		return;
+	}
+	dprintf(fd, "# TYPE %s %s\n", name, types[type]);
+}
+
+
+/******************************************************************************/
+/**
+ * Write one sample.
+ *
+ * @param labels labels without braces, or NULL
+ */
+void dd_metrics_sample(int fd, const char *name, const char *labels, double v)
+{
+	if (labels && *labels)
+	{
+		dprintf(fd, "%s{%s} %.15g\n", name, labels, v);
+	}
+	else
+	{
+		dprintf(fd, "%s %.15g\n", name, v);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Append label with escaped value into labels string. Labels are separated
+ * with comma.
+ *
+ * @param buf labels string, must be terminated
+ * @param size size of buf
+ * @return length of labels, label is not added if it does not fit
+ */
+size_t dd_metrics_label(char *buf, size_t size, const char *key, const char *value)
+{
+	size_t len = strlen(buf), n = len;
+
+	if (n > 0 && n + 1 < size)
+	{
+		buf[n++] = ',';
+	}
+	n += snprintf(buf + n, n < size ? size - n : 0, "%s=\"", key);
+	for (; *value && n + 2 < size; value++)
+	{
+		if (*value == '\\' || *value == '"' || *value == '\n')
+		{
+			buf[n++] = '\\';
+			buf[n++] = *value == '\n' ? 'n' : *value;
+		}
+		else
+		{
+			buf[n++] = *value;
+		}
+	}
+	if (*value || n + 2 > size)
+	{
+		buf[len] = '\0';
+		return len;
+	}
+	buf[n++] = '"';
+	buf[n] = '\0';
+
+	return n;
+}
+
+
+/******************************************************************************/
+static void dd_metrics_export_histogram(int fd, struct dd_metric *m)
+{
+	uint64_t limits[DD_METRIC_LIMITS], counts[DD_METRIC_LIMITS], count, sum;
+	const char *sep = *m->labels ? "," : "";
+	int i;
+
+	for (i = 0; i < DD_METRIC_LIMITS; i++)
+	{
+		limits[i] = 1ull << (2 * i);
+	}
+	count = dd_histogram_cumulative(m->h, limits, counts, DD_METRIC_LIMITS, &sum);
+	for (i = 0; i < DD_METRIC_LIMITS; i++)
+	{
+		dprintf(fd, "%s_bucket{%s%sle=\"%llu\"} %llu\n", m->name, m->labels, sep,
+		        (unsigned long long)limits[i], (unsigned long long)counts[i]);
+	}
+	dprintf(fd, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", m->name, m->labels, sep,
+	        (unsigned long long)count);
+	if (*m->labels)
+	{
+		dprintf(fd, "%s_sum{%s} %llu\n", m->name, m->labels, (unsigned long long)sum);
+		dprintf(fd, "%s_count{%s} %llu\n", m->name, m->labels, (unsigned long long)count);
+	}
+	else
+	{
+		dprintf(fd, "%s_sum %llu\n", m->name, (unsigned long long)sum);
+		dprintf(fd, "%s_count %llu\n", m->name, (unsigned long long)count);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Export all metrics in Prometheus text format into file descriptor.
+ * Metrics with same name are written together under one HELP and TYPE.
+ */
+void dd_metrics_export(int fd)
+{
+	struct dd_metric *m;
+	int i, j, n = __atomic_load_n(&dd_metric_count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+	{
+		for (j = 0; j < i && strcmp(dd_metrics[j].name, dd_metrics[i].name); j++);
+		if (j < i)
+		{
+			continue;
+		}
+		dd_metrics_family(fd, dd_metrics[i].name, dd_metrics[i].type, dd_metrics[i].help);
+		for (j = i; j < n; j++)
+		{
+			m = &dd_metrics[j];
+			if (strcmp(m->name, dd_metrics[i].name))
+			{
+				continue;
+			}
+			if (m->type == DD_METRIC_HISTOGRAM)
+			{
+				dd_metrics_export_histogram(fd, m);
+			}
+			else if (m->fn)
+			{
+				dd_metrics_sample(fd, m->name, m->labels, m->fn(m->arg));
+			}
+			else
+			{
+				dprintf(fd, *m->labels ? "%s{%s} %lld\n" : "%s%s %lld\n", m->name,
+				        m->labels, (long long)dd_metric_value(j));
+			}
+		}
+	}
+
+	n = __atomic_load_n(&dd_metric_collector_count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++)
+	{
+		dd_metric_collectors[i].fn(fd, dd_metric_collectors[i].arg);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Export all metrics into file. File is written under temporary name and
+ * then renamed, so readers such as textfile collector of node_exporter
+ * never see partial file.
+ *
+ * @return 0 on success, -1 on errors
+ */
+int dd_metrics_export_file(const char *path)
+{
+	char tmp[4096];
+	int fd;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= sizeof(tmp))
+	{
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	dd_metrics_export(fd);
+	if (close(fd) != 0 || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
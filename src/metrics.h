@@ -0,0 +1,158 @@
+/*
+ * DDebuglib
+ *
+ * Process-wide registry of named counters, gauges and histograms, exported
+ * on demand in Prometheus text format. Updates go to the shard of the
+ * calling thread. Threads get private shards while there are free ones
+ * and give them back when they exit, so only when more than
+ * DD_METRIC_SHARDS - 1 threads update metrics at the same time do the
+ * rest share one shard with atomic adds, see ddshard.h.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "ddshard.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of metrics. */
+#define DD_METRIC_MAX 256
+
+/** Maximum number of collectors. */
+#define DD_METRIC_COLLECTORS 32
+
+/** Number of shards, see ddshard.h. */
+#define DD_METRIC_SHARDS 16
+
+/** Metric types. */
+enum {
+	DD_METRIC_COUNTER = 0,
+	DD_METRIC_GAUGE,
+	DD_METRIC_HISTOGRAM,
+};
+
+/** Function that returns current value of metric. */
+typedef double (*dd_metric_fn)(void *arg);
+
+/**
+ * Function that writes samples into export, for subsystems that have their
+ * own tables. Use dd_metrics_family() and dd_metrics_sample() to write.
+ */
+typedef void (*dd_metrics_collector_fn)(int fd, void *arg);
+
+/** Values of all metrics in one shard. */
+struct dd_metric_shard
+{
+	int64_t v[DD_METRIC_MAX];
+} __attribute__((aligned(64)));
+
+/** One metric. */
+struct dd_metric
+{
+	int type;
+	const char *name;
+	const char *labels;
+	const char *help;
+	/** Value set with dd_gauge_set(), added to shard values. */
+	int64_t base;
+	struct dd_histogram *h;
+	dd_metric_fn fn;
+	void *arg;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_metric_counter(const char *, const char *, const char *);
+int dd_metric_gauge(const char *, const char *, const char *);
+int dd_metric_histogram(const char *, const char *, const char *, int);
+int dd_metric_callback(int, const char *, const char *, const char *, dd_metric_fn, void *);
+int dd_metric_find(const char *, const char *);
+int dd_metrics_count(void);
+int64_t dd_metric_value(int);
+struct dd_histogram *dd_metric_get_histogram(int);
+void dd_gauge_set(int, int64_t);
+int dd_metrics_collector(dd_metrics_collector_fn, void *);
+void dd_metrics_family(int, const char *, int, const char *);
+void dd_metrics_sample(int, const char *, const char *, double);
+size_t dd_metrics_label(char *, size_t, const char *, const char *);
+void dd_metrics_export(int);
+int dd_metrics_export_file(const char *);
+int dd_metric_shard_new(void);
+
+/** Registered metrics. */
+extern struct dd_metric dd_metrics[DD_METRIC_MAX];
+
+/** Values of counters and gauges. */
+extern struct dd_metric_shard dd_metric_shards[DD_METRIC_SHARDS];
+
+/** Shard of this thread, -1 until first update. */
+extern __thread int dd_metric_shard_n;
+
+/** Whether this thread is the only one using its shard. */
+extern __thread int dd_metric_shard_own;
+
+/**
+ * Add to counter or gauge. Metric ids below zero, as returned when the
+ * registry is full, are ignored.
+ */
+static __inline__ void dd_metric_add(int id, int64_t v)
+{
+	int64_t *p;
+	int i = dd_metric_shard_n;
+
+	if (__builtin_expect((unsigned int)id >= DD_METRIC_MAX, 0))
+	{
+		return;
+	}
+	if (__builtin_expect(i < 0, 0))
+	{
+		i = dd_metric_shard_new();
+	}
+	p = &dd_metric_shards[i].v[id];
+	dd_shard_add(dd_metric_shard_own, (uint64_t *)p, (uint64_t)v);
+}
+
+/** Increment counter. */
+static __inline__ void dd_counter_inc(int id)
+{
+	dd_metric_add(id, 1);
+}
+
+/** Add to counter, v must not be negative. */
+static __inline__ void dd_counter_add(int id, int64_t v)
+{
+	dd_metric_add(id, v);
+}
+
+/** Add to gauge, v may be negative. */
+static __inline__ void dd_gauge_add(int id, int64_t v)
+{
+	dd_metric_add(id, v);
+}
+
+/** Record value into histogram metric. */
+static __inline__ void dd_metric_observe(int id, uint64_t v)
+{
+	if (__builtin_expect((unsigned int)id < DD_METRIC_MAX && dd_metrics[id].h != NULL, 1))
+	{
+		dd_histogram_record(dd_metrics[id].h, v);
+	}
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,331 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+int dd_perf_on = 0;
+
+/** Counter set in use, same for all threads so results can be merged. */
+static int dd_perf_set = DD_PERF_NONE;
+
+/** Counters of one thread. */
+struct dd_perf_thread
+{
+	/** 0 when not opened yet, 1 when open, -1 when not available. */
+	int state;
+	int fds[DD_PERF_COUNTERS];
+	struct perf_event_mmap_page *pages[DD_PERF_COUNTERS];
+};
+
+static __thread struct dd_perf_thread dd_perf_self;
+
+static pthread_once_t dd_perf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_perf_key;
+
+static const struct
+{
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} dd_perf_events[3][DD_PERF_COUNTERS] = {
+	{
+		{ 0, 0, "" }, { 0, 0, "" }, { 0, 0, "" }, { 0, 0, "" },
+	},
+	{
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+	},
+	{
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu-migrations" },
+	},
+};
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_perf_close(struct dd_perf_thread *t)
+{
+	int i;
+
+	for (i = 0; i < DD_PERF_COUNTERS; i++)
+	{
+		if (t->pages[i])
+		{
+			munmap(t->pages[i], sysconf(_SC_PAGESIZE));
+			t->pages[i] = NULL;
+		}
+		if (t->fds[i] >= 0)
+		{
+			close(t->fds[i]);
+			t->fds[i] = -1;
+		}
+	}
+}
+
+
+/******************************************************************************/
+static void dd_perf_thread_exit(void *arg)
+{
+	struct dd_perf_thread *t = arg;
+
+	dd_perf_close(t);
+	t->state = -1;
+}
+
+
+/******************************************************************************/
+static void dd_perf_setup(void)
+{
+	pthread_key_create(&dd_perf_key, dd_perf_thread_exit);
+}
+
+
+/******************************************************************************/
+/**
+ * Open counter group of set for calling thread.
+ *
+ * @return 0 on success, -1 on errors
+ */
+static int dd_perf_open_set(struct dd_perf_thread *t, int set)
+{
+	struct perf_event_attr attr;
+	void *page;
+	int i, group = -1;
+
+	for (i = 0; i < DD_PERF_COUNTERS; i++)
+	{
+		t->fds[i] = -1;
+		t->pages[i] = NULL;
+	}
+	for (i = 0; i < DD_PERF_COUNTERS; i++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = dd_perf_events[set][i].type;
+		attr.config = dd_perf_events[set][i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.disabled = (group < 0);
+		t->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+		if (t->fds[i] < 0)
+		{
+			dd_perf_close(t);
+			return -1;
+		}
+		if (group < 0)
+		{
+			group = t->fds[i];
+		}
+		/* User page tells whether rdpmc can be used, not fatal if missing. */
+		page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, t->fds[i], 0);
+		t->pages[i] = (page == MAP_FAILED) ? NULL : page;
+	}
+	ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Open counters for calling thread. Set is chosen by first thread:
+ * hardware if available, software otherwise.
+ */
+static int dd_perf_open(struct dd_perf_thread *t)
+{
+	int set, none = DD_PERF_NONE;
+
+	pthread_once(&dd_perf_once, dd_perf_setup);
+
+	set = __atomic_load_n(&dd_perf_set, __ATOMIC_ACQUIRE);
+	if (set == DD_PERF_NONE)
+	{
+		set = dd_perf_open_set(t, DD_PERF_HW) == 0 ? DD_PERF_HW :
+		      dd_perf_open_set(t, DD_PERF_SW) == 0 ? DD_PERF_SW : DD_PERF_NONE;
+		if (set == DD_PERF_NONE)
+		{
+			t->state = -1;
+			return -1;
+		}
+		if (!__atomic_compare_exchange_n(&dd_perf_set, &none, set, 0,
+		                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && none != set)
+		{
+			/* Other thread chose different set first, follow it. */
+			dd_perf_close(t);
+			set = none;
+			if (dd_perf_open_set(t, set))
+			{
+				t->state = -1;
+				return -1;
+			}
+		}
+	}
+	else if (dd_perf_open_set(t, set))
+	{
+		t->state = -1;
+		return -1;
+	}
+
+	t->state = 1;
+	pthread_setspecific(dd_perf_key, t);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Read counter through rdpmc.
+ *
+ * @return 0 on success, -1 if rdpmc can not be used for counter
+ */
+static __inline__ int dd_perf_rdpmc(struct perf_event_mmap_page *pc, uint64_t *value)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	uint32_t seq, idx, lo, hi;
+	uint64_t count;
+	int64_t offset;
+	uint16_t width;
+
+	if (!pc)
+	{
+		return -1;
+	}
+	do
+	{
+		seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+		idx = pc->index;
+		offset = pc->offset;
+		width = pc->pmc_width;
+		if (!pc->cap_user_rdpmc || idx == 0)
+		{
+			return -1;
+		}
+		__asm__ __volatile__("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx - 1));
+		count = ((uint64_t)hi << 32) | lo;
+		count = (uint64_t)((int64_t)(count << (64 - width)) >> (64 - width));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+	*value = (uint64_t)offset + count;
+
+	return 0;
+#else
+	(void)pc;
+	(void)value;
+	return -1;
+#endif
+}
+
+
+/******************************************************************************/
+/**
+ * Read counters of calling thread. Counters are opened on first call.
+ *
+ * @return 0 on success, -1 if counters are not available
+ */
+int dd_perf_read(struct dd_perf_sample *s)
+{
+	struct dd_perf_thread *t = &dd_perf_self;
+	uint64_t buf[1 + DD_PERF_COUNTERS];
+	int i;
+
+	if (__builtin_expect(t->state <= 0, 0) && (t->state < 0 || dd_perf_open(t)))
+	{
+		memset(s, 0, sizeof(*s));
+		return -1;
+	}
+
+	for (i = 0; i < DD_PERF_COUNTERS; i++)
+	{
+		if (dd_perf_rdpmc(t->pages[i], &s->v[i]))
+		{
+			break;
+		}
+	}
+	if (i < DD_PERF_COUNTERS)
+	{
+		/* Whole group in one read: number of values, then values. */
+		if (read(t->fds[0], buf, sizeof(buf)) < (ssize_t)sizeof(buf))
+		{
+			memset(s, 0, sizeof(*s));
+			return -1;
+		}
+		memcpy(s->v, &buf[1], sizeof(s->v));
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Enable or disable reading counters in zones and timerecs. Counters of
+ * calling thread are opened to find out which set is available.
+ *
+ * @return counter set in use, DD_PERF_NONE if none is available
+ */
+int dd_perf_enable(int enable)
+{
+	struct dd_perf_sample s;
+
+	if (enable && dd_perf_read(&s))
+	{
+		enable = 0;
+	}
+	__atomic_store_n(&dd_perf_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+
+	return dd_perf_kind();
+}
+
+
+/******************************************************************************/
+/**
+ * @return counter set in use, DD_PERF_NONE if not opened or not available
+ */
+int dd_perf_kind(void)
+{
+	return __atomic_load_n(&dd_perf_set, __ATOMIC_ACQUIRE);
+}
+
+
+/******************************************************************************/
+/**
+ * @return name of counter in set in use
+ */
+const char *dd_perf_name(int i)
+{
+	if (i < 0 || i >= DD_PERF_COUNTERS)
+	{
+		return "";
+	}
+	return dd_perf_events[dd_perf_kind()][i].name;
+}
+
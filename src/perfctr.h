@@ -0,0 +1,57 @@
+/*
+ * DDebuglib
+ *
+ * Per-thread performance counters with perf_event_open(). Hardware
+ * counters are used when available, software events otherwise. Counters
+ * are read with rdpmc when the kernel allows it.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Number of counters in one group. */
+#define DD_PERF_COUNTERS 4
+
+/**
+ * Counter sets. Hardware set is cycles, instructions, cache misses and
+ * branch misses. Software set is task clock in nanoseconds, page faults,
+ * context switches and CPU migrations.
+ */
+enum {
+	DD_PERF_NONE = 0,
+	DD_PERF_HW,
+	DD_PERF_SW,
+};
+
+/** Counter values of calling thread. */
+struct dd_perf_sample
+{
+	uint64_t v[DD_PERF_COUNTERS];
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_perf_enable(int);
+int dd_perf_kind(void);
+const char *dd_perf_name(int);
+int dd_perf_read(struct dd_perf_sample *);
+
+/** Whether zones and timerecs read counters. */
+extern int dd_perf_on;
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
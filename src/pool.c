@@ -0,0 +1,285 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "synchro.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/*
+ * Objects are carved from slabs that are never given back, free objects
+ * are linked through their first word. Each thread keeps a free list per
+ * pool and moves objects to and from the pool in batches, so the pool lock
+ * is taken once per batch. Caches are flushed when their thread exits.
+ */
+
+/** All pools that have been used. */
+static struct dd_pool *dd_pools = NULL;
+
+/** Pool caches used by this thread. */
+static __thread struct dd_pool_cache *dd_pool_caches = NULL;
+
+static pthread_once_t dd_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_pool_key;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_pool_atfork_prepare(void)
+{
+	struct dd_pool *pool;
+
+	for (pool = __atomic_load_n(&dd_pools, __ATOMIC_ACQUIRE); pool; pool = pool->next)
+	{
+		dd_spin_lock(&pool->lock);
+	}
+}
+
+
+/******************************************************************************/
+static void dd_pool_atfork_release(void)
+{
+	struct dd_pool *pool;
+
+	for (pool = __atomic_load_n(&dd_pools, __ATOMIC_ACQUIRE); pool; pool = pool->next)
+	{
+		dd_spin_unlock(&pool->lock);
+	}
+}
+
+
+/******************************************************************************/
+static void dd_pool_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_pool_flush();
+}
+
+
+/******************************************************************************/
+static void dd_pool_setup(void)
+{
+	pthread_key_create(&dd_pool_key, dd_pool_thread_exit);
+	pthread_atfork(dd_pool_atfork_prepare, dd_pool_atfork_release, dd_pool_atfork_release);
+}
+
+
+/******************************************************************************/
+/**
+ * Add pool into list of all pools and cache into list of this thread.
+ */
+static void dd_pool_register(struct dd_pool *pool, struct dd_pool_cache *c)
+{
+	int listed = 0;
+
+	pthread_once(&dd_pool_once, dd_pool_setup);
+
+	if (__atomic_compare_exchange_n(&pool->listed, &listed, 1, 0,
+	                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		pool->next = __atomic_load_n(&dd_pools, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&dd_pools, &pool->next, pool, 1,
+		                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	c->pool = pool;
+	c->next = dd_pool_caches;
+	dd_pool_caches = c;
+	c->registered = 1;
+	pthread_setspecific(dd_pool_key, &dd_pool_caches);
+}
+
+
+/******************************************************************************/
+/**
+ * Add new slab into free list of pool. Pool lock must be held.
+ */
+static int dd_pool_slab_new(struct dd_pool *pool)
+{
+	size_t n = DD_POOL_SLAB / pool->size, i;
+	char *slab, *obj;
+
+	if (n < DD_POOL_BATCH)
+	{
+		n = DD_POOL_BATCH;
+	}
+	slab = malloc(16 + n * pool->size);
+	if (!slab)
+	{
+		return -1;
+	}
+	*(void **)slab = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+	pool->capacity += n;
+
+	obj = slab + 16;
+	for (i = 0; i < n - 1; i++)
+	{
+		*(void **)(obj + i * pool->size) = obj + (i + 1) * pool->size;
+	}
+	*(void **)(obj + i * pool->size) = pool->free;
+	pool->free = obj;
+	pool->free_count += n;
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of dd_pool_get(): thread cache is empty, move batch of
+ * objects into it from pool.
+ *
+ * @return one object or NULL if out of memory
+ */
+void *dd_pool_refill(struct dd_pool *pool, struct dd_pool_cache *c)
+{
+	void *head, *tail;
+	unsigned int n;
+
+	if (!c->registered)
+	{
+		dd_pool_register(pool, c);
+	}
+
+	dd_spin_lock(&pool->lock);
+	if (!pool->free && dd_pool_slab_new(pool))
+	{
+		dd_spin_unlock(&pool->lock);
+		return NULL;
+	}
+	head = tail = pool->free;
+	for (n = 1; n < DD_POOL_BATCH && *(void **)tail; n++)
+	{
+		tail = *(void **)tail;
+	}
+	pool->free = *(void **)tail;
+	pool->free_count -= n;
+	pool->gets += c->gets + 1;
+	pool->puts += c->puts;
+	dd_spin_unlock(&pool->lock);
+	c->gets = c->puts = 0;
+
+	/* First object is returned, rest go to thread cache. */
+	*(void **)tail = c->head;
+	c->head = *(void **)head;
+	c->count += n - 1;
+
+	return head;
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of dd_pool_put(): move n objects from thread cache into pool.
+ */
+void dd_pool_drain(struct dd_pool *pool, struct dd_pool_cache *c, unsigned int n)
+{
+	void *head = NULL, *tail = NULL;
+	unsigned int i;
+
+	if (!c->registered)
+	{
+		dd_pool_register(pool, c);
+	}
+
+	if (n > c->count)
+	{
+		n = c->count;
+	}
+	if (n > 0)
+	{
+		head = tail = c->head;
+		for (i = 1; i < n; i++)
+		{
+			tail = *(void **)tail;
+		}
+		c->head = *(void **)tail;
+		c->count -= n;
+	}
+
+	dd_spin_lock(&pool->lock);
+	if (n > 0)
+	{
+		*(void **)tail = pool->free;
+		pool->free = head;
+		pool->free_count += n;
+	}
+	pool->gets += c->gets;
+	pool->puts += c->puts;
+	dd_spin_unlock(&pool->lock);
+	c->gets = c->puts = 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Return all objects cached by calling thread into their pools. Done
+ * automatically when thread exits.
+ */
+void dd_pool_flush(void)
+{
+	struct dd_pool_cache *c;
+
+	for (c = dd_pool_caches; c; c = c->next)
+	{
+		dd_pool_drain(c->pool, c, c->count);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Get occupancy of pool. Counts of other threads are added to pool when
+ * they exchange objects with it, so they lag behind by at most one batch
+ * per thread.
+ */
+void dd_pool_stats(struct dd_pool *pool, struct dd_pool_stats *stats)
+{
+	dd_spin_lock(&pool->lock);
+	stats->slabs = pool->slab_count;
+	stats->capacity = pool->capacity;
+	stats->gets = pool->gets;
+	stats->puts = pool->puts;
+	dd_spin_unlock(&pool->lock);
+	stats->in_use = (stats->gets > stats->puts) ? (size_t)(stats->gets - stats->puts) : 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Print occupancy of all pools into file descriptor.
+ */
+void dd_pool_report(int fd)
+{
+	struct dd_pool *pool;
+	struct dd_pool_stats s;
+
+	dd_pool_flush();
+	dprintf(fd, "%-24s %8s %10s %10s %12s %12s\n",
+	        "pool", "size", "capacity", "in use", "gets", "puts");
+	for (pool = __atomic_load_n(&dd_pools, __ATOMIC_ACQUIRE); pool; pool = pool->next)
+	{
+		dd_pool_stats(pool, &s);
+		dprintf(fd, "%-24s %8lu %10lu %10lu %12llu %12llu\n",
+		        pool->name, (unsigned long)pool->size, (unsigned long)s.capacity,
+		        (unsigned long)s.in_use, (unsigned long long)s.gets,
+		        (unsigned long long)s.puts);
+	}
+}
+
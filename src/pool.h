@@ -0,0 +1,155 @@
+/*
+ * DDebuglib
+ *
+ * Typed pools of fixed size objects with per-thread free lists.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Objects moved at once between thread cache and pool. */
+#define DD_POOL_BATCH 32
+
+/** Minimum size of one slab. */
+#define DD_POOL_SLAB (64 * 1024)
+
+/** Pool of one object type. Initialize with DD_POOL_INITIALIZER(). */
+struct dd_pool
+{
+	const char *name;
+	size_t size;
+	int zero;
+	int lock;
+	/** Free objects not in any thread cache. */
+	void *free;
+	size_t free_count;
+	/** Slabs, linked through their first word. */
+	void *slabs;
+	size_t slab_count;
+	/** Number of objects in all slabs. */
+	size_t capacity;
+	/** Gets and puts, thread caches add their counts in batches. */
+	uint64_t gets;
+	uint64_t puts;
+	/** Next pool in list of all pools. */
+	struct dd_pool *next;
+	int listed;
+};
+
+/** Cache of one thread for one pool. */
+struct dd_pool_cache
+{
+	void *head;
+	unsigned int count;
+	unsigned int registered;
+	uint64_t gets;
+	uint64_t puts;
+	struct dd_pool *pool;
+	struct dd_pool_cache *next;
+};
+
+/** Occupancy of pool. */
+struct dd_pool_stats
+{
+	size_t slabs;
+	size_t capacity;
+	size_t in_use;
+	uint64_t gets;
+	uint64_t puts;
+};
+
+#define DD_POOL_INITIALIZER(name, size, zero) \
+	{ name, ((size) + 15) & ~(size_t)15, zero, 0, NULL, 0, NULL, 0, 0, 0, 0, NULL, 0 }
+
+/**
+ * Declare pool for struct type. Defines functions
+ *   struct type *type_pool_get(void)
+ *   void type_pool_put(struct type *)
+ * Objects from DD_POOL_DECLARE_ZERO() pools are cleared on get.
+ */
+#define DD_POOL_DECLARE_EXT(type, zero) \
+	static struct dd_pool type##_pool = DD_POOL_INITIALIZER(#type, sizeof(struct type), zero); \
+	static __thread struct dd_pool_cache type##_pool_cache; \
+	static __inline__ __attribute__((unused)) struct type *type##_pool_get(void) \
+	{ \
+		return dd_pool_get(&type##_pool, &type##_pool_cache); \
+	} \
+	static __inline__ __attribute__((unused)) void type##_pool_put(struct type *p) \
+	{ \
+		dd_pool_put(&type##_pool, &type##_pool_cache, p); \
+	}
+#define DD_POOL_DECLARE(type) DD_POOL_DECLARE_EXT(type, 0)
+#define DD_POOL_DECLARE_ZERO(type) DD_POOL_DECLARE_EXT(type, 1)
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+void *dd_pool_refill(struct dd_pool *, struct dd_pool_cache *);
+void dd_pool_drain(struct dd_pool *, struct dd_pool_cache *, unsigned int);
+void dd_pool_flush(void);
+void dd_pool_stats(struct dd_pool *, struct dd_pool_stats *);
+void dd_pool_report(int);
+
+/**
+ * Get object from pool.
+ *
+ * @return object or NULL if out of memory
+ */
+static __inline__ void *dd_pool_get(struct dd_pool *pool, struct dd_pool_cache *c)
+{
+	void *p = c->head;
+
+	if (__builtin_expect(p != NULL, 1))
+	{
+		c->head = *(void **)p;
+		c->count--;
+		c->gets++;
+	}
+	else
+	{
+		p = dd_pool_refill(pool, c);
+	}
+	if (p && pool->zero)
+	{
+		memset(p, 0, pool->size);
+	}
+
+	return p;
+}
+
+/**
+ * Return object into pool. Object goes into cache of calling thread.
+ */
+static __inline__ void dd_pool_put(struct dd_pool *pool, struct dd_pool_cache *c, void *p)
+{
+	if (!p)
+	{
+		return;
+	}
+	*(void **)p = c->head;
+	c->head = p;
+	c->count++;
+	c->puts++;
+	if (__builtin_expect(c->count > 2 * DD_POOL_BATCH, 0) || !c->registered)
+	{
+		dd_pool_drain(pool, c, c->registered ? DD_POOL_BATCH : 0);
+	}
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
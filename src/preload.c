@@ -0,0 +1,491 @@
+/*
+ * DDebuglib
+ *
+ * malloc() interposer to be used with LD_PRELOAD. Feeds every allocation
+ * of the process into rec_* tracking.
+ *
+ * Environment:
+ *   DDEBUG_PRELOAD_STACKS  call stack depth to capture, default 0 (off)
+ *   DDEBUG_PRELOAD_REPORT  file where report is written at exit,
+ *                          default is stderr
+ *   DDEBUG_PRELOAD_TOP     number of sites in report, default 20
+ *   DDEBUG_PRELOAD_SAMPLE  when set, only sample allocations with heap
+ *                          profiler, value is mean bytes between samples
+ *                          (0 for default), report is a pprof heap profile
+ *   DDEBUG_PRELOAD_SHM     when set, publish metrics into shared memory for
+ *                          ddtop, value is milliseconds between updates
+ *                          (0 for default)
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "heapprof.h"
+#include "shmstats.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Library is built with hidden visibility, only these are exported. */
+#define PRELOAD_EXPORT __attribute__((visibility("default")))
+
+/** Size of bootstrap arena used before real allocator is found. */
+#define PRELOAD_BOOTSTRAP_SIZE (64 * 1024)
+
+/** Bootstrap allocations have their size in a header of this size. */
+#define PRELOAD_BOOTSTRAP_HDR 16
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+static void *(*real_malloc)(size_t) = NULL;
+static void *(*real_calloc)(size_t, size_t) = NULL;
+static void *(*real_realloc)(void *, size_t) = NULL;
+static void (*real_free)(void *) = NULL;
+static int (*real_posix_memalign)(void **, size_t, size_t) = NULL;
+static void *(*real_memalign)(size_t, size_t) = NULL;
+static void *(*real_aligned_alloc)(size_t, size_t) = NULL;
+
+/** Memory handed out while dlsym() is still looking for real allocator. */
+static char preload_bootstrap[PRELOAD_BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+
+/** Bytes used from bootstrap arena. */
+static size_t preload_bootstrap_used = 0;
+
+/** Tracking is started after constructor has finished. */
+static int preload_ready = 0;
+
+/** Set while inside tracking code, allocations made there are not tracked. */
+static __thread int preload_guard __attribute__((tls_model("initial-exec"))) = 0;
+
+/** Number of sites in exit report. */
+static int preload_top = 20;
+
+/** Sample allocations with heap profiler instead of tracking all. */
+static int preload_sample = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void *preload_bootstrap_alloc(size_t size)
+{
+	size_t need = PRELOAD_BOOTSTRAP_HDR + ((size + 15) & ~(size_t)15);
+	size_t off = __atomic_fetch_add(&preload_bootstrap_used, need, __ATOMIC_RELAXED);
+	char *p;
+
+	if (off + need > sizeof(preload_bootstrap))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	p = preload_bootstrap + off;
+	*(size_t *)p = size;
+
+	return p + PRELOAD_BOOTSTRAP_HDR;
+}
+
+
+/******************************************************************************/
+static __inline__ int preload_is_bootstrap(void *ptr)
+{
+	return (char *)ptr >= preload_bootstrap &&
+	       (char *)ptr < preload_bootstrap + sizeof(preload_bootstrap);
+}
+
+
+/******************************************************************************/
+/**
+ * Find real allocator functions. dlsym() may allocate, those allocations
+ * are served from bootstrap arena.
+ */
+static void preload_resolve(void)
+{
+	preload_guard++;
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	/* malloc last, it is used to check whether everything is resolved. */
+	__atomic_store_n(&real_malloc, dlsym(RTLD_NEXT, "malloc"), __ATOMIC_RELEASE);
+	preload_guard--;
+}
+
+
+/******************************************************************************/
+/**
+ * Check that real allocator is known.
+ *
+ * @return 1 if real allocator can be used, 0 if bootstrap arena must be used
+ */
+static __inline__ int preload_real(void)
+{
+	if (__builtin_expect(__atomic_load_n(&real_malloc, __ATOMIC_ACQUIRE) != NULL, 1))
+	{
+		return 1;
+	}
+	if (preload_guard)
+	{
+		return 0;
+	}
+	preload_resolve();
+	return real_malloc != NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Start tracking allocation. Caller of the allocation function is used
+ * as allocation site.
+ */
+static __attribute__((noinline)) void preload_track(void *ptr, size_t size, void *caller)
+{
+	preload_guard++;
+	rec_track_alloc(ptr, size, rec_stack_capture(2), NULL, (uintptr_t)caller);
+	preload_guard--;
+}
+
+
+/******************************************************************************/
+static __inline__ int preload_tracking(void)
+{
+	return __builtin_expect(preload_ready, 1) && !preload_guard;
+}
+
+
+/******************************************************************************/
+static __inline__ void preload_alloc(void *ptr, size_t size, void *caller)
+{
+	if (preload_sample)
+	{
+		heapprof_alloc(ptr, size);
+	}
+	else
+	{
+		preload_track(ptr, size, caller);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Stop tracking allocation that realloc() is about to release.
+ *
+ * @return 1 if entry was got, 0 if sampled or not tracked
+ */
+static int preload_untrack_entry(void *ptr, struct ptrtable_entry *e)
+{
+	int err;
+
+	if (preload_sample)
+	{
+		heapprof_free(ptr);
+		return 0;
+	}
+	preload_guard++;
+	err = rec_track_take(ptr, e);
+	preload_guard--;
+
+	return err == 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Track allocation again after realloc() failed and left it in place.
+ * Sampled allocations are offered to the sampler again.
+ */
+static void preload_retrack(void *ptr, const struct ptrtable_entry *e)
+{
+	if (preload_sample)
+	{
+		heapprof_alloc(ptr, malloc_usable_size(ptr));
+		return;
+	}
+	if (e)
+	{
+		preload_guard++;
+		rec_track_restore(e);
+		preload_guard--;
+	}
+}
+
+
+/******************************************************************************/
+static __inline__ void preload_untrack(void *ptr)
+{
+	if (preload_tracking())
+	{
+		if (preload_sample)
+		{
+			heapprof_free(ptr);
+			return;
+		}
+		preload_guard++;
+		rec_track_free(ptr);
+		preload_guard--;
+	}
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void *malloc(size_t size)
+{
+	void *ptr;
+
+	if (!preload_real())
+	{
+		return preload_bootstrap_alloc(size);
+	}
+	ptr = real_malloc(size);
+	if (ptr && preload_tracking())
+	{
+		preload_alloc(ptr, size, __builtin_return_address(0));
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void *calloc(size_t n, size_t size)
+{
+	void *ptr;
+
+	if (!preload_real())
+	{
+		if (size && n > (size_t)-1 / size)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		/* Bootstrap arena is static and never reused, so it is zero. */
+		return preload_bootstrap_alloc(n * size);
+	}
+	ptr = real_calloc(n, size);
+	if (ptr && preload_tracking())
+	{
+		preload_alloc(ptr, n * size, __builtin_return_address(0));
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void *realloc(void *old, size_t size)
+{
+	struct ptrtable_entry e;
+	void *ptr;
+	int tracking, tracked = 0;
+
+	if (preload_is_bootstrap(old))
+	{
+		size_t n = *(size_t *)((char *)old - PRELOAD_BOOTSTRAP_HDR);
+		ptr = malloc(size);
+		if (ptr)
+		{
+			memcpy(ptr, old, n < size ? n : size);
+		}
+		return ptr;
+	}
+	if (!preload_real())
+	{
+		return preload_bootstrap_alloc(size);
+	}
+
+	/* Old pointer may be handed out to another thread as soon as it is released. */
+	tracking = preload_tracking();
+	if (tracking && old)
+	{
+		tracked = preload_untrack_entry(old, &e);
+	}
+	ptr = real_realloc(old, size);
+	if (tracking)
+	{
+		/* Old memory is left as it was when realloc fails, except for size zero. */
+		if (old && !ptr && size != 0)
+		{
+			preload_retrack(old, tracked ? &e : NULL);
+		}
+		if (ptr)
+		{
+			preload_alloc(ptr, size, __builtin_return_address(0));
+		}
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void free(void *ptr)
+{
+	if (!ptr || preload_is_bootstrap(ptr))
+	{
+		return;
+	}
+	preload_untrack(ptr);
+	if (preload_real())
+	{
+		real_free(ptr);
+	}
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT int posix_memalign(void **ptr, size_t align, size_t size)
+{
+	int err;
+
+	if (!preload_real())
+	{
+		*ptr = align <= 16 ? preload_bootstrap_alloc(size) : NULL;
+		return *ptr ? 0 : ENOMEM;
+	}
+	err = real_posix_memalign(ptr, align, size);
+	if (err == 0 && preload_tracking())
+	{
+		preload_alloc(*ptr, size, __builtin_return_address(0));
+	}
+
+	return err;
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void *memalign(size_t align, size_t size)
+{
+	void *ptr;
+
+	if (!preload_real())
+	{
+		return align <= 16 ? preload_bootstrap_alloc(size) : NULL;
+	}
+	ptr = real_memalign(align, size);
+	if (ptr && preload_tracking())
+	{
+		preload_alloc(ptr, size, __builtin_return_address(0));
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+PRELOAD_EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+	void *ptr;
+
+	if (!preload_real())
+	{
+		return align <= 16 ? preload_bootstrap_alloc(size) : NULL;
+	}
+	ptr = real_aligned_alloc(align, size);
+	if (ptr && preload_tracking())
+	{
+		preload_alloc(ptr, size, __builtin_return_address(0));
+	}
+
+	return ptr;
+}
+
+
+/******************************************************************************/
+/**
+ * Resolve real allocator and start tracking.
+ */
+static __attribute__((constructor)) void preload_init(void)
+{
+	const char *env;
+
+	preload_real();
+
+	preload_guard++;
+	env = getenv("DDEBUG_PRELOAD_SAMPLE");
+	if (env)
+	{
+		heapprof_start(strtoul(env, NULL, 0));
+		preload_sample = 1;
+	}
+	rec_init();
+	env = getenv("DDEBUG_PRELOAD_STACKS");
+	if (env)
+	{
+		rec_stacks(atoi(env));
+	}
+	env = getenv("DDEBUG_PRELOAD_TOP");
+	if (env)
+	{
+		preload_top = atoi(env);
+	}
+	env = getenv("DDEBUG_PRELOAD_SHM");
+	if (env)
+	{
+		dd_shm_start(NULL, atoi(env) > 0 ? atoi(env) : DD_SHM_INTERVAL);
+	}
+	preload_guard--;
+
+	__atomic_store_n(&preload_ready, 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+/**
+ * Write report of allocations still alive at exit.
+ */
+static __attribute__((destructor)) void preload_quit(void)
+{
+	const char *env;
+	int fd = STDERR_FILENO;
+
+	preload_guard++;
+	dd_shm_stop();
+	env = getenv("DDEBUG_PRELOAD_REPORT");
+	if (env)
+	{
+		fd = open(env, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			fd = STDERR_FILENO;
+		}
+	}
+
+	if (preload_sample)
+	{
+		heapprof_dump(fd);
+	}
+	else
+	{
+		dprintf(fd, "== top allocation sites by live bytes ==\n");
+		rec_report(fd, preload_top, SITESTATS_ORDER_LIVE);
+		dprintf(fd, "== top allocation sites by total bytes ==\n");
+		rec_report(fd, preload_top, SITESTATS_ORDER_CHURN);
+		if (getenv("DDEBUG_PRELOAD_STACKS"))
+		{
+			dprintf(fd, "== live allocations by stack ==\n");
+			rec_report_stacks(fd, preload_top);
+		}
+	}
+
+	if (fd != STDERR_FILENO)
+	{
+		close(fd);
+	}
+	preload_guard--;
+}
+
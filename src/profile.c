@@ -0,0 +1,423 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "profile.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/*
+ * Each thread owns a call tree that only it writes to. Trees are never
+ * released: when a thread exits its tree is handed to the next new
+ * thread, which keeps adding to the same counters. Reports merge trees
+ * of all threads by zone path, so totals are not affected by this.
+ */
+
+int dd_profile_on = 0;
+
+__thread struct dd_profile_thread *dd_profile_self = NULL;
+
+/** Trees of all threads. */
+static struct dd_profile_thread *dd_profile_threads = NULL;
+
+static pthread_once_t dd_profile_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_profile_key;
+
+/** Node of merged call tree. */
+struct dd_profile_merged
+{
+	struct dd_zone *zone;
+	int child;
+	int next;
+	uint64_t count;
+	uint64_t ticks;
+	uint64_t min;
+	uint64_t max;
+	uint64_t perf_count;
+	uint64_t perf[DD_PERF_COUNTERS];
+};
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_profile_thread_exit(void *arg)
+{
+	struct dd_profile_thread *t = arg;
+
+	dd_profile_self = NULL;
+	__atomic_store_n(&t->free, 1, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************/
+static void dd_profile_setup(void)
+{
+	pthread_key_create(&dd_profile_key, dd_profile_thread_exit);
+}
+
+
+/******************************************************************************/
+/**
+ * Get tree for calling thread, tree of exited thread is reused if there
+ * is one.
+ */
+static struct dd_profile_thread *dd_profile_thread_new(void)
+{
+	struct dd_profile_thread *t;
+	int free;
+
+	pthread_once(&dd_profile_once, dd_profile_setup);
+
+	for (t = __atomic_load_n(&dd_profile_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	{
+		free = 1;
+		if (__atomic_compare_exchange_n(&t->free, &free, 0, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+
+	if (!t)
+	{
+		t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (t == MAP_FAILED)
+		{
+			return NULL;
+		}
+		t->nodes[0].parent = -1;
+		t->nodes[0].child = -1;
+		t->nodes[0].next = -1;
+		t->nodes[0].hint = -1;
+		t->used = 1;
+		t->next = __atomic_load_n(&dd_profile_threads, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&dd_profile_threads, &t->next, t, 1,
+		                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	t->current = 0;
+	t->depth = 0;
+
+	dd_profile_self = t;
+	pthread_setspecific(dd_profile_key, t);
+
+	return t;
+}
+
+
+/******************************************************************************/
+/**
+ * Slow path of dd_profile_begin(): find zone from children of current
+ * node or add it, then enter it.
+ *
+ * @return 1 if zone is timed, 0 if not
+ */
+int __attribute__((noinline)) dd_profile_enter(struct dd_zone *z)
+{
+	struct dd_profile_thread *t = dd_profile_self;
+	struct dd_profile_node *cur, *n;
+	int i;
+
+	if (!t)
+	{
+		t = dd_profile_thread_new();
+		if (!t)
+		{
+			return 0;
+		}
+	}
+	if (t->depth >= DD_PROFILE_DEPTH)
+	{
+		return 0;
+	}
+
+	cur = &t->nodes[t->current];
+	for (i = cur->child; i >= 0; i = t->nodes[i].next)
+	{
+		if (t->nodes[i].zone == z)
+		{
+			break;
+		}
+	}
+	if (i < 0)
+	{
+		if (t->used >= DD_PROFILE_NODES)
+		{
+			return 0;
+		}
+		i = t->used;
+		n = &t->nodes[i];
+		n->zone = z;
+		n->parent = t->current;
+		n->child = -1;
+		n->hint = -1;
+		n->next = cur->child;
+		n->min = UINT64_MAX;
+		/* Publish node only after it is complete, reports may be reading. */
+		__atomic_store_n(&t->used, i + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&cur->child, i, __ATOMIC_RELEASE);
+	}
+
+	cur->hint = i;
+	t->current = i;
+	if (dd_perf_on)
+	{
+		dd_profile_perf_begin(t);
+	}
+	t->start[t->depth++] = dd_clock_ticks();
+
+	return 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Read counters when entering zone, called before depth is increased.
+ */
+void __attribute__((noinline)) dd_profile_perf_begin(struct dd_profile_thread *t)
+{
+	if (dd_perf_read(&t->perf_start[t->depth]) == 0)
+	{
+		t->perf_mask |= 1ull << t->depth;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Add counter deltas into node when leaving zone, called after depth is
+ * decreased.
+ */
+void __attribute__((noinline)) dd_profile_perf_end(struct dd_profile_thread *t,
+                                                   struct dd_profile_node *n)
+{
+	struct dd_perf_sample s;
+	int i;
+
+	if (!(t->perf_mask & (1ull << t->depth)))
+	{
+		return;
+	}
+	t->perf_mask &= ~(1ull << t->depth);
+	if (dd_perf_read(&s))
+	{
+		return;
+	}
+	for (i = 0; i < DD_PERF_COUNTERS; i++)
+	{
+		__atomic_store_n(&n->perf[i], n->perf[i] + (s.v[i] - t->perf_start[t->depth].v[i]),
+		                 __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&n->perf_count, n->perf_count + 1, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Enable or disable timing of zones. Zones already entered are ended
+ * normally.
+ */
+void dd_profile_enable(int enable)
+{
+	if (enable)
+	{
+		dd_clock_init();
+	}
+	__atomic_store_n(&dd_profile_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Add children of thread node into children of merged node, recursively.
+ */
+static void dd_profile_merge(struct dd_profile_thread *t, int ti,
+                             struct dd_profile_merged *m, int mi, int *used, int max)
+{
+	struct dd_profile_node *n;
+	int i, j, k;
+	uint64_t v;
+
+	for (i = __atomic_load_n(&t->nodes[ti].child, __ATOMIC_ACQUIRE); i >= 0;
+	     i = __atomic_load_n(&t->nodes[i].next, __ATOMIC_ACQUIRE))
+	{
+		n = &t->nodes[i];
+		for (j = m[mi].child; j >= 0 && m[j].zone != n->zone; j = m[j].next);
+		if (j < 0)
+		{
+			if (*used >= max)
+			{
+				return;
+			}
+			j = (*used)++;
+			memset(&m[j], 0, sizeof(m[j]));
+			m[j].zone = n->zone;
+			m[j].child = -1;
+			m[j].next = m[mi].child;
+			m[j].min = UINT64_MAX;
+			m[mi].child = j;
+		}
+		m[j].count += __atomic_load_n(&n->count, __ATOMIC_RELAXED);
+		m[j].ticks += __atomic_load_n(&n->ticks, __ATOMIC_RELAXED);
+		v = __atomic_load_n(&n->min, __ATOMIC_RELAXED);
+		m[j].min = v < m[j].min ? v : m[j].min;
+		v = __atomic_load_n(&n->max, __ATOMIC_RELAXED);
+		m[j].max = v > m[j].max ? v : m[j].max;
+		m[j].perf_count += __atomic_load_n(&n->perf_count, __ATOMIC_RELAXED);
+		for (k = 0; k < DD_PERF_COUNTERS; k++)
+		{
+			m[j].perf[k] += __atomic_load_n(&n->perf[k], __ATOMIC_RELAXED);
+		}
+		dd_profile_merge(t, i, m, j, used, max);
+	}
+}
+
+
+/******************************************************************************/
+static int dd_profile_cmp(const void *a, const void *b)
+{
+	const struct dd_profile_merged *ma = *(const struct dd_profile_merged **)a;
+	const struct dd_profile_merged *mb = *(const struct dd_profile_merged **)b;
+	return (mb->ticks > ma->ticks) - (mb->ticks < ma->ticks);
+}
+
+
+/******************************************************************************/
+/**
+ * Print counters of merged node per call. IPC is shown for hardware
+ * counters instead of instructions.
+ */
+static void dd_profile_print_perf(struct dd_profile_merged *z, int perf, int fd)
+{
+	double c = z->perf_count ? (double)z->perf_count : 1.0;
+
+	if (perf == DD_PERF_HW)
+	{
+		dprintf(fd, " %12.1f %8.2f %10.2f %10.2f", (double)z->perf[0] / c,
+		        z->perf[0] ? (double)z->perf[1] / (double)z->perf[0] : 0.0,
+		        (double)z->perf[2] / c, (double)z->perf[3] / c);
+	}
+	else
+	{
+		dprintf(fd, " %12.3f %8.2f %10.2f %10.2f", (double)z->perf[0] / c / 1e3,
+		        (double)z->perf[1] / c, (double)z->perf[2] / c, (double)z->perf[3] / c);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Print children of merged node, largest inclusive time first.
+ */
+static void dd_profile_print(struct dd_profile_merged *m, int mi, int depth, int perf, int fd)
+{
+	struct dd_profile_merged **list;
+	uint64_t children;
+	int i, j, n = 0;
+
+	for (i = m[mi].child; i >= 0; i = m[i].next)
+	{
+		n++;
+	}
+	list = malloc((n + 1) * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	for (i = m[mi].child, n = 0; i >= 0; i = m[i].next)
+	{
+		list[n++] = &m[i];
+	}
+	qsort(list, n, sizeof(list[0]), dd_profile_cmp);
+
+	for (i = 0; i < n; i++)
+	{
+		struct dd_profile_merged *z = list[i];
+		children = 0;
+		for (j = z->child; j >= 0; j = m[j].next)
+		{
+			children += m[j].ticks;
+		}
+		dprintf(fd, "%*s%-*s %10llu %12.3f %12.3f %10.3f %10.3f %10.3f",
+		        depth * 2, "", 32 - depth * 2 > 0 ? 32 - depth * 2 : 0, z->zone->name,
+		        (unsigned long long)z->count,
+		        dd_clock_ns(z->ticks) / 1e6,
+		        dd_clock_ns(z->ticks > children ? z->ticks - children : 0) / 1e6,
+		        z->count ? dd_clock_ns(z->ticks / z->count) / 1e3 : 0.0,
+		        z->count ? dd_clock_ns(z->min) / 1e3 : 0.0,
+		        dd_clock_ns(z->max) / 1e3);
+		if (perf)
+		{
+			dd_profile_print_perf(z, perf, fd);
+		}
+		dprintf(fd, "  %s:%d\n", z->zone->file, z->zone->line);
+		if (depth + 1 < DD_PROFILE_DEPTH)
+		{
+			dd_profile_print(m, (int)(z - m), depth + 1, perf, fd);
+		}
+	}
+	free(list);
+}
+
+
+/******************************************************************************/
+/**
+ * Merge call trees of all threads and print them into file descriptor,
+ * with inclusive and exclusive times in milliseconds and per call times
+ * in microseconds. Counters per call are included when counters have
+ * been enabled with dd_perf_enable(). Zones still running are not
+ * included.
+ */
+void dd_profile_report(int fd)
+{
+	struct dd_profile_thread *t;
+	struct dd_profile_merged *m;
+	int used = 1, max = 1, perf;
+
+	for (t = __atomic_load_n(&dd_profile_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	{
+		max += __atomic_load_n(&t->used, __ATOMIC_ACQUIRE);
+	}
+	m = malloc(max * sizeof(*m));
+	if (!m)
+	{
+		return;
+	}
+	memset(&m[0], 0, sizeof(m[0]));
+	m[0].child = -1;
+	m[0].next = -1;
+	for (t = __atomic_load_n(&dd_profile_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	{
+		dd_profile_merge(t, 0, m, 0, &used, max);
+	}
+
+	perf = dd_perf_kind();
+	dprintf(fd, "%-32s %10s %12s %12s %10s %10s %10s", "zone", "count",
+	        "incl ms", "excl ms", "avg us", "min us", "max us");
+	if (perf == DD_PERF_HW)
+	{
+		dprintf(fd, " %12s %8s %10s %10s", "cycles/call", "IPC", "cmiss/call", "bmiss/call");
+	}
+	else if (perf == DD_PERF_SW)
+	{
+		dprintf(fd, " %12s %8s %10s %10s", "task us/call", "flt/call", "cs/call", "migr/call");
+	}
+	dprintf(fd, "  %s\n", "site");
+	dd_profile_print(m, 0, 0, perf, fd);
+	free(m);
+}
+
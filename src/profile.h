@@ -0,0 +1,204 @@
+/*
+ * DDebuglib
+ *
+ * Instrumentation profiler. Named zones are timed into a call tree of
+ * each thread without locks, and trees of all threads are merged for
+ * reports. Zones cost next to nothing while profiling is disabled.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ddclock.h"
+#include "perfctr.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of call tree nodes in one thread. */
+#define DD_PROFILE_NODES 1024
+
+/** Maximum nesting depth of zones, deeper zones are not timed. */
+#define DD_PROFILE_DEPTH 64
+
+/** Zone, one for each place where zone is used. */
+struct dd_zone
+{
+	const char *name;
+	const char *file;
+	int line;
+};
+
+#define DD_ZONE_INITIALIZER(name) { name, __FILE__, __LINE__ }
+
+/** Node of call tree, written only by its own thread. */
+struct dd_profile_node
+{
+	struct dd_zone *zone;
+	/** Parent, first child and next sibling, -1 for none. */
+	int parent;
+	int child;
+	int next;
+	/** Child entered last, checked first when entering zone. */
+	int hint;
+	uint64_t count;
+	uint64_t ticks;
+	uint64_t min;
+	uint64_t max;
+	/** Counter deltas when dd_perf_enable() is on, and calls they cover. */
+	uint64_t perf_count;
+	uint64_t perf[DD_PERF_COUNTERS];
+};
+
+/** Call tree and zone stack of one thread. Node 0 is root. */
+struct dd_profile_thread
+{
+	struct dd_profile_thread *next;
+	int free;
+	int current;
+	int depth;
+	int used;
+	uint64_t start[DD_PROFILE_DEPTH];
+	/** Depths where counters were read when zone was entered. */
+	uint64_t perf_mask;
+	struct dd_perf_sample perf_start[DD_PROFILE_DEPTH];
+	struct dd_profile_node nodes[DD_PROFILE_NODES];
+};
+
+/**
+ * Begin and end zone. Name must be an identifier unique within the
+ * function, and same name must be given to both.
+ */
+#define DD_ZONE_BEGIN(name) \
+	static struct dd_zone dd_zone_##name = DD_ZONE_INITIALIZER(#name); \
+	int dd_zone_active_##name = dd_profile_begin(&dd_zone_##name)
+#define DD_ZONE_END(name) dd_profile_end(dd_zone_active_##name)
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+#ifdef __cplusplus
+extern "C" {
+#endif
+void dd_profile_enable(int);
+int dd_profile_enter(struct dd_zone *);
+void dd_profile_perf_begin(struct dd_profile_thread *);
+void dd_profile_perf_end(struct dd_profile_thread *, struct dd_profile_node *);
+void dd_profile_report(int);
+#ifdef __cplusplus
+}
+#endif
+
+/** Whether zones are timed. */
+extern int dd_profile_on;
+
+/** Call tree of this thread, NULL until first zone. */
+extern __thread struct dd_profile_thread *dd_profile_self;
+
+/**
+ * Enter zone.
+ *
+ * @return 1 if zone is timed and dd_profile_end() must be given 1
+ */
+static __inline__ int dd_profile_begin(struct dd_zone *z)
+{
+	struct dd_profile_thread *t = dd_profile_self;
+	int i;
+
+	if (__builtin_expect(!__atomic_load_n(&dd_profile_on, __ATOMIC_RELAXED), 1))
+	{
+		return 0;
+	}
+	if (__builtin_expect(!t || t->depth >= DD_PROFILE_DEPTH, 0))
+	{
+		return dd_profile_enter(z);
+	}
+	i = t->nodes[t->current].hint;
+	if (__builtin_expect(i < 0 || t->nodes[i].zone != z, 0))
+	{
+		return dd_profile_enter(z);
+	}
+	t->current = i;
+	if (__builtin_expect(dd_perf_on, 0))
+	{
+		dd_profile_perf_begin(t);
+	}
+	t->start[t->depth++] = dd_clock_ticks();
+
+	return 1;
+}
+
+/**
+ * Leave zone entered with dd_profile_begin().
+ */
+static __inline__ void dd_profile_end(int active)
+{
+	struct dd_profile_thread *t;
+	struct dd_profile_node *n;
+	uint64_t d;
+
+	if (!active)
+	{
+		return;
+	}
+	t = dd_profile_self;
+	n = &t->nodes[t->current];
+	d = dd_clock_ticks() - t->start[--t->depth];
+	/* Only this thread writes, stores are atomic for concurrent reports. */
+	__atomic_store_n(&n->count, n->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->ticks, n->ticks + d, __ATOMIC_RELAXED);
+	if (d < n->min)
+	{
+		__atomic_store_n(&n->min, d, __ATOMIC_RELAXED);
+	}
+	if (d > n->max)
+	{
+		__atomic_store_n(&n->max, d, __ATOMIC_RELAXED);
+	}
+	if (__builtin_expect(t->perf_mask != 0, 0))
+	{
+		dd_profile_perf_end(t, n);
+	}
+	t->current = n->parent;
+}
+
+/** Used by DD_ZONE(). */
+static __inline__ void dd_profile_end_scope(int *active)
+{
+	dd_profile_end(*active);
+}
+
+#ifdef __cplusplus
+/** Zone that ends when guard goes out of scope. */
+struct dd_zone_guard
+{
+	int active;
+	dd_zone_guard(struct dd_zone *z) : active(dd_profile_begin(z)) { }
+	~dd_zone_guard() { dd_profile_end(active); }
+};
+
+/** Zone from this point until end of enclosing scope. */
+#define DD_ZONE(name) \
+	static struct dd_zone dd_zone_##name = DD_ZONE_INITIALIZER(#name); \
+	dd_zone_guard dd_zone_guard_##name(&dd_zone_##name)
+#else
+/** Zone from this point until end of enclosing scope. */
+#define DD_ZONE(name) \
+	static struct dd_zone dd_zone_##name = DD_ZONE_INITIALIZER(#name); \
+	int dd_zone_active_##name __attribute__((cleanup(dd_profile_end_scope))) = \
+		dd_profile_begin(&dd_zone_##name)
+#endif
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
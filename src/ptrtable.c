@@ -0,0 +1,446 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ptrtable.h"
+#include "synchro.h"
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/*
+ * Memory for tables is taken straight from mmap() so that the table can
+ * be used from inside malloc() replacements without recursion.
+ */
+
+/******************************************************************************/
+static void *ptrtable_map(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+/******************************************************************************/
+/**
+ * Mix pointer bits. Low bits of allocations are mostly zero because of
+ * alignment, so multiply and use high bits for shard and slot.
+ */
+static __inline__ uint64_t ptrtable_hash(void *ptr)
+{
+	uint64_t h = (uint64_t)(uintptr_t)ptr;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+
+/******************************************************************************/
+static __inline__ struct ptrtable_shard *ptrtable_shard(struct ptrtable *t, uint64_t h)
+{
+	return &t->shards[h & (PTRTABLE_SHARDS - 1)];
+}
+
+
+/******************************************************************************/
+/**
+ * Find slot for pointer, either the slot holding it or the empty slot
+ * where it should be inserted. Shard must be locked and not full.
+ */
+static size_t ptrtable_probe(struct ptrtable_shard *s, void *ptr, uint64_t h)
+{
+	size_t i = (size_t)(h >> 16) & s->mask;
+
+	while (s->slots[i].ptr != NULL && s->slots[i].ptr != ptr)
+	{
+		i = (i + 1) & s->mask;
+	}
+
+	return i;
+}
+
+
+/******************************************************************************/
+/**
+ * Double shard size. Shard must be locked.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int ptrtable_grow(struct ptrtable_shard *s)
+{
+	struct ptrtable_entry *old = s->slots;
+	size_t i, n = s->slots ? (s->mask + 1) : 0;
+	size_t size = n ? n * 2 : PTRTABLE_SHARD_MIN;
+
+	s->slots = ptrtable_map(size * sizeof(*s->slots));
+	if (!s->slots)
+	{
+		s->slots = old;
+		return -1;
+	}
+	s->mask = size - 1;
+
+	for (i = 0; i < n; i++)
+	{
+		if (old[i].ptr)
+		{
+			uint64_t h = ptrtable_hash(old[i].ptr);
+			s->slots[ptrtable_probe(s, old[i].ptr, h)] = old[i];
+		}
+	}
+	if (old)
+	{
+		munmap(old, n * sizeof(*old));
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Insert pointer into table. If the pointer already exists, its entry
+ * is replaced.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int ptrtable_insert(struct ptrtable *t, const struct ptrtable_entry *e)
+{
+	uint64_t h = ptrtable_hash(e->ptr);
+	struct ptrtable_shard *s = ptrtable_shard(t, h);
+	size_t i;
+
+	dd_spin_lock(&s->lock);
+	/* Keep load factor under 3/4. */
+	if (!s->slots || (s->count + 1) * 4 > (s->mask + 1) * 3)
+	{
+		if (ptrtable_grow(s))
+		{
+			dd_spin_unlock(&s->lock);
+			return -1;
+		}
+	}
+	i = ptrtable_probe(s, e->ptr, h);
+	if (s->slots[i].ptr == NULL)
+	{
+		s->count++;
+	}
+	s->slots[i] = *e;
+	dd_spin_unlock(&s->lock);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Remove pointer from table. Uses backward shift deletion so that no
+ * tombstones are left behind and probe lengths stay short.
+ *
+ * @param out If not NULL, removed entry is copied here
+ * @return 0 on success, -1 if pointer was not found
+ */
+int ptrtable_remove(struct ptrtable *t, void *ptr, struct ptrtable_entry *out)
+{
+	uint64_t h = ptrtable_hash(ptr);
+	struct ptrtable_shard *s = ptrtable_shard(t, h);
+	size_t i, j, k;
+
+	dd_spin_lock(&s->lock);
+	if (!s->slots)
+	{
+		dd_spin_unlock(&s->lock);
+		return -1;
+	}
+	i = ptrtable_probe(s, ptr, h);
+	if (s->slots[i].ptr == NULL)
+	{
+		dd_spin_unlock(&s->lock);
+		return -1;
+	}
+	if (out)
+	{
+		*out = s->slots[i];
+	}
+
+	for (j = (i + 1) & s->mask; s->slots[j].ptr; j = (j + 1) & s->mask)
+	{
+		/* Move entry back if its home slot is not between hole and it. */
+		k = (size_t)(ptrtable_hash(s->slots[j].ptr) >> 16) & s->mask;
+		if (((j - k) & s->mask) >= ((j - i) & s->mask))
+		{
+			s->slots[i] = s->slots[j];
+			i = j;
+		}
+	}
+	memset(&s->slots[i], 0, sizeof(s->slots[i]));
+	s->count--;
+	dd_spin_unlock(&s->lock);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Find pointer from table.
+ *
+ * @param out If not NULL, entry is copied here
+ * @return 0 if found, -1 if not
+ */
+int ptrtable_find(struct ptrtable *t, void *ptr, struct ptrtable_entry *out)
+{
+	uint64_t h = ptrtable_hash(ptr);
+	struct ptrtable_shard *s = ptrtable_shard(t, h);
+	size_t i;
+	int err = -1;
+
+	dd_spin_lock(&s->lock);
+	if (s->slots)
+	{
+		i = ptrtable_probe(s, ptr, h);
+		if (s->slots[i].ptr)
+		{
+			if (out) *out = s->slots[i];
+			err = 0;
+		}
+	}
+	dd_spin_unlock(&s->lock);
+
+	return err;
+}
+
+
+/******************************************************************************/
+/**
+ * Count pointers in table. Not exact if table is modified at the same time.
+ */
+size_t ptrtable_count(struct ptrtable *t)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < PTRTABLE_SHARDS; i++)
+	{
+		n += __atomic_load_n(&t->shards[i].count, __ATOMIC_RELAXED);
+	}
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Remove all pointers from table and release memory used by it.
+ */
+void ptrtable_clear(struct ptrtable *t)
+{
+	size_t i;
+
+	for (i = 0; i < PTRTABLE_SHARDS; i++)
+	{
+		struct ptrtable_shard *s = &t->shards[i];
+		dd_spin_lock(&s->lock);
+		if (s->slots)
+		{
+			munmap(s->slots, (s->mask + 1) * sizeof(*s->slots));
+		}
+		s->slots = NULL;
+		s->mask = 0;
+		s->count = 0;
+		dd_spin_unlock(&s->lock);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Lock all shards, for example before fork() so that child does not
+ * inherit a shard locked by some other thread.
+ */
+void ptrtable_lock_all(struct ptrtable *t)
+{
+	size_t i;
+
+	for (i = 0; i < PTRTABLE_SHARDS; i++)
+	{
+		dd_spin_lock(&t->shards[i].lock);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Unlock shards locked with ptrtable_lock_all().
+ */
+void ptrtable_unlock_all(struct ptrtable *t)
+{
+	size_t i;
+
+	for (i = 0; i < PTRTABLE_SHARDS; i++)
+	{
+		dd_spin_unlock(&t->shards[i].lock);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Take snapshot of table. Shards are copied one at a time, so only one
+ * shard is locked at once and only for the time it takes to copy it.
+ *
+ * @return snapshot to be walked with ptrtable_iter_next() and released
+ *         with ptrtable_iter_free(), NULL if out of memory
+ */
+struct ptrtable_iter *ptrtable_snapshot(struct ptrtable *t)
+{
+	struct ptrtable_iter *it = NULL;
+	size_t i, j, max, size;
+
+	max = ptrtable_count(t) + PTRTABLE_SHARD_MIN;
+
+	while (1)
+	{
+		size = sizeof(*it) + max * sizeof(*it->entries);
+		it = ptrtable_map(size);
+		if (!it)
+		{
+			return NULL;
+		}
+		it->entries = (struct ptrtable_entry *)(it + 1);
+		it->size = size;
+		it->count = 0;
+		it->pos = 0;
+
+		for (i = 0; i < PTRTABLE_SHARDS; i++)
+		{
+			struct ptrtable_shard *s = &t->shards[i];
+			dd_spin_lock(&s->lock);
+			if (s->count > max - it->count)
+			{
+				dd_spin_unlock(&s->lock);
+				break;
+			}
+			for (j = 0; s->slots && j <= s->mask; j++)
+			{
+				if (s->slots[j].ptr)
+				{
+					it->entries[it->count++] = s->slots[j];
+				}
+			}
+			dd_spin_unlock(&s->lock);
+		}
+		if (i >= PTRTABLE_SHARDS)
+		{
+			break;
+		}
+
+		/* Table grew while copying, try again with more room. */
+		munmap(it, size);
+		max = max * 2;
+	}
+
+	return it;
+}
+
+
+/******************************************************************************/
+/**
+ * Get next entry from snapshot.
+ *
+ * @return entry or NULL when all entries have been walked
+ */
+const struct ptrtable_entry *ptrtable_iter_next(struct ptrtable_iter *it)
+{
+	if (!it || it->pos >= it->count)
+	{
+		return NULL;
+	}
+	return &it->entries[it->pos++];
+}
+
+
+/******************************************************************************/
+/**
+ * Release snapshot.
+ */
+void ptrtable_iter_free(struct ptrtable_iter *it)
+{
+	if (it)
+	{
+		munmap(it, it->size);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Call function for every pointer in table. Shards are visited one at a
+ * time: contents of shard are copied while it is locked and function is
+ * called after lock has been released, so it may use the table and other
+ * shards are never blocked.
+ *
+ * @param fn function to call
+ * @param arg passed to function
+ * @return 0 on success, -1 if out of memory
+ */
+int ptrtable_foreach(struct ptrtable *t, void (*fn)(const struct ptrtable_entry *, void *), void *arg)
+{
+	struct ptrtable_entry *buf = NULL;
+	size_t i, j, n, size = 0;
+
+	for (i = 0; i < PTRTABLE_SHARDS; i++)
+	{
+		struct ptrtable_shard *s = &t->shards[i];
+
+		dd_spin_lock(&s->lock);
+		while (s->count * sizeof(*buf) > size)
+		{
+			/* Grow copy buffer without holding lock. */
+			n = s->count * 2 * sizeof(*buf);
+			dd_spin_unlock(&s->lock);
+			if (buf)
+			{
+				munmap(buf, size);
+			}
+			buf = ptrtable_map(n);
+			if (!buf)
+			{
+				return -1;
+			}
+			size = n;
+			dd_spin_lock(&s->lock);
+		}
+		for (j = 0, n = 0; s->slots && j <= s->mask; j++)
+		{
+			if (s->slots[j].ptr)
+			{
+				buf[n++] = s->slots[j];
+			}
+		}
+		dd_spin_unlock(&s->lock);
+
+		for (j = 0; j < n; j++)
+		{
+			fn(&buf[j], arg);
+		}
+	}
+
+	if (buf)
+	{
+		munmap(buf, size);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,91 @@
+/*
+ * DDebuglib
+ *
+ * Concurrent hash table of live pointers, used for tracking allocations.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef PTRTABLE_H
+#define PTRTABLE_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Number of independently locked shards in one table, power of two. */
+#define PTRTABLE_SHARDS 64
+
+/** Initial number of slots in one shard when first used, power of two. */
+#define PTRTABLE_SHARD_MIN 64
+
+/**
+ * One live pointer and information about where it came from. When file is
+ * NULL, line may hold any other integer such as a return address.
+ */
+struct ptrtable_entry
+{
+	void *ptr;
+	size_t size;
+	const char *name;
+	const char *file;
+	uintptr_t line;
+	uint32_t stack;
+	/** Id of allocating thread, see dd_thread_id(). */
+	uint32_t thread;
+	uint64_t time;
+};
+
+/** Shard of table: open addressing with linear probing. */
+struct ptrtable_shard
+{
+	int lock;
+	size_t count;
+	size_t mask;
+	struct ptrtable_entry *slots;
+} __attribute__((aligned(64)));
+
+/**
+ * Pointer table. All zero is a valid empty table, so static tables
+ * need no initialization.
+ */
+struct ptrtable
+{
+	struct ptrtable_shard shards[PTRTABLE_SHARDS];
+};
+
+/** Snapshot of table contents. */
+struct ptrtable_iter
+{
+	size_t size;
+	size_t count;
+	size_t pos;
+	struct ptrtable_entry *entries;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int ptrtable_insert(struct ptrtable *, const struct ptrtable_entry *);
+int ptrtable_remove(struct ptrtable *, void *, struct ptrtable_entry *);
+int ptrtable_find(struct ptrtable *, void *, struct ptrtable_entry *);
+size_t ptrtable_count(struct ptrtable *);
+void ptrtable_clear(struct ptrtable *);
+void ptrtable_lock_all(struct ptrtable *);
+void ptrtable_unlock_all(struct ptrtable *);
+
+struct ptrtable_iter *ptrtable_snapshot(struct ptrtable *);
+const struct ptrtable_entry *ptrtable_iter_next(struct ptrtable_iter *);
+void ptrtable_iter_free(struct ptrtable_iter *);
+int ptrtable_foreach(struct ptrtable *, void (*)(const struct ptrtable_entry *, void *), void *);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
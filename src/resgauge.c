@@ -0,0 +1,242 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "resgauge.h"
+#include "ddslots.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Key of resource in table. */
+struct resgauge_key
+{
+	const char *name;
+	unsigned int hash;
+};
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static __inline__ unsigned int resgauge_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; name[i] && i < RESGAUGE_NAME - 1; i++)
+	{
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+
+/******************************************************************************/
+static int resgauge_match(const void *entry, const void *key)
+{
+	const struct resgauge_entry *e = entry;
+	const struct resgauge_key *k = key;
+
+	return e->hash == k->hash && strncmp(e->name, k->name, RESGAUGE_NAME - 1) == 0;
+}
+
+
+/******************************************************************************/
+static void *resgauge_create(const void *key)
+{
+	const struct resgauge_key *k = key;
+	struct resgauge_entry *e;
+
+	e = mmap(NULL, sizeof(*e), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (e == MAP_FAILED)
+	{
+		return NULL;
+	}
+	strncpy(e->name, k->name, RESGAUGE_NAME - 1);
+	e->hash = k->hash;
+
+	return e;
+}
+
+
+/******************************************************************************/
+static void resgauge_destroy(void *entry)
+{
+	munmap(entry, sizeof(struct resgauge_entry));
+}
+
+
+/******************************************************************************/
+static const struct dd_slots_ops resgauge_ops = {
+	resgauge_match, resgauge_create, resgauge_destroy
+};
+
+
+/******************************************************************************/
+/**
+ * Find resource from table, insert new if not found. Insertion is
+ * lock-free, see dd_slots_get().
+ *
+ * @return entry or NULL if table is full or out of memory
+ */
+struct resgauge_entry *resgauge_get(struct resgauge *t, const char *name)
+{
+	struct resgauge_key key = { name, resgauge_hash(name) };
+	int full;
+
+	return dd_slots_get((void **)t->entries, RESGAUGE_SLOTS, RESGAUGE_SLOTS,
+	                    key.hash, &key, &resgauge_ops, &t->count, &full);
+}
+
+
+/******************************************************************************/
+/**
+ * Find resource from table.
+ *
+ * @return entry or NULL if not found
+ */
+struct resgauge_entry *resgauge_find(struct resgauge *t, const char *name)
+{
+	struct resgauge_key key = { name, resgauge_hash(name) };
+	int full;
+
+	return dd_slots_find((void **)t->entries, RESGAUGE_SLOTS, RESGAUGE_SLOTS,
+	                     key.hash, &key, &resgauge_ops, &full);
+}
+
+
+/******************************************************************************/
+/**
+ * Count allocation of resource and update its high-water mark.
+ */
+void resgauge_alloc(struct resgauge *t, const char *name)
+{
+	struct resgauge_entry *e = resgauge_get(t, name);
+	int64_t live, peak;
+
+	if (!e)
+	{
+		return;
+	}
+	__atomic_add_fetch(&e->allocs, 1, __ATOMIC_RELAXED);
+	live = __atomic_add_fetch(&e->live, 1, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&e->peak, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&e->peak, &peak, live, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/******************************************************************************/
+/**
+ * Count free of resource.
+ */
+void resgauge_free(struct resgauge *t, const char *name)
+{
+	struct resgauge_entry *e = resgauge_get(t, name);
+
+	if (!e)
+	{
+		return;
+	}
+	__atomic_add_fetch(&e->frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&e->live, 1, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+static void resgauge_copy(struct resgauge_entry *e, struct resgauge_info *info)
+{
+	memcpy(info->name, e->name, RESGAUGE_NAME);
+	info->live = __atomic_load_n(&e->live, __ATOMIC_RELAXED);
+	info->peak = __atomic_load_n(&e->peak, __ATOMIC_RELAXED);
+	info->allocs = __atomic_load_n(&e->allocs, __ATOMIC_RELAXED);
+	info->frees = __atomic_load_n(&e->frees, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************/
+/**
+ * Get state of one resource.
+ *
+ * @return 0 on success, -1 if resource has never been allocated
+ */
+int resgauge_info(struct resgauge *t, const char *name, struct resgauge_info *info)
+{
+	struct resgauge_entry *e = resgauge_find(t, name);
+
+	if (!e)
+	{
+		return -1;
+	}
+	resgauge_copy(e, info);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Get state of all resources.
+ *
+ * @param list where to store states
+ * @param max size of list
+ * @return number of resources stored
+ */
+size_t resgauge_list(struct resgauge *t, struct resgauge_info *list, size_t max)
+{
+	struct resgauge_entry *e;
+	size_t i, n = 0;
+
+	for (i = 0; i < RESGAUGE_SLOTS && n < max; i++)
+	{
+		e = __atomic_load_n(&t->entries[i], __ATOMIC_ACQUIRE);
+		if (e)
+		{
+			resgauge_copy(e, &list[n++]);
+		}
+	}
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Print all resources into file descriptor.
+ */
+void resgauge_report(struct resgauge *t, int fd)
+{
+	struct resgauge_info info;
+	struct resgauge_entry *e;
+	size_t i;
+
+	dprintf(fd, "%-24s %10s %10s %12s %12s\n", "resource", "live", "peak", "allocs", "frees");
+	for (i = 0; i < RESGAUGE_SLOTS; i++)
+	{
+		e = __atomic_load_n(&t->entries[i], __ATOMIC_ACQUIRE);
+		if (!e)
+		{
+			continue;
+		}
+		resgauge_copy(e, &info);
+		dprintf(fd, "%-24s %10lld %10lld %12llu %12llu\n", info.name,
+		        (long long)info.live, (long long)info.peak,
+		        (unsigned long long)info.allocs, (unsigned long long)info.frees);
+	}
+}
+
@@ -0,0 +1,70 @@
+/*
+ * DDebuglib
+ *
+ * Live counts and high-water marks of named resources.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef RESGAUGE_H
+#define RESGAUGE_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of resource names in one table, power of two. */
+#define RESGAUGE_SLOTS 256
+
+/** Maximum length of resource name, longer names are truncated. */
+#define RESGAUGE_NAME 32
+
+/** Counters of one resource name. */
+struct resgauge_entry
+{
+	char name[RESGAUGE_NAME];
+	unsigned int hash;
+	int64_t live;
+	int64_t peak;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+/** Current state of one resource name. */
+struct resgauge_info
+{
+	char name[RESGAUGE_NAME];
+	int64_t live;
+	int64_t peak;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+/** Resource table. All zero is a valid empty table. Names are never removed. */
+struct resgauge
+{
+	struct resgauge_entry *entries[RESGAUGE_SLOTS];
+	unsigned int count;
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+struct resgauge_entry *resgauge_get(struct resgauge *, const char *);
+struct resgauge_entry *resgauge_find(struct resgauge *, const char *);
+void resgauge_alloc(struct resgauge *, const char *);
+void resgauge_free(struct resgauge *, const char *);
+int resgauge_info(struct resgauge *, const char *, struct resgauge_info *);
+size_t resgauge_list(struct resgauge *, struct resgauge_info *, size_t);
+void resgauge_report(struct resgauge *, int);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
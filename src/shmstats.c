@@ -0,0 +1,305 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "shmstats.h"
+#include "metrics.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+static struct dd_shm *dd_shm_page = NULL;
+static char dd_shm_name[256];
+
+/** Serializes updates, there is only one writer at a time. */
+static pthread_mutex_t dd_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Values are collected here before copying into shared memory. */
+static struct dd_shm_entry dd_shm_entries[DD_SHM_ENTRIES];
+
+/** Background updater. */
+static pthread_t dd_shm_updater;
+static pthread_mutex_t dd_shm_updater_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dd_shm_updater_cond;
+static int dd_shm_updater_run = 0;
+static unsigned int dd_shm_interval = 0;
+
+/** Fork handler is registered only once. */
+static pthread_once_t dd_shm_atfork_once = PTHREAD_ONCE_INIT;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static uint64_t dd_shm_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/******************************************************************************/
+/**
+ * Copy current values of all metrics into shared memory. Called by the
+ * background updater, or by the application when it was started without
+ * one. Values are collected first and then copied while sequence is odd,
+ * so readers have to retry only during the copy.
+ */
+void dd_shm_update(void)
+{
+	struct dd_shm *shm;
+	struct dd_shm_entry *e;
+	struct dd_histogram_stats stats;
+	struct dd_metric *m;
+	int i, n;
+
+	pthread_mutex_lock(&dd_shm_lock);
+	shm = dd_shm_page;
+	if (!shm)
+	{
+		pthread_mutex_unlock(&dd_shm_lock);
+		return;
+	}
+
+	n = dd_metrics_count();
+	n = n < DD_SHM_ENTRIES ? n : DD_SHM_ENTRIES;
+	for (i = 0; i < n; i++)
+	{
+		m = &dd_metrics[i];
+		e = &dd_shm_entries[i];
+		if (!e->name[0])
+		{
+			e->type = m->type;
+			snprintf(e->name, sizeof(e->name), "%s", m->name);
+			snprintf(e->labels, sizeof(e->labels), "%s", m->labels);
+		}
+		if (m->type == DD_METRIC_HISTOGRAM)
+		{
+			dd_histogram_stats(m->h, &stats);
+			e->value = (int64_t)stats.count;
+			e->sum = (uint64_t)(stats.mean * (double)stats.count + 0.5);
+			e->p50 = stats.p50;
+			e->p90 = stats.p90;
+			e->p99 = stats.p99;
+			e->max = stats.max;
+		}
+		else
+		{
+			e->value = dd_metric_value(i);
+		}
+	}
+
+	__atomic_store_n(&shm->header.seq, shm->header.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shm->entries, dd_shm_entries, n * sizeof(*e));
+	shm->header.count = n;
+	shm->header.time = dd_shm_clock();
+	shm->header.updates++;
+	__atomic_store_n(&shm->header.seq, shm->header.seq + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&dd_shm_lock);
+}
+
+
+/******************************************************************************/
+static void *dd_shm_updater_thread(void *arg)
+{
+	struct timespec ts;
+	unsigned int interval = dd_shm_interval;
+	(void)arg;
+
+	pthread_mutex_lock(&dd_shm_updater_lock);
+	while (dd_shm_updater_run)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (long)(interval % 1000) * 1000000l;
+		if (ts.tv_nsec >= 1000000000l)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000l;
+		}
+		if (pthread_cond_timedwait(&dd_shm_updater_cond, &dd_shm_updater_lock, &ts) == 0)
+		{
+			continue;
+		}
+		pthread_mutex_unlock(&dd_shm_updater_lock);
+		dd_shm_update();
+		pthread_mutex_lock(&dd_shm_updater_lock);
+	}
+	pthread_mutex_unlock(&dd_shm_updater_lock);
+
+	return NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Child of fork() does not publish. Shared memory belongs to the parent
+ * and the updater thread does not exist in the child, so both are
+ * forgotten without touching them. Locks may have been held by the
+ * updater when the process was copied.
+ */
+static void dd_shm_atfork_child(void)
+{
+	pthread_mutex_t init = PTHREAD_MUTEX_INITIALIZER;
+
+	if (dd_shm_page)
+	{
+		munmap(dd_shm_page, sizeof(*dd_shm_page));
+		dd_shm_page = NULL;
+	}
+	dd_shm_updater_run = 0;
+	dd_shm_lock = init;
+	dd_shm_updater_lock = init;
+}
+
+
+/******************************************************************************/
+static void dd_shm_atfork_register(void)
+{
+	pthread_atfork(NULL, NULL, dd_shm_atfork_child);
+}
+
+
+/******************************************************************************/
+/**
+ * Create shared memory and start publishing metrics into it. Memory is
+ * readable only by the same user.
+ *
+ * @param name name of shared memory, NULL for "/ddebug.<pid>" that ddtop
+ *             finds by pid
+ * @param interval milliseconds between updates, 0 to update only when
+ *                 dd_shm_update() is called
+ * @return 0 on success, -1 on errors
+ */
+int dd_shm_start(const char *name, unsigned int interval)
+{
+	struct dd_shm *shm;
+	pthread_condattr_t attr;
+	int fd;
+
+	pthread_once(&dd_shm_atfork_once, dd_shm_atfork_register);
+	pthread_mutex_lock(&dd_shm_lock);
+	if (dd_shm_page)
+	{
+		pthread_mutex_unlock(&dd_shm_lock);
+		return -1;
+	}
+	if (name)
+	{
+		snprintf(dd_shm_name, sizeof(dd_shm_name), "%s", name);
+	}
+	else
+	{
+		snprintf(dd_shm_name, sizeof(dd_shm_name), DD_SHM_PATH, (int)getpid());
+	}
+	fd = shm_open(dd_shm_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		pthread_mutex_unlock(&dd_shm_lock);
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*shm)))
+	{
+		close(fd);
+		shm_unlink(dd_shm_name);
+		pthread_mutex_unlock(&dd_shm_lock);
+		return -1;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		shm_unlink(dd_shm_name);
+		pthread_mutex_unlock(&dd_shm_lock);
+		return -1;
+	}
+
+	memset(dd_shm_entries, 0, sizeof(dd_shm_entries));
+	shm->header.version = DD_SHM_VERSION;
+	shm->header.header_size = sizeof(shm->header);
+	shm->header.entry_size = sizeof(struct dd_shm_entry);
+	shm->header.entries_max = DD_SHM_ENTRIES;
+	shm->header.pid = (int32_t)getpid();
+	shm->header.interval = interval;
+	/* Magic last, readers do not look further until it is there. */
+	__atomic_store_n(&shm->header.magic, DD_SHM_MAGIC, __ATOMIC_RELEASE);
+	dd_shm_page = shm;
+	pthread_mutex_unlock(&dd_shm_lock);
+
+	dd_shm_update();
+
+	if (interval > 0)
+	{
+		pthread_mutex_lock(&dd_shm_updater_lock);
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&dd_shm_updater_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		dd_shm_interval = interval;
+		dd_shm_updater_run = 1;
+		if (pthread_create(&dd_shm_updater, NULL, dd_shm_updater_thread, NULL))
+		{
+			dd_shm_updater_run = 0;
+			pthread_cond_destroy(&dd_shm_updater_cond);
+			pthread_mutex_unlock(&dd_shm_updater_lock);
+			dd_shm_stop();
+			return -1;
+		}
+		pthread_mutex_unlock(&dd_shm_updater_lock);
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop publishing and remove shared memory. Readers that have it mapped
+ * keep their last values.
+ */
+void dd_shm_stop(void)
+{
+	pthread_mutex_lock(&dd_shm_updater_lock);
+	if (dd_shm_updater_run)
+	{
+		dd_shm_updater_run = 0;
+		pthread_cond_signal(&dd_shm_updater_cond);
+		pthread_mutex_unlock(&dd_shm_updater_lock);
+		pthread_join(dd_shm_updater, NULL);
+		pthread_cond_destroy(&dd_shm_updater_cond);
+	}
+	else
+	{
+		pthread_mutex_unlock(&dd_shm_updater_lock);
+	}
+
+	pthread_mutex_lock(&dd_shm_lock);
+	if (dd_shm_page)
+	{
+		munmap(dd_shm_page, sizeof(*dd_shm_page));
+		shm_unlink(dd_shm_name);
+		dd_shm_page = NULL;
+	}
+	pthread_mutex_unlock(&dd_shm_lock);
+}
+
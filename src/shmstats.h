@@ -0,0 +1,141 @@
+/*
+ * DDebuglib
+ *
+ * Metrics published into shared memory, so that external tools such as
+ * ddtop can read them without asking anything from the process. Values
+ * are copied from the metrics registry periodically by a background
+ * thread and protected with a sequence lock, so readers never block the
+ * process and see consistent snapshots.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** First bytes of shared memory, "DDSTATS" and zero. */
+#define DD_SHM_MAGIC 0x0053544154534444ull
+
+/** Layout version, changed when layout changes incompatibly. */
+#define DD_SHM_VERSION 1
+
+/** Number of entries, same as maximum number of metrics. */
+#define DD_SHM_ENTRIES 256
+
+/** Default milliseconds between updates. */
+#define DD_SHM_INTERVAL 250
+
+/** Sizes of names in entries, longer names are truncated. */
+#define DD_SHM_NAME 64
+#define DD_SHM_LABELS 96
+
+/** Name of shared memory of process under /dev/shm. */
+#define DD_SHM_PATH "/ddebug.%d"
+
+/** Entry types, same as metric types. */
+enum {
+	DD_SHM_COUNTER = 0,
+	DD_SHM_GAUGE,
+	DD_SHM_HISTOGRAM,
+};
+
+/** One metric. Entries are only appended, so index of metric never changes. */
+struct dd_shm_entry
+{
+	uint32_t type;
+	uint32_t reserved;
+	char name[DD_SHM_NAME];
+	char labels[DD_SHM_LABELS];
+	/** Value of counter or gauge, number of values of histogram. */
+	int64_t value;
+	/** Summary of histogram. */
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+};
+
+/**
+ * Header at start of shared memory. Readers must check magic, version and
+ * sizes before using anything else.
+ */
+struct dd_shm_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t entries_max;
+	int32_t pid;
+	uint32_t interval;
+	/** Odd while writer is updating, see dd_shm_read(). */
+	uint32_t seq;
+	/** Number of entries in use. */
+	uint32_t count;
+	/** CLOCK_MONOTONIC nanoseconds of last update. */
+	uint64_t time;
+	/** Number of updates done. */
+	uint64_t updates;
+	uint64_t reserved[4];
+};
+
+/** Whole shared memory. */
+struct dd_shm
+{
+	struct dd_shm_header header;
+	struct dd_shm_entry entries[DD_SHM_ENTRIES];
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_shm_start(const char *, unsigned int);
+void dd_shm_stop(void);
+void dd_shm_update(void);
+
+/**
+ * Copy consistent snapshot from shared memory, used by readers.
+ *
+ * @param shm mapped shared memory
+ * @param copy where to copy
+ * @param tries how many times to try when writer is updating
+ * @return 0 on success, -1 if no consistent copy was got
+ */
+static __inline__ int dd_shm_read(const struct dd_shm *shm, struct dd_shm *copy, int tries)
+{
+	uint32_t seq;
+
+	while (tries-- > 0)
+	{
+		seq = __atomic_load_n(&shm->header.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+		{
+			continue;
+		}
+		memcpy(copy, shm, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->header.seq, __ATOMIC_RELAXED) == seq)
+		{
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,458 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sitestats.h"
+#include "ddshard.h"
+#include "ddslots.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Key of site in table. */
+struct sitestats_key
+{
+	const char *file;
+	uintptr_t line;
+};
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+const char sitestats_other_file[] = "(other sites)";
+
+/** Mask of shards in use by threads, given back at thread exit. */
+static uint64_t sitestats_used = 0;
+static pthread_once_t sitestats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sitestats_key;
+
+/** Shard used by this thread, -1 until first used. */
+static __thread int sitestats_shard_n = -1;
+
+/** Whether this thread is the only one using its shard. */
+static __thread int sitestats_shard_own = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void sitestats_thread_exit(void *arg)
+{
+	(void)arg;
+	dd_shard_release(&sitestats_used, sitestats_shard_n, sitestats_shard_own);
+	/* Frees from destructors that run after this one still count. */
+	sitestats_shard_n = SITESTATS_SHARDS - 1;
+	sitestats_shard_own = 0;
+}
+
+
+/******************************************************************************/
+static void sitestats_atfork_child(void)
+{
+	dd_shard_reset(&sitestats_used, sitestats_shard_n, sitestats_shard_own);
+}
+
+
+/******************************************************************************/
+static void sitestats_setup(void)
+{
+	pthread_key_create(&sitestats_key, sitestats_thread_exit);
+	pthread_atfork(NULL, NULL, sitestats_atfork_child);
+}
+
+
+/******************************************************************************/
+static void sitestats_shard_new(void)
+{
+	pthread_once(&sitestats_once, sitestats_setup);
+	/* Set shard first, setting key may allocate and come back here. */
+	sitestats_shard_n = dd_shard_pick(&sitestats_used, SITESTATS_SHARDS, &sitestats_shard_own);
+	if (sitestats_shard_own)
+	{
+		pthread_setspecific(sitestats_key, &sitestats_used);
+	}
+}
+
+
+/******************************************************************************/
+static __inline__ struct sitestats_shard *sitestats_shard(struct sitestats_site *site)
+{
+	if (__builtin_expect(sitestats_shard_n < 0, 0))
+	{
+		sitestats_shard_new();
+	}
+	return &site->shards[sitestats_shard_n];
+}
+
+
+/******************************************************************************/
+static __inline__ int64_t sitestats_add(void *counter, int64_t v)
+{
+	return (int64_t)dd_shard_add(sitestats_shard_own, counter, (uint64_t)v);
+}
+
+
+/******************************************************************************/
+static __inline__ unsigned int sitestats_hash(const char *file, uintptr_t line)
+{
+	uint64_t h = (uint64_t)(uintptr_t)file * 0x9e3779b97f4a7c15ull;
+	h ^= (uint64_t)line * 0xff51afd7ed558ccdull;
+	h ^= h >> 29;
+	return (unsigned int)h;
+}
+
+
+/******************************************************************************/
+static struct sitestats_site *sitestats_new(const char *file, uintptr_t line)
+{
+	struct sitestats_site *site;
+
+	site = mmap(NULL, sizeof(*site), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (site == MAP_FAILED)
+	{
+		return NULL;
+	}
+	site->file = file;
+	site->line = line;
+
+	return site;
+}
+
+
+/******************************************************************************/
+static int sitestats_match(const void *entry, const void *key)
+{
+	const struct sitestats_site *site = entry;
+	const struct sitestats_key *k = key;
+
+	return site->file == k->file && site->line == k->line;
+}
+
+
+/******************************************************************************/
+static void *sitestats_create(const void *key)
+{
+	const struct sitestats_key *k = key;
+
+	return sitestats_new(k->file, k->line);
+}
+
+
+/******************************************************************************/
+static void sitestats_destroy(void *entry)
+{
+	munmap(entry, sizeof(struct sitestats_site));
+}
+
+
+/******************************************************************************/
+static const struct dd_slots_ops sitestats_ops = {
+	sitestats_match, sitestats_create, sitestats_destroy
+};
+
+
+/******************************************************************************/
+/**
+ * Get site where sites that do not fit into table are counted.
+ *
+ * @return site or NULL if out of memory
+ */
+static struct sitestats_site *sitestats_other(struct sitestats *t)
+{
+	struct sitestats_site *site = __atomic_load_n(&t->other, __ATOMIC_ACQUIRE), *fresh;
+
+	if (site)
+	{
+		return site;
+	}
+	fresh = sitestats_new(sitestats_other_file, 0);
+	if (!fresh)
+	{
+		return NULL;
+	}
+	if (!__atomic_compare_exchange_n(&t->other, &site, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(fresh, sizeof(*fresh));
+		return site;
+	}
+
+	return fresh;
+}
+
+
+/******************************************************************************/
+/**
+ * Find site from table, insert new if not found. Insertion is lock-free,
+ * see dd_slots_get(). Only SITESTATS_PROBE slots are looked at, site that
+ * does not fit there is counted into other site.
+ *
+ * @return site or NULL if out of memory
+ */
+struct sitestats_site *sitestats_get(struct sitestats *t, const char *file, uintptr_t line)
+{
+	struct sitestats_key key = { file, line };
+	struct sitestats_site *site;
+	int full;
+
+	site = dd_slots_get((void **)t->sites, SITESTATS_SLOTS, SITESTATS_PROBE,
+	                    sitestats_hash(file, line), &key, &sitestats_ops, &t->count, &full);
+
+	return full ? sitestats_other(t) : site;
+}
+
+
+/******************************************************************************/
+/**
+ * Find site from table. Slots are never emptied, so site that did not
+ * fit when it was inserted is still in other site.
+ *
+ * @return site or NULL if not found
+ */
+struct sitestats_site *sitestats_find(struct sitestats *t, const char *file, uintptr_t line)
+{
+	struct sitestats_key key = { file, line };
+	struct sitestats_site *site;
+	int full;
+
+	site = dd_slots_find((void **)t->sites, SITESTATS_SLOTS, SITESTATS_PROBE,
+	                     sitestats_hash(file, line), &key, &sitestats_ops, &full);
+
+	return full ? __atomic_load_n(&t->other, __ATOMIC_ACQUIRE) : site;
+}
+
+
+/******************************************************************************/
+/**
+ * Move live byte delta of shard into site total and update peak.
+ */
+static void sitestats_flush(struct sitestats_site *site, struct sitestats_shard *s)
+{
+	int64_t d, live, peak;
+
+	d = __atomic_exchange_n(&s->live_delta, 0, __ATOMIC_RELAXED);
+	live = __atomic_add_fetch(&site->live, d, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&site->peak, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&site->peak, &peak, live, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/******************************************************************************/
+static __inline__ int sitestats_bucket(size_t size)
+{
+	int b = size ? 64 - __builtin_clzll((unsigned long long)size) : 0;
+	return (b < SITESTATS_BUCKETS) ? b : SITESTATS_BUCKETS - 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Account allocation to site. Only counters of the shard of calling
+ * thread are written.
+ */
+void sitestats_alloc(struct sitestats *t, const char *file, uintptr_t line, size_t size)
+{
+	struct sitestats_site *site = sitestats_get(t, file, line);
+	struct sitestats_shard *s;
+
+	if (!site)
+	{
+		return;
+	}
+	s = sitestats_shard(site);
+
+	sitestats_add(&s->allocs, 1);
+	sitestats_add(&s->bytes, (int64_t)size);
+	sitestats_add(&s->hist[sitestats_bucket(size)], 1);
+	if (sitestats_add(&s->live_delta, (int64_t)size) >= SITESTATS_BATCH)
+	{
+		sitestats_flush(site, s);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Account free to site where the memory was allocated.
+ */
+void sitestats_free(struct sitestats *t, const char *file, uintptr_t line, size_t size)
+{
+	struct sitestats_site *site = sitestats_find(t, file, line);
+	struct sitestats_shard *s;
+
+	if (!site)
+	{
+		return;
+	}
+	s = sitestats_shard(site);
+
+	sitestats_add(&s->frees, 1);
+	if (sitestats_add(&s->live_delta, -(int64_t)size) <= -SITESTATS_BATCH)
+	{
+		sitestats_flush(site, s);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Merge shards of site into one set of statistics.
+ */
+void sitestats_merge(struct sitestats_site *site, struct sitestats_info *info)
+{
+	int i, j;
+
+	memset(info, 0, sizeof(*info));
+	info->file = site->file;
+	info->line = site->line;
+	info->live_bytes = __atomic_load_n(&site->live, __ATOMIC_RELAXED);
+	for (i = 0; i < SITESTATS_SHARDS; i++)
+	{
+		struct sitestats_shard *s = &site->shards[i];
+		info->live_bytes += __atomic_load_n(&s->live_delta, __ATOMIC_RELAXED);
+		info->allocs += __atomic_load_n(&s->allocs, __ATOMIC_RELAXED);
+		info->frees += __atomic_load_n(&s->frees, __ATOMIC_RELAXED);
+		info->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+		for (j = 0; j < SITESTATS_BUCKETS; j++)
+		{
+			info->hist[j] += __atomic_load_n(&s->hist[j], __ATOMIC_RELAXED);
+		}
+	}
+	info->live_count = (int64_t)(info->allocs - info->frees);
+	info->peak_bytes = __atomic_load_n(&site->peak, __ATOMIC_RELAXED);
+	if (info->live_bytes > info->peak_bytes)
+	{
+		info->peak_bytes = info->live_bytes;
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Get merged statistics of all sites.
+ *
+ * @param list where to store statistics
+ * @param max size of list
+ * @return number of sites stored
+ */
+size_t sitestats_list(struct sitestats *t, struct sitestats_info *list, size_t max)
+{
+	struct sitestats_site *site;
+	size_t i, n = 0;
+
+	for (i = 0; i < SITESTATS_SLOTS && n < max; i++)
+	{
+		site = __atomic_load_n(&t->sites[i], __ATOMIC_ACQUIRE);
+		if (site)
+		{
+			sitestats_merge(site, &list[n++]);
+		}
+	}
+	site = __atomic_load_n(&t->other, __ATOMIC_ACQUIRE);
+	if (site && n < max)
+	{
+		sitestats_merge(site, &list[n++]);
+	}
+
+	return n;
+}
+
+
+/******************************************************************************/
+static int sitestats_cmp_live(const void *a, const void *b)
+{
+	const struct sitestats_info *ia = a, *ib = b;
+	return (ib->live_bytes > ia->live_bytes) - (ib->live_bytes < ia->live_bytes);
+}
+
+
+/******************************************************************************/
+static int sitestats_cmp_churn(const void *a, const void *b)
+{
+	const struct sitestats_info *ia = a, *ib = b;
+	return (ib->bytes > ia->bytes) - (ib->bytes < ia->bytes);
+}
+
+
+/******************************************************************************/
+/**
+ * Print top sites into file descriptor.
+ *
+ * @param fd where to print
+ * @param n number of sites to print, 0 for all
+ * @param order SITESTATS_ORDER_LIVE or SITESTATS_ORDER_CHURN
+ */
+void sitestats_report(struct sitestats *t, int fd, size_t n, int order)
+{
+	struct sitestats_info *list;
+	size_t count, i;
+	int j;
+
+	list = malloc((SITESTATS_SLOTS + 1) * sizeof(*list));
+	if (!list)
+	{
+		return;
+	}
+	count = sitestats_list(t, list, SITESTATS_SLOTS + 1);
+	qsort(list, count, sizeof(*list),
+	      order == SITESTATS_ORDER_CHURN ? sitestats_cmp_churn : sitestats_cmp_live);
+	if (n == 0 || n > count)
+	{
+		n = count;
+	}
+
+	dprintf(fd, "%12s %12s %10s %10s %14s  %s\n",
+	        "live bytes", "peak bytes", "allocs", "frees", "churn bytes", "site");
+	for (i = 0; i < n; i++)
+	{
+		struct sitestats_info *info = &list[i];
+		if (info->file == sitestats_other_file)
+		{
+			dprintf(fd, "%12lld %12lld %10llu %10llu %14llu  %s\n",
+			        (long long)info->live_bytes, (long long)info->peak_bytes,
+			        (unsigned long long)info->allocs, (unsigned long long)info->frees,
+			        (unsigned long long)info->bytes, info->file);
+		}
+		else if (info->file)
+		{
+			dprintf(fd, "%12lld %12lld %10llu %10llu %14llu  %s:%lu\n",
+			        (long long)info->live_bytes, (long long)info->peak_bytes,
+			        (unsigned long long)info->allocs, (unsigned long long)info->frees,
+			        (unsigned long long)info->bytes, info->file, (unsigned long)info->line);
+		}
+		else
+		{
+			dprintf(fd, "%12lld %12lld %10llu %10llu %14llu  0x%lx\n",
+			        (long long)info->live_bytes, (long long)info->peak_bytes,
+			        (unsigned long long)info->allocs, (unsigned long long)info->frees,
+			        (unsigned long long)info->bytes, (unsigned long)info->line);
+		}
+		dprintf(fd, "%12s sizes:", "");
+		for (j = 0; j < SITESTATS_BUCKETS; j++)
+		{
+			if (info->hist[j])
+			{
+				dprintf(fd, " <%llu:%llu", 1ull << j, (unsigned long long)info->hist[j]);
+			}
+		}
+		dprintf(fd, "\n");
+	}
+
+	free(list);
+}
+
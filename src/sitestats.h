@@ -0,0 +1,114 @@
+/*
+ * DDebuglib
+ *
+ * Per allocation site memory statistics.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef SITESTATS_H
+#define SITESTATS_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum number of sites in one table, power of two. */
+#define SITESTATS_SLOTS 4096
+
+/**
+ * Maximum number of slots looked at when finding site. Sites that do not
+ * fit are counted together into one other site, see sitestats_other().
+ */
+#define SITESTATS_PROBE 32
+
+/** Number of counter shards per site, power of two. */
+#define SITESTATS_SHARDS 8
+
+/** Number of size histogram buckets, bucket n holds sizes < 2^n. */
+#define SITESTATS_BUCKETS 32
+
+/**
+ * Live byte changes are collected in shards and moved into site totals
+ * in batches of this many bytes, so peak is exact within
+ * SITESTATS_SHARDS * SITESTATS_BATCH bytes.
+ */
+#define SITESTATS_BATCH 65536
+
+/** Report ordering. */
+enum {
+	SITESTATS_ORDER_LIVE = 0,
+	SITESTATS_ORDER_CHURN,
+};
+
+/** Counters of one shard, each on its own cache line. */
+struct sitestats_shard
+{
+	int64_t live_delta;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	uint64_t hist[SITESTATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+/** One allocation site. */
+struct sitestats_site
+{
+	const char *file;
+	uintptr_t line;
+	int64_t live;
+	int64_t peak;
+	struct sitestats_shard shards[SITESTATS_SHARDS];
+};
+
+/** Merged statistics of one site. */
+struct sitestats_info
+{
+	const char *file;
+	uintptr_t line;
+	int64_t live_bytes;
+	int64_t live_count;
+	int64_t peak_bytes;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	uint64_t hist[SITESTATS_BUCKETS];
+};
+
+/**
+ * Site table. All zero is a valid empty table. Sites are never removed.
+ * Site key is file and line, line may also be any other integer such as
+ * a return address when file is NULL.
+ */
+struct sitestats
+{
+	struct sitestats_site *sites[SITESTATS_SLOTS];
+	unsigned int count;
+	/** Sites that did not fit into table. */
+	struct sitestats_site *other;
+};
+
+/** File of other site, see SITESTATS_PROBE. */
+extern const char sitestats_other_file[];
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+struct sitestats_site *sitestats_get(struct sitestats *, const char *, uintptr_t);
+struct sitestats_site *sitestats_find(struct sitestats *, const char *, uintptr_t);
+void sitestats_alloc(struct sitestats *, const char *, uintptr_t, size_t);
+void sitestats_free(struct sitestats *, const char *, uintptr_t, size_t);
+void sitestats_merge(struct sitestats_site *, struct sitestats_info *);
+size_t sitestats_list(struct sitestats *, struct sitestats_info *, size_t);
+void sitestats_report(struct sitestats *, int, size_t, int);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
@@ -0,0 +1,382 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <string.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "stacktab.h"
+#include "synchro.h"
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/*
+ * Lookups are lock-free: stacks are written before their id is published
+ * into hash slot and they are never moved or removed. Lock is taken only
+ * when a new stack is inserted. All memory comes from mmap() so that the
+ * table can be used from inside malloc() replacements.
+ */
+
+/******************************************************************************/
+static void *stacktab_map(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+/******************************************************************************/
+static uint32_t stacktab_hash(void *const *frames, int depth)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int i;
+
+	for (i = 0; i < depth; i++)
+	{
+		h ^= (uint64_t)(uintptr_t)frames[i];
+		h *= 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+
+/******************************************************************************/
+static __inline__ struct stacktab_stack *stacktab_stack(struct stacktab *t, uint32_t id)
+{
+	struct stacktab_stack **block;
+
+	id--;
+	block = __atomic_load_n(&t->dir[id / STACKTAB_DIR_BLOCK], __ATOMIC_ACQUIRE);
+	return block ? __atomic_load_n(&block[id % STACKTAB_DIR_BLOCK], __ATOMIC_ACQUIRE) : NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Search stack from table.
+ *
+ * @param slot set to the slot where search ended
+ * @return id of stack or 0 if not found
+ */
+static uint32_t stacktab_lookup(struct stacktab *t, uint32_t *slots, uint32_t hash,
+                                void *const *frames, int depth, uint32_t *slot)
+{
+	struct stacktab_stack *s;
+	uint32_t i = hash, id;
+
+	for (;; i++)
+	{
+		i &= STACKTAB_SLOTS - 1;
+		id = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+		if (id == 0)
+		{
+			break;
+		}
+		s = stacktab_stack(t, id);
+		if (s && s->hash == hash && s->depth == (uint32_t)depth &&
+		    memcmp(s->frames, frames, depth * sizeof(void *)) == 0)
+		{
+			break;
+		}
+	}
+
+	*slot = i;
+	return id;
+}
+
+
+/******************************************************************************/
+/**
+ * Insert new stack. Table must be locked.
+ *
+ * @return id of stack or 0 if table is full or out of memory
+ */
+static uint32_t stacktab_insert(struct stacktab *t, uint32_t hash, void *const *frames,
+                                int depth, uint32_t slot)
+{
+	struct stacktab_stack *s, **block;
+	size_t size = sizeof(*s) + depth * sizeof(void *);
+	uint32_t id = t->count;
+
+	if (t->count >= STACKTAB_SLOTS / 4 * 3)
+	{
+		return 0;
+	}
+	block = t->dir[id / STACKTAB_DIR_BLOCK];
+	if (!block)
+	{
+		block = stacktab_map(STACKTAB_DIR_BLOCK * sizeof(*block));
+		if (!block)
+		{
+			return 0;
+		}
+		__atomic_store_n(&t->dir[id / STACKTAB_DIR_BLOCK], block, __ATOMIC_RELEASE);
+	}
+	if (t->chunk_left < size)
+	{
+		t->chunk = stacktab_map(STACKTAB_CHUNK);
+		if (!t->chunk)
+		{
+			t->chunk_left = 0;
+			return 0;
+		}
+		t->chunk_left = STACKTAB_CHUNK;
+	}
+
+	s = (struct stacktab_stack *)t->chunk;
+	t->chunk += size;
+	t->chunk_left -= size;
+	s->hash = hash;
+	s->depth = depth;
+	memcpy(s->frames, frames, depth * sizeof(void *));
+
+	__atomic_store_n(&block[id % STACKTAB_DIR_BLOCK], s, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->count, id + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->slots[slot], id + 1, __ATOMIC_RELEASE);
+
+	return id + 1;
+}
+
+
+/******************************************************************************/
+/**
+ * Get stack into frames using backtrace().
+ *
+ * @param frames where to store return addresses
+ * @param max size of frames
+ * @param skip number of callers to skip, this function is always skipped
+ * @return number of frames stored
+ */
+__attribute__((noinline)) int stacktab_backtrace(void **frames, int max, int skip)
+{
+	void *tmp[STACKTAB_DEPTH + 16];
+	int n;
+
+	skip++;
+	if (max > STACKTAB_DEPTH) max = STACKTAB_DEPTH;
+	if (skip > 16) skip = 16;
+	n = backtrace(tmp, max + skip) - skip;
+	if (n <= 0)
+	{
+		return 0;
+	}
+	memcpy(frames, tmp + skip, n * sizeof(void *));
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Read one word of memory without faulting on bad addresses. Frame
+ * pointers of code built without them may point anywhere.
+ */
+static int stacktab_peek(uintptr_t addr, uintptr_t *value)
+{
+	struct iovec local = { value, sizeof(*value) };
+	struct iovec remote = { (void *)addr, sizeof(*value) };
+
+	return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == sizeof(*value) ? 0 : -1;
+}
+
+
+/******************************************************************************/
+/**
+ * Get stack of code interrupted by signal by walking frame pointers.
+ * Unlike stacktab_backtrace(), this is async-signal-safe: memory is read
+ * only through a system call and nothing is locked or allocated. Code
+ * built without frame pointers gives short stacks.
+ *
+ * @param uc context given to SA_SIGINFO handler
+ * @param frames where to store addresses, first is interrupted instruction
+ * @param max size of frames
+ * @return number of frames stored
+ */
+int stacktab_walk(void *uc, void **frames, int max)
+{
+	ucontext_t *ctx = uc;
+	uintptr_t pc = 0, fp = 0, sp = 0, next, ret;
+	int n = 0;
+
+#if defined(__x86_64__)
+	pc = ctx->uc_mcontext.gregs[REG_RIP];
+	fp = ctx->uc_mcontext.gregs[REG_RBP];
+	sp = ctx->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	pc = ctx->uc_mcontext.pc;
+	fp = ctx->uc_mcontext.regs[29];
+	sp = ctx->uc_mcontext.sp;
+#else
+	(void)ctx;
+#endif
+	if (pc && n < max)
+	{
+		frames[n++] = (void *)pc;
+	}
+	/* Frames grow upwards from stack pointer, each frame is [next fp, return address]. */
+	while (n < max && fp >= sp && (fp & (sizeof(void *) - 1)) == 0)
+	{
+		if (stacktab_peek(fp, &next) || stacktab_peek(fp + sizeof(void *), &ret) || !ret)
+		{
+			break;
+		}
+		frames[n++] = (void *)ret;
+		if (next <= fp)
+		{
+			break;
+		}
+		fp = next;
+	}
+
+	return n;
+}
+
+
+/******************************************************************************/
+/**
+ * Intern stack into table. Same stack always gets same id.
+ *
+ * @return id of stack, 0 if table is full or out of memory
+ */
+uint32_t stacktab_intern(struct stacktab *t, void *const *frames, int depth)
+{
+	uint32_t hash, id, slot, *slots;
+
+	if (depth <= 0)
+	{
+		return 0;
+	}
+	if (depth > STACKTAB_DEPTH)
+	{
+		depth = STACKTAB_DEPTH;
+	}
+	hash = stacktab_hash(frames, depth);
+
+	slots = __atomic_load_n(&t->slots, __ATOMIC_ACQUIRE);
+	if (slots)
+	{
+		id = stacktab_lookup(t, slots, hash, frames, depth, &slot);
+		if (id)
+		{
+			return id;
+		}
+	}
+
+	dd_spin_lock(&t->lock);
+	if (!t->slots)
+	{
+		slots = stacktab_map(STACKTAB_SLOTS * sizeof(*slots));
+		if (!slots)
+		{
+			dd_spin_unlock(&t->lock);
+			return 0;
+		}
+		__atomic_store_n(&t->slots, slots, __ATOMIC_RELEASE);
+	}
+	/* Search again, someone might have inserted same stack. */
+	id = stacktab_lookup(t, t->slots, hash, frames, depth, &slot);
+	if (!id)
+	{
+		id = stacktab_insert(t, hash, frames, depth, slot);
+	}
+	dd_spin_unlock(&t->lock);
+
+	return id;
+}
+
+
+/******************************************************************************/
+/**
+ * Capture call stack of caller and intern it.
+ *
+ * @param depth maximum number of frames
+ * @param skip number of callers to skip
+ * @return id of stack, 0 on errors
+ */
+__attribute__((noinline)) uint32_t stacktab_capture(struct stacktab *t, int depth, int skip)
+{
+	void *frames[STACKTAB_DEPTH];
+	int n;
+
+	if (depth > STACKTAB_DEPTH) depth = STACKTAB_DEPTH;
+	n = stacktab_backtrace(frames, depth, skip + 1);
+
+	return stacktab_intern(t, frames, n);
+}
+
+
+/******************************************************************************/
+/**
+ * Get frames of stack.
+ *
+ * @param frames set to point to frames of stack
+ * @return depth of stack, 0 if not found
+ */
+int stacktab_get(struct stacktab *t, uint32_t id, void *const **frames)
+{
+	struct stacktab_stack *s;
+
+	if (id == 0 || id > __atomic_load_n(&t->count, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	s = stacktab_stack(t, id);
+	if (!s)
+	{
+		return 0;
+	}
+	*frames = s->frames;
+
+	return s->depth;
+}
+
+
+/******************************************************************************/
+/**
+ * Print symbolized stack into file descriptor, one frame per line.
+ */
+void stacktab_print(struct stacktab *t, uint32_t id, int fd)
+{
+	void *const *frames;
+	int depth = stacktab_get(t, id, &frames);
+
+	if (depth > 0)
+	{
+		backtrace_symbols_fd((void **)frames, depth, fd);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Lock table against inserts, for example before fork().
+ */
+void stacktab_lock_all(struct stacktab *t)
+{
+	dd_spin_lock(&t->lock);
+}
+
+
+/******************************************************************************/
+/**
+ * Unlock table locked with stacktab_lock_all().
+ */
+void stacktab_unlock_all(struct stacktab *t)
+{
+	dd_spin_unlock(&t->lock);
+}
+
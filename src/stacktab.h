@@ -0,0 +1,71 @@
+/*
+ * DDebuglib
+ *
+ * Call stack capture and table of deduplicated stacks.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef STACKTAB_H
+#define STACKTAB_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stddef.h>
+#include <stdint.h>
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Maximum depth of one stack. */
+#define STACKTAB_DEPTH 64
+
+/** Number of hash slots in table, power of two. Table holds 3/4 of this. */
+#define STACKTAB_SLOTS (1 << 18)
+
+/** Number of stacks in one id directory block. */
+#define STACKTAB_DIR_BLOCK 4096
+
+/** Size of one stack storage chunk. */
+#define STACKTAB_CHUNK (1024 * 1024)
+
+/** One interned stack. */
+struct stacktab_stack
+{
+	uint32_t hash;
+	uint32_t depth;
+	void *frames[];
+};
+
+/**
+ * Stack table. All zero is a valid empty table. Stacks are never removed,
+ * so stack ids stay valid for the lifetime of the table.
+ */
+struct stacktab
+{
+	int lock;
+	uint32_t count;
+	uint32_t *slots;
+	char *chunk;
+	size_t chunk_left;
+	struct stacktab_stack **dir[(STACKTAB_SLOTS / 4 * 3) / STACKTAB_DIR_BLOCK + 1];
+};
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int stacktab_backtrace(void **, int, int);
+int stacktab_walk(void *, void **, int);
+uint32_t stacktab_intern(struct stacktab *, void *const *, int);
+uint32_t stacktab_capture(struct stacktab *, int, int);
+int stacktab_get(struct stacktab *, uint32_t, void *const **);
+void stacktab_print(struct stacktab *, uint32_t, int);
+void stacktab_lock_all(struct stacktab *);
+void stacktab_unlock_all(struct stacktab *);
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+
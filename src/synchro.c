@@ -7,12 +7,68 @@
 
 /******************************************************************************/
 /* INCLUDES */
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
 #include "synchro.h"
+#include "metrics.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/** Metrics are registered only once. */
+static pthread_once_t synchro_metrics_once = PTHREAD_ONCE_INIT;
+static int synchro_lock_contended = -1;
+static int synchro_lock_wait = -1;
+static int synchro_sem_timeouts = -1;
+
+/** Spins before sleeping, zero on single processor where nobody can post meanwhile. */
+static int synchro_sem_spin = -1;
 
 
 /******************************************************************************/
 /* FUNCTIONS */
 
+/******************************************************************************/
+static void synchro_metrics_register(void)
+{
+	synchro_lock_contended = dd_metric_counter("dd_lock_contended_total", NULL,
+	                                           "Locks that were already locked by another thread.");
+	synchro_lock_wait = dd_metric_histogram("dd_lock_wait_nanoseconds", NULL,
+	                                        "Time waited for contended locks.", 0);
+	synchro_sem_timeouts = dd_metric_counter("dd_semaphore_timeouts_total", NULL,
+	                                         "Semaphore waits that timed out.");
+}
+
+
+/******************************************************************************/
+/**
+	Lock mutex. Try first without waiting, so contended locks can be
+	counted and their waiting time measured.
+*/
+static int synchro_lock(lock_t *lock_var)
+{
+	uint64_t start;
+	int err;
+
+	err = pthread_mutex_trylock(lock_var);
+	if (err != EBUSY)
+	{
+		return err;
+	}
+
+	pthread_once(&synchro_metrics_once, synchro_metrics_register);
+	start = dd_clock_ticks();
+	err = pthread_mutex_lock(lock_var);
+	dd_counter_inc(synchro_lock_contended);
+	dd_metric_observe(synchro_lock_wait, dd_clock_ns(dd_clock_ticks() - start));
+
+	return err;
+}
+
 /******************************************************************************/
 /** Get ticks (milliseconds) from program start. */
 long get_ticks(void)
@@ -26,36 +82,117 @@ long get_ticks(void)
 };
 
 
+/******************************************************************************/
+/**
+	Wait for semaphore after fast path failed. Spins for a while first,
+	then sleeps in kernel until value is posted or deadline passes.
+
+	@param deadline absolute CLOCK_MONOTONIC time, NULL to wait forever
+	@return 0 on success, 1 on timeout
+*/
+int dd_sem_wait_slow(struct dd_sem *s, const struct timespec *deadline)
+{
+	int i, spin = __atomic_load_n(&synchro_sem_spin, __ATOMIC_RELAXED);
+
+	if (spin < 0)
+	{
+		spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? DD_SEM_SPIN : 0;
+		__atomic_store_n(&synchro_sem_spin, spin, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < spin; i++)
+	{
+		if (dd_sem_trywait(s) == 0)
+		{
+			return 0;
+		}
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+		__builtin_ia32_pause();
+#endif
+	}
+
+	/* Poster sees waiters or this sees posted value, both are sequentially consistent. */
+	__atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	while (dd_sem_trywait(s) != 0)
+	{
+		/* Kernel sleeps only if value is still zero. Bitset wait takes absolute time. */
+		if (syscall(SYS_futex, &s->value, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+		            0, deadline, NULL, FUTEX_BITSET_MATCH_ANY) && errno == ETIMEDOUT)
+		{
+			if (dd_sem_trywait(s) == 0)
+			{
+				break;
+			}
+			__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_once(&synchro_metrics_once, synchro_metrics_register);
+			dd_counter_inc(synchro_sem_timeouts);
+			return 1;
+		}
+	}
+	__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+	Wake one thread sleeping in dd_sem_wait_slow().
+*/
+void dd_sem_wake(struct dd_sem *s)
+{
+	syscall(SYS_futex, &s->value, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+}
+
+
+/******************************************************************************/
+/**
+	Decrease semaphore value, wait at most given time.
+
+	@param timeout milliseconds
+	@return 0 on success, 1 on timeout
+*/
+int dd_sem_timedwait(struct dd_sem *s, unsigned long timeout)
+{
+	struct timespec deadline;
+
+	if (dd_sem_trywait(s) == 0)
+	{
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000000l;
+	if (deadline.tv_nsec >= 1000000000l)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000l;
+	}
+
+	return dd_sem_wait_slow(s, &deadline);
+}
+
+
 /******************************************************************************/
 /**
 	Creates new semaphore with given start value.
 	Semaphores are not shared within processes, when
-	created in here.
+	created in here. Use struct dd_sem directly to
+	avoid allocation.
 */
 semt semt_create(int n)
 {
-	sem_t *hsem;
-	int err;
+	struct dd_sem *hsem;
 
-	/*
-		Little things to do for creating semaphore...
-		First allocate memory, then initialize semaphore,
-		but remember to release semaphore memory after
-		semaphore destroy.
-		Check errors too.
-	*/
-	hsem = (semt)malloc(sizeof(sem_t)); // rec_malloc(sizeof(sem_t));
-	if (!hsem)
+	if (n < 0)
 	{
 		return (SEM_ERROR);
 	}
-	
-	err = sem_init(hsem, 0, n);
-	if (err)
+	hsem = (semt)malloc(sizeof(*hsem));
+	if (!hsem)
 	{
-		free(hsem); // rec_mfree(hsem);
 		return (SEM_ERROR);
 	}
+	dd_sem_init(hsem, (unsigned int)n);
 
 	rec_alloc("semaphore", hsem);
 
@@ -63,19 +200,13 @@ semt semt_create(int n)
 }
 
 
-
 /******************************************************************************/
 /**
 	Decrease semaphore value.
 */
 int semt_wait(semt hsem)
 {
-	int err = 0;
-
-	/* Try locking semaphore. */
-	err = sem_wait(hsem);
-	
-	return err;
+	return dd_sem_wait(hsem);
 }
 
 
@@ -84,27 +215,11 @@ int semt_wait(semt hsem)
 	Decrease semaphore value with timeout.
 	
 	@return 0 on success,
-	        1 on timeout,
-	        -1 on errors.
+	        1 on timeout.
 */
 int semt_wait_timeout(semt hsem, unsigned long timeout)
 {
-	int err = -1;
-	long start;
-	
-	/* Wait for semaphore. */
-	start = get_ticks();
-	while ((err = sem_trywait(hsem)) != 0)
-	{
-		if (get_ticks() > (start + timeout))
-		{
-			err = -1;
-			break;
-		}
-		usleep(1000);
-	}
-
-	return err;
+	return dd_sem_timedwait(hsem, timeout);
 }
 
 
@@ -114,10 +229,7 @@ int semt_wait_timeout(semt hsem, unsigned long timeout)
 */
 int semt_post(semt hsem)
 {
-//	int err = 0;
-
-	/* Increase value. */
-	sem_post(hsem);
+	dd_sem_post(hsem);
 	
 	return 0;
 }
@@ -130,10 +242,9 @@ int semt_post(semt hsem)
 */
 void semt_free(semt hsem)
 {
-	/* Destroy semaphore and free memory allocated for it. */
-	sem_destroy(hsem);
-	free(hsem); // rec_mfree(hsem);
+	/* Forget address before releasing it, malloc may hand it out again at once. */
 	rec_free("semaphore", hsem);
+	free(hsem);
 }
 
 
@@ -181,7 +292,7 @@ int lock_read(lock_t *lock_var)
 {
 	int err = 0;
 
-	err = pthread_mutex_lock(lock_var);
+	err = synchro_lock(lock_var);
 // 	err = pthread_rwlock_rdlock(lock_var);
 
 out_err:
@@ -197,7 +308,7 @@ int lock_write(lock_t *lock_var)
 {
 	int err = 0;
 
-	err = pthread_mutex_lock(lock_var);
+	err = synchro_lock(lock_var);
 // 	err = pthread_rwlock_wrlock(lock_var);
 
 out_err:
@@ -15,13 +15,36 @@
 /******************************************************************************/
 /* INCLUDES */
 #include <stdlib.h>
-#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 
 #include "debug.h"
 
-#define semt sem_t *
+/** How many times waiting spins before it sleeps in kernel, on multiprocessors. */
+#define DD_SEM_SPIN 100
+
+/** How many times spinlock spins before it yields processor. */
+#define DD_SPIN_YIELD 100
+
+/**
+ * Semaphore that lives where it is declared, no allocation needed.
+ * Value is changed in userspace, kernel futex is used only when a thread
+ * has to sleep, and posting makes a system call only when someone sleeps.
+ */
+struct dd_sem
+{
+	uint32_t value;
+	/** Number of threads sleeping or about to sleep in kernel. */
+	uint32_t waiters;
+};
+
+/** Static initializer, same as dd_sem_init(). */
+#define DD_SEM_INITIALIZER(n) { (n), 0 }
+
+#define semt struct dd_sem *
 #define SEM_ERROR NULL
 #define lock_t pthread_mutex_t
 //#define lock_t pthread_rwlock_t
@@ -50,6 +73,10 @@ do { \
 /* FUNCTION DEFINITIONS */
 long get_ticks(void);
 
+int dd_sem_wait_slow(struct dd_sem *, const struct timespec *);
+void dd_sem_wake(struct dd_sem *);
+int dd_sem_timedwait(struct dd_sem *, unsigned long);
+
 semt semt_create(int);
 int semt_wait(semt);
 int semt_wait_timeout(semt, unsigned long);
@@ -62,6 +89,95 @@ int lock_read(lock_t *);
 int lock_write(lock_t *);
 int lock_unlock(lock_t *);
 
+/**
+ * Take spinlock, integer that is zero when unlocked. For short critical
+ * sections only, waiter yields after DD_SPIN_YIELD spins because the
+ * holder may have been preempted.
+ */
+static __inline__ void dd_spin_lock(int *lock)
+{
+	int spins = 0;
+
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+		{
+			if (++spins > DD_SPIN_YIELD)
+			{
+				sched_yield();
+				spins = 0;
+			}
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+}
+
+/**
+ * Release spinlock taken with dd_spin_lock().
+ */
+static __inline__ void dd_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Initialize semaphore with given value.
+ */
+static __inline__ void dd_sem_init(struct dd_sem *s, unsigned int n)
+{
+	s->value = n;
+	s->waiters = 0;
+}
+
+/**
+ * Decrease semaphore value if it is not zero.
+ *
+ * @return 0 on success, -1 if value was zero
+ */
+static __inline__ int dd_sem_trywait(struct dd_sem *s)
+{
+	uint32_t v = __atomic_load_n(&s->value, __ATOMIC_SEQ_CST);
+
+	while (v > 0)
+	{
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 1,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Decrease semaphore value, wait until it is not zero.
+ *
+ * @return 0 on success
+ */
+static __inline__ int dd_sem_wait(struct dd_sem *s)
+{
+	if (__builtin_expect(dd_sem_trywait(s) == 0, 1))
+	{
+		return 0;
+	}
+	return dd_sem_wait_slow(s, NULL);
+}
+
+/**
+ * Increase semaphore value and wake one waiter if there are any.
+ */
+static __inline__ void dd_sem_post(struct dd_sem *s)
+{
+	__atomic_add_fetch(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+	{
+		dd_sem_wake(s);
+	}
+}
+
 
 #endif /* END OF HEADER FILE */
 /******************************************************************************/
@@ -0,0 +1,434 @@
+/*
+ * DDebuglib
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+
+#include "watchdog.h"
+#include "ddthread.h"
+#include "dlog.h"
+#include "metrics.h"
+#include "stacktab.h"
+
+
+/******************************************************************************/
+/* VARIABLES */
+
+/** Watch states, index is id in thread registry minus one. */
+static struct dd_watch dd_watches[DD_THREAD_MAX];
+__thread struct dd_watch *dd_watch_self = NULL;
+
+/** Removes watch of exiting thread. */
+static pthread_once_t dd_watchdog_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dd_watchdog_key;
+
+/**
+ * Stack of stalled thread, written by its signal handler. Each request has
+ * a sequence number that is sent with the signal. Handler claims the
+ * request by clearing it, so a late answer to an earlier request that the
+ * monitor already gave up on is ignored.
+ */
+static void *dd_watchdog_frames[DD_WATCHDOG_DEPTH];
+static int dd_watchdog_depth = 0;
+static unsigned int dd_watchdog_request = 0;
+static unsigned int dd_watchdog_seq = 0;
+
+/** Copy of flight recorder, used only by the monitor. */
+static struct dlog_flight_entry dd_watchdog_flight[DLOG_FLIGHT];
+
+/** Stalls found. */
+static int dd_watchdog_metric = -1;
+
+/** Monitor thread. */
+static pthread_t dd_watchdog_monitor;
+static pthread_mutex_t dd_watchdog_monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dd_watchdog_monitor_cond;
+static int dd_watchdog_run = 0;
+static unsigned int dd_watchdog_period = 0;
+
+
+/******************************************************************************/
+/* FUNCTIONS */
+
+/******************************************************************************/
+static void dd_watchdog_exit(void *arg)
+{
+	(void)arg;
+	/* Usually already done by dd_thread_unregister(), before id is freed. */
+	dd_watchdog_unwatch();
+}
+
+
+/******************************************************************************/
+/**
+ * Only the thread that called fork() exists in the child. Watches of other
+ * threads are removed and the monitor is forgotten, it does not exist in
+ * the child either.
+ */
+static void dd_watchdog_atfork_child(void)
+{
+	pthread_mutex_t init = PTHREAD_MUTEX_INITIALIZER;
+	int i;
+
+	for (i = 0; i < DD_THREAD_MAX; i++)
+	{
+		if (&dd_watches[i] != dd_watch_self)
+		{
+			dd_watches[i].limit = 0;
+		}
+	}
+	if (dd_watch_self)
+	{
+		dd_watch_self->tid = dd_gettid();
+	}
+	dd_watchdog_run = 0;
+	dd_watchdog_monitor_lock = init;
+}
+
+
+/******************************************************************************/
+/**
+ * Take stack of interrupted thread for the monitor, by walking frame
+ * pointers since only async-signal-safe calls are allowed here.
+ */
+static void dd_watchdog_handler(int sig, siginfo_t *info, void *ctx)
+{
+	int saved = errno, depth;
+	unsigned int seq;
+	(void)sig;
+
+	if (info->si_code != SI_QUEUE)
+	{
+		return;
+	}
+	seq = (unsigned int)info->si_value.sival_int;
+	if (!__atomic_compare_exchange_n(&dd_watchdog_request, &seq, 0, 0,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		/* Answer to request that monitor already gave up on. */
+		return;
+	}
+	depth = stacktab_walk(ctx, dd_watchdog_frames, DD_WATCHDOG_DEPTH);
+	__atomic_store_n(&dd_watchdog_depth, depth > 0 ? depth : -1, __ATOMIC_RELEASE);
+	errno = saved;
+}
+
+
+/******************************************************************************/
+static void dd_watchdog_setup(void)
+{
+	struct sigaction sa;
+
+	pthread_key_create(&dd_watchdog_key, dd_watchdog_exit);
+	pthread_atfork(NULL, NULL, dd_watchdog_atfork_child);
+	/* Watch is indexed by id, new owner of the id would lose its watch. */
+	__atomic_store_n(&dd_thread_unregister_hook, dd_watchdog_unwatch, __ATOMIC_RELEASE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = dd_watchdog_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(DD_WATCHDOG_SIGNAL, &sa, NULL);
+
+	dd_watchdog_metric = dd_metric_counter("dd_watchdog_stalls_total", "",
+	                                       "Stalls of watched threads found by watchdog.");
+}
+
+
+/******************************************************************************/
+/**
+ * Log stack of stalled thread. Monitor waits a moment for the thread to
+ * answer, thread that is stuck in kernel answers only when it returns.
+ */
+static void dd_watchdog_log_stack(pid_t tid)
+{
+	char **symbols;
+	int i, depth = 0, waited;
+	unsigned int seq;
+	siginfo_t si;
+	struct timespec ts = { 0, 1000000l };
+
+	/* Zero means no request. */
+	if (++dd_watchdog_seq == 0)
+	{
+		dd_watchdog_seq = 1;
+	}
+	seq = dd_watchdog_seq;
+
+	memset(&si, 0, sizeof(si));
+	si.si_signo = DD_WATCHDOG_SIGNAL;
+	si.si_code = SI_QUEUE;
+	si.si_pid = getpid();
+	si.si_uid = getuid();
+	si.si_value.sival_int = (int)seq;
+
+	__atomic_store_n(&dd_watchdog_depth, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dd_watchdog_request, seq, __ATOMIC_RELEASE);
+	if (syscall(SYS_rt_tgsigqueueinfo, (int)getpid(), (int)tid, DD_WATCHDOG_SIGNAL, &si))
+	{
+		DLog_w("watchdog: could not signal thread: %s", strerror(errno));
+		__atomic_store_n(&dd_watchdog_request, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	for (waited = 0; waited < DD_WATCHDOG_SIGNAL_WAIT; waited++)
+	{
+		depth = __atomic_load_n(&dd_watchdog_depth, __ATOMIC_ACQUIRE);
+		if (depth != 0)
+		{
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+	if (depth == 0 && !__atomic_compare_exchange_n(&dd_watchdog_request, &seq, 0, 0,
+	                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		/* Handler claimed request just now and is writing, it will not take long. */
+		while ((depth = __atomic_load_n(&dd_watchdog_depth, __ATOMIC_ACQUIRE)) == 0)
+		{
+			nanosleep(&ts, NULL);
+		}
+	}
+	if (depth <= 0)
+	{
+		DLog_w("watchdog: thread did not answer, no stack");
+		return;
+	}
+
+	symbols = backtrace_symbols(dd_watchdog_frames, depth);
+	for (i = 0; i < depth; i++)
+	{
+		DLog_w("watchdog:   #%d %s", i, symbols ? symbols[i] : "?");
+	}
+	free(symbols);
+}
+
+
+/******************************************************************************/
+/**
+ * Log flight recorder copied at the time stall was found.
+ */
+static void dd_watchdog_log_flight(int n, uint64_t now)
+{
+	static const char *levels[] = { "", "ERROR: ", "WARNING: ", "INFO: ", "DEBUG: " };
+	struct dlog_flight_entry *e;
+	int i;
+
+	DLog_w("watchdog: last %d log messages:", n);
+	for (i = 0; i < n; i++)
+	{
+		e = &dd_watchdog_flight[i];
+		DLog_w("watchdog:   %9.3f ms [%s:%d] %s%s", -(double)(int64_t)(now - e->time) / 1e6,
+		       dd_thread_name(e->thread), e->thread,
+		       levels[e->level >= 0 && e->level < 5 ? e->level : 0], e->message);
+	}
+}
+
+
+/******************************************************************************/
+/**
+ * Check heartbeats of all watched threads.
+ */
+static void dd_watchdog_check(void)
+{
+	struct dd_watch *w;
+	uint64_t beat, reported, now, age;
+	int i, n;
+
+	for (i = 0; i < DD_THREAD_MAX; i++)
+	{
+		w = &dd_watches[i];
+		if (!__atomic_load_n(&w->limit, __ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+		/* Heartbeat first, so that it is never newer than now. */
+		beat = __atomic_load_n(&w->beat, __ATOMIC_RELAXED);
+		now = dd_clock_ticks();
+		age = dd_clock_ns(now - beat);
+		reported = w->reported;
+
+		if (reported && beat != reported)
+		{
+			DLog_i("watchdog: thread %s:%d recovered after %.1f ms",
+			       dd_thread_name(i + 1), i + 1, (double)dd_clock_ns(beat - reported) / 1e6);
+			w->reported = 0;
+		}
+		if (age <= w->limit || beat == w->reported)
+		{
+			continue;
+		}
+		/* Thread may have exited and its id may be in use already. */
+		if (__atomic_load_n(&dd_threads[i].state, __ATOMIC_ACQUIRE) != DD_THREAD_LIVE ||
+		    dd_threads[i].tid != w->tid)
+		{
+			continue;
+		}
+
+		w->reported = beat;
+		dd_counter_inc(dd_watchdog_metric);
+		n = DLog_flight_get(dd_watchdog_flight, DLOG_FLIGHT);
+		DLog_w("watchdog: thread %s:%d (tid %d) stalled, no heartbeat for %.1f ms",
+		       dd_thread_name(i + 1), i + 1, (int)w->tid, (double)age / 1e6);
+		dd_watchdog_log_stack(w->tid);
+		dd_watchdog_log_flight(n, dd_clock_ns(now));
+	}
+}
+
+
+/******************************************************************************/
+static void *dd_watchdog_monitor_thread(void *arg)
+{
+	struct timespec ts;
+	unsigned int period = dd_watchdog_period;
+	(void)arg;
+
+	dd_thread_register("dd_watchdog");
+	pthread_mutex_lock(&dd_watchdog_monitor_lock);
+	while (dd_watchdog_run)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += period / 1000;
+		ts.tv_nsec += (long)(period % 1000) * 1000000l;
+		if (ts.tv_nsec >= 1000000000l)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000l;
+		}
+		if (pthread_cond_timedwait(&dd_watchdog_monitor_cond, &dd_watchdog_monitor_lock, &ts) == 0)
+		{
+			continue;
+		}
+		pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+		dd_watchdog_check();
+		pthread_mutex_lock(&dd_watchdog_monitor_lock);
+	}
+	pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+
+	return NULL;
+}
+
+
+/******************************************************************************/
+/**
+ * Start monitor thread. Stall is found at most one period after limit of
+ * thread has passed.
+ *
+ * @param period milliseconds between checks, 0 for DD_WATCHDOG_PERIOD
+ * @return 0 on success, -1 on errors or if already started
+ */
+int dd_watchdog_start(unsigned int period)
+{
+	pthread_condattr_t attr;
+
+	pthread_once(&dd_watchdog_once, dd_watchdog_setup);
+	pthread_mutex_lock(&dd_watchdog_monitor_lock);
+	if (dd_watchdog_run)
+	{
+		pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+		return -1;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dd_watchdog_monitor_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	dd_watchdog_period = period > 0 ? period : DD_WATCHDOG_PERIOD;
+	dd_watchdog_run = 1;
+	if (pthread_create(&dd_watchdog_monitor, NULL, dd_watchdog_monitor_thread, NULL))
+	{
+		dd_watchdog_run = 0;
+		pthread_cond_destroy(&dd_watchdog_monitor_cond);
+		pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop monitor thread. Threads stay watched and can keep sending
+ * heartbeats.
+ */
+void dd_watchdog_stop(void)
+{
+	pthread_mutex_lock(&dd_watchdog_monitor_lock);
+	if (!dd_watchdog_run)
+	{
+		pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+		return;
+	}
+	dd_watchdog_run = 0;
+	pthread_cond_signal(&dd_watchdog_monitor_cond);
+	pthread_mutex_unlock(&dd_watchdog_monitor_lock);
+	pthread_join(dd_watchdog_monitor, NULL);
+	pthread_cond_destroy(&dd_watchdog_monitor_cond);
+}
+
+
+/******************************************************************************/
+/**
+ * Start watching calling thread, or change its limit. Thread has to call
+ * dd_watchdog_beat() more often than the limit. Watch is removed when the
+ * thread exits.
+ *
+ * @param limit milliseconds without heartbeat that is reported as stall
+ * @return 0 on success, -1 if thread could not be registered
+ */
+int dd_watchdog_watch(unsigned int limit)
+{
+	struct dd_watch *w;
+	int id;
+
+	pthread_once(&dd_watchdog_once, dd_watchdog_setup);
+	id = dd_thread_id();
+	if (id <= 0 || limit == 0)
+	{
+		return -1;
+	}
+
+	w = &dd_watches[id - 1];
+	w->tid = dd_gettid();
+	w->reported = 0;
+	__atomic_store_n(&w->beat, dd_clock_ticks(), __ATOMIC_RELAXED);
+	__atomic_store_n(&w->limit, (uint64_t)limit * 1000000ull, __ATOMIC_RELEASE);
+	dd_watch_self = w;
+	pthread_setspecific(dd_watchdog_key, w);
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/**
+ * Stop watching calling thread, for example before it blocks for long
+ * on purpose.
+ */
+void dd_watchdog_unwatch(void)
+{
+	struct dd_watch *w = dd_watch_self;
+
+	dd_watch_self = NULL;
+	if (!w)
+	{
+		return;
+	}
+	pthread_setspecific(dd_watchdog_key, NULL);
+	__atomic_store_n(&w->limit, 0, __ATOMIC_RELEASE);
+}
+
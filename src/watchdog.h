@@ -0,0 +1,86 @@
+/*
+ * DDebuglib
+ *
+ * Stall watchdog. Watched threads send heartbeats, which only store a
+ * timestamp. A monitor thread checks heartbeats periodically, and when a
+ * thread has been silent longer than its limit, takes stack of the thread
+ * with a signal and logs it with DLog together with the flight recorder.
+ *
+ * Signal interrupts the stalled thread, so a system call it is blocked
+ * in, such as nanosleep() or epoll_wait(), may return EINTR.
+ *
+ * License: MIT, see COPYING
+ * Authors: Antti Partanen <aehparta@iki.fi, duge at IRCnet>
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+/******************************************************************************/
+/* INCLUDES */
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "ddclock.h"
+
+
+/******************************************************************************/
+/* DEFINES */
+
+/** Default milliseconds between checks. */
+#define DD_WATCHDOG_PERIOD 50
+
+/** Signal used to take stack of stalled thread. */
+#define DD_WATCHDOG_SIGNAL (SIGRTMIN + 2)
+
+/** Maximum depth of stack of stalled thread. */
+#define DD_WATCHDOG_DEPTH 32
+
+/** How long to wait for stalled thread to answer signal, milliseconds. */
+#define DD_WATCHDOG_SIGNAL_WAIT 100
+
+/**
+ * Watch state of one thread, indexed by id in thread registry. Heartbeat
+ * is written by the thread, everything else by the monitor.
+ */
+struct dd_watch
+{
+	/** dd_clock_ticks() of last heartbeat. */
+	uint64_t beat;
+	/** Limit in nanoseconds, 0 when thread is not watched. */
+	uint64_t limit;
+	/** Heartbeat that was reported as stalled. */
+	uint64_t reported;
+	pid_t tid;
+} __attribute__((aligned(64)));
+
+
+/******************************************************************************/
+/* FUNCTION DEFINITIONS */
+int dd_watchdog_start(unsigned int);
+void dd_watchdog_stop(void);
+int dd_watchdog_watch(unsigned int);
+void dd_watchdog_unwatch(void);
+
+/** Watch state of calling thread, NULL when not watched. */
+extern __thread struct dd_watch *dd_watch_self;
+
+/**
+ * Send heartbeat from calling thread. Does nothing if thread is not
+ * watched.
+ */
+static __inline__ void dd_watchdog_beat(void)
+{
+	struct dd_watch *w = dd_watch_self;
+
+	if (w)
+	{
+		__atomic_store_n(&w->beat, dd_clock_ticks(), __ATOMIC_RELAXED);
+	}
+}
+
+
+#endif /* END OF HEADER FILE */
+/******************************************************************************/
+